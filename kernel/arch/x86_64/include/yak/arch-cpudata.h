@@ -6,9 +6,27 @@ extern "C" {
 
 #include <stdint.h>
 
+// few processes share a cpu at a time: more slots mostly cost lookups
+#define PCID_SLOTS 8
+
 struct cpu_md {
 	uint32_t apic_id;
+	// x2APIC logical id: cluster << 16 | 1 << (id & 15)
+	uint32_t apic_ldr;
 	uint64_t apic_ticks_per_ms;
+	// longest delta (ns) a one-shot count can express
+	uint64_t apic_max_delta;
+	// the lapic timer is in TSC-deadline mode
+	bool tsc_deadline;
+
+	// CR4.PCIDE is set
+	bool pcid;
+	// next slot to evict
+	uint8_t pcid_next;
+	// PCID n + 1 holds the entries of the pmap with id pcid_pmap[n],
+	// up to date as of its tlb_gen pcid_gen[n]. 0 is a free slot
+	uint64_t pcid_pmap[PCID_SLOTS];
+	uint64_t pcid_gen[PCID_SLOTS];
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,36 @@
+#pragma once
+
+// Layout of the vDSO data page. The kernel writes it, the vDSO in
+// arch/x86_64/vdso reads it from userspace, so keep this header free of
+// anything kernel-only.
+
+#include <stdint.h>
+
+enum {
+	// the clock can't be read from userspace: take the syscall
+	VDSO_CLOCK_NONE = 0,
+	VDSO_CLOCK_TSC,
+};
+
+enum {
+	VDSO_GETCPU_NONE = 0,
+	// IA32_TSC_AUX holds the cpu number
+	VDSO_GETCPU_RDTSCP,
+	VDSO_GETCPU_RDPID,
+};
+
+struct vdso_data {
+	// seqcount: odd while the kernel updates the clock fields below
+	uint32_t seq;
+	uint32_t clock_mode;
+	// same conversion as uptime():
+	// ns = base_ns + ((counter - base_cycles) * mult) >> shift
+	uint64_t base_cycles;
+	uint64_t base_ns;
+	uint32_t mult;
+	uint32_t shift;
+	// CLOCK_REALTIME = CLOCK_MONOTONIC + realtime_offset
+	uint64_t realtime_offset;
+
+	uint32_t getcpu_mode;
+};
@@ -8,6 +8,7 @@
 #include <yak/log.h>
 #include <yak/init.h>
 #include <yak/irq.h>
+#include <yak/cpudata.h>
 #include <yak/vm/map.h>
 #include <yio/pci/Pci.hh>
 #include <yio/acpi/AcpiDevice.hh>
@@ -91,6 +92,13 @@ struct IOApic : public Service {
 		write(IOAPIC_REDTBL_BASE + gsi * 2 + 1, (uint32_t)(val >> 32));
 	}
 
+	// the destination lives in the upper half on its own
+	void setDestination(uint8_t irq, uint8_t cpu)
+	{
+		auto gsi = irq - gsiBase_;
+		write(IOAPIC_REDTBL_BASE + gsi * 2 + 1, (uint32_t)cpu << 24);
+	}
+
     private:
 	inline void write(uint8_t offset, uint32_t value)
 	{
@@ -202,27 +210,53 @@ struct CpuNamespace : public Service {
 
 IO_OBJ_DEFINE(CpuNamespace, Service);
 
-extern "C" void arch_program_intr(uint8_t irq, irq_vec_t vector, int masked)
+static void resolve_intr(uint8_t *irq, bool *low, bool *edge)
 {
-	bool low = false;
-	bool edge = true;
-	if (irq < 16) {
-		auto override = &isr_overrides[irq];
-		edge = override->edge;
-		low = override->low;
-		irq = override->gsi;
+	*low = false;
+	*edge = true;
+	if (*irq < 16) {
+		auto override = &isr_overrides[*irq];
+		*edge = override->edge;
+		*low = override->low;
+		*irq = override->gsi;
 	}
+}
 
+static IOApic *find_ioapic(uint8_t gsi)
+{
 	for (size_t i = 0; i < ioapic_count; i++) {
-		if (i >= ioapics[i]->gsiBase_ &&
-		    i <= ioapics[i]->gsiBase_ + ioapics[i]->maxRedirEnt_) {
-			auto ioapic = ioapics[i];
-			ioapic->program(irq, vector, 0, low, edge, masked);
-			return;
-		}
+		if (gsi >= ioapics[i]->gsiBase_ &&
+		    gsi <= ioapics[i]->gsiBase_ + ioapics[i]->maxRedirEnt_)
+			return ioapics[i];
 	}
 
 	panic("couldnt find ioapic\n");
+	return nullptr;
+}
+
+extern "C" void arch_program_intr(uint8_t irq, irq_vec_t vector, int masked)
+{
+	bool low, edge;
+	resolve_intr(&irq, &low, &edge);
+
+	// cpu 0 is where irq slots start out
+	find_ioapic(irq)->program(irq, vector, getcpu(0)->md.apic_id, low, edge,
+				  masked);
+}
+
+extern "C" status_t arch_retarget_intr(struct irq_object *obj, size_t cpu)
+{
+	uint8_t irq = (uintptr_t)obj->retarget_arg;
+	bool low, edge;
+	resolve_intr(&irq, &low, &edge);
+
+	// physical destination mode: 8 bits without interrupt remapping
+	uint32_t apic_id = getcpu(cpu)->md.apic_id;
+	if (apic_id > 0xFF)
+		return YAK_NOT_SUPPORTED;
+
+	find_ioapic(irq)->setDestination(irq, apic_id);
+	return YAK_SUCCESS;
 }
 
 void IOApic::initWithArgs(uint8_t id, uint32_t gsi_base, paddr_t addr)
@@ -43,19 +43,54 @@ enum {
 	LAPIC_REG_TIMER_INITIAL = 0x380,
 	LAPIC_REG_TIMER_CURRENT = 0x390,
 	LAPIC_REG_TIMER_DIVIDE = 0x3E0,
+	// x2APIC only
+	LAPIC_REG_SELF_IPI = 0x3F0,
 };
 
+enum {
+	LAPIC_ICR_LOGICAL = (1 << 11),
+	LAPIC_ICR_ALL_EXCLUDING_SELF = (0b11 << 18),
+};
+
+enum {
+	APIC_BASE_X2APIC = (1 << 10),
+	APIC_BASE_ENABLE = (1 << 11),
+};
+
+enum {
+	LAPIC_TIMER_ONESHOT = 0,
+	LAPIC_TIMER_TSC_DEADLINE = (0b10 << 17),
+};
+
+bool tsc_deadline_usable();
+bool tsc_deadline(nstime_t deadline, uint64_t *tsc);
+
 static uintptr_t apic_vbase;
 static struct irq_object apic_irqobj;
+// registers are MSRs instead of MMIO, same choice on all cpus
+static bool x2apic;
 
 static inline uintptr_t read_phys_base()
 {
 	return rdmsr(MSR_LAPIC_BASE) & 0xffffffffff000;
 }
 
+static bool has_x2apic()
+{
+	uint32_t a, b, c, d;
+	asm_cpuid(1, 0, &a, &b, &c, &d);
+	return c & (1 << 21);
+}
+
 static inline void lapic_write(uint16_t offset, uint32_t value)
 {
 	assert((offset & 15) == 0);
+
+	if (x2apic) {
+		wrmsr(MSR_X2APIC_BASE + (offset >> 4), value);
+		return;
+	}
+
 	asm volatile("movl %1, (%0)" ::"r"((void *)(apic_vbase + offset)),
 		     "r"(value)
 		     : "memory");
@@ -66,6 +101,9 @@ static inline uint32_t lapic_read(uint16_t offset)
 	uint32_t val;
 	assert((offset & 15) == 0);
 
+	if (x2apic)
+		return rdmsr(MSR_X2APIC_BASE + (offset >> 4));
+
 	asm volatile("movl (%1), %0"
 		     : "=r"(val)
 		     : "r"((void *)(apic_vbase + offset))
@@ -74,9 +112,27 @@ static inline uint32_t lapic_read(uint16_t offset)
 	return val;
 }
 
-uint8_t lapic_id()
+// In x2APIC mode, ICR is a single 64-bit register: one write sends
+static inline void lapic_write_icr(uint32_t dest, uint32_t low)
+{
+	if (x2apic) {
+		// unlike MMIO, wrmsr to x2APIC registers isn't ordered against
+		// earlier stores, which the target has to see
+		asm volatile("mfence; lfence" ::: "memory");
+		wrmsr(MSR_X2APIC_BASE + (LAPIC_REG_ICR0 >> 4),
+		      ((uint64_t)dest << 32) | low);
+		return;
+	}
+
+	lapic_write(LAPIC_REG_ICR1, dest << 24);
+	lapic_write(LAPIC_REG_ICR0, low);
+}
+
+uint32_t lapic_id()
 {
-	return lapic_read(LAPIC_REG_ID) >> 24;
+	uint32_t id = lapic_read(LAPIC_REG_ID);
+	// the full 32 bits in x2APIC mode
+	return x2apic ? id : id >> 24;
 }
 
 uint8_t lapic_version()
@@ -91,14 +147,16 @@ void lapic_eoi()
 
 void lapic_send_ipi(uint32_t lapic_id, uint8_t vector)
 {
-	lapic_write(LAPIC_REG_ICR1, lapic_id << 24);
-	lapic_write(LAPIC_REG_ICR0, vector);
+	lapic_write_icr(lapic_id, vector);
 }
 
 void lapic_defer_interrupt(uint8_t number)
 {
 	// send self-interrupt
-	lapic_send_ipi(PERCPU_FIELD_LOAD(md.apic_id), number);
+	if (x2apic)
+		lapic_write(LAPIC_REG_SELF_IPI, number);
+	else
+		lapic_send_ipi(PERCPU_FIELD_LOAD(md.apic_id), number);
 }
 
 extern size_t ipi_vector;
@@ -108,6 +166,82 @@ void plat_ipi(struct cpu *cpu)
 	lapic_send_ipi(cpu->md.apic_id, ipi_vector);
 }
 
+// x2APIC logical mode addresses up to 16 cpus of a cluster at once
+static void x2apic_ipi_clusters(struct cpumask *mask)
+{
+	uint32_t dest[8];
+	size_t count = 0;
+
+	bitset_word_t tmp;
+	for_each_cpu(tmp, mask) {
+		uint32_t ldr = getcpu(tmp)->md.apic_ldr;
+
+		size_t i;
+		for (i = 0; i < count; i++) {
+			if ((dest[i] >> 16) == (ldr >> 16))
+				break;
+		}
+
+		if (i < count) {
+			dest[i] |= ldr;
+			continue;
+		}
+
+		if (count == elementsof(dest)) {
+			for (i = 0; i < count; i++)
+				lapic_write_icr(dest[i],
+						LAPIC_ICR_LOGICAL | ipi_vector);
+			count = 0;
+		}
+
+		dest[count++] = ldr;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		lapic_write_icr(dest[i], LAPIC_ICR_LOGICAL | ipi_vector);
+}
+
+// Caller is at IPL_HIGH, so nothing can clobber ICR1 between the writes
+void plat_ipi_mask(struct cpumask *mask)
+{
+	// every cpu but us: the shorthand reaches all of them with one write
+	if (!bitset_test(mask, cpuid()) &&
+	    bitset_count(mask) == cpus_total() - 1) {
+		lapic_write_icr(0, LAPIC_ICR_ALL_EXCLUDING_SELF | ipi_vector);
+		return;
+	}
+
+	if (x2apic) {
+		x2apic_ipi_clusters(mask);
+		return;
+	}
+
+	bitset_word_t tmp;
+	for_each_cpu(tmp, mask) {
+		plat_ipi(getcpu(tmp));
+	}
+}
+
+#define MSI_ADDR_BASE 0xFEE00000
+
+status_t plat_msi_message(irq_vec_t vec, size_t cpu, uint64_t *addr,
+			  uint32_t *data)
+{
+	if (cpu >= MAX_NR_CPUS || !bitset_atomic_test(&cpumask_active, cpu))
+		return YAK_INVALID_ARGS;
+
+	uint32_t apic_id = getcpu(cpu)->md.apic_id;
+	// the message has 8 bits of destination without interrupt remapping
+	if (apic_id > 0xFF)
+		return YAK_NOT_SUPPORTED;
+
+	// physical destination, no redirection hint
+	*addr = MSI_ADDR_BASE | (apic_id << 12);
+	// fixed delivery, edge triggered
+	*data = VEC_TO_IRQ(vec);
+	return YAK_SUCCESS;
+}
+
 static void lapic_mask(uint16_t offset)
 {
 	lapic_write(offset, (1 << 16));
@@ -119,7 +253,6 @@ static void lapic_calibrate()
 	int runs = 0;
 	uint64_t sum = 0;
 	while (runs++ < 10) {
-		lapic_write(LAPIC_REG_TIMER_CURRENT, 0);
 		uint32_t start_val = UINT32_MAX;
 		lapic_write(LAPIC_REG_TIMER_INITIAL, start_val);
 		nstime_t deadline = uptime() + wait_ms * 1000000;
@@ -136,14 +269,45 @@ static void lapic_calibrate()
 	}
 
 	uint64_t avg = sum / (wait_ms * runs);
-	// round up to 100000
-	avg = (avg + 100000) / 100000 * 100000;
 	pr_debug("%ld timer ticks/ms\n", avg);
 	PERCPU_FIELD_STORE(md.apic_ticks_per_ms, avg);
+	PERCPU_FIELD_STORE(md.apic_max_delta, UINT32_MAX * 1000000ULL / avg);
+}
+
+static bool has_tsc_deadline()
+{
+	uint32_t a, b, c, d;
+	asm_cpuid(1, 0, &a, &b, &c, &d);
+	return c & (1 << 24);
+}
+
+static void lapic_timer_setup(bool tsc_deadline)
+{
+	uint32_t vector = apic_irqobj.slot->vector + 32;
+
+	if (tsc_deadline) {
+		lapic_write(LAPIC_REG_LVT_TIMER,
+			    vector | LAPIC_TIMER_TSC_DEADLINE);
+		// the mode switch has to land before the first deadline write
+		asm volatile("mfence" ::: "memory");
+	} else {
+		// also disarms a pending deadline
+		lapic_write(LAPIC_REG_LVT_TIMER, vector | LAPIC_TIMER_ONESHOT);
+	}
+
+	PERCPU_FIELD_STORE(md.tsc_deadline, tsc_deadline);
 }
 
 void lapic_enable()
 {
+	if (x2apic) {
+		// limine may have switched already
+		uint64_t base = rdmsr(MSR_LAPIC_BASE);
+		if ((base & APIC_BASE_X2APIC) == 0)
+			wrmsr(MSR_LAPIC_BASE,
+			      base | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+	}
+
 	lapic_mask(LAPIC_REG_LVT_TIMER);
 	lapic_mask(LAPIC_REG_LVT_ERROR);
 	lapic_mask(LAPIC_REG_LVT_LINT0);
@@ -157,15 +321,21 @@ void lapic_enable()
 	lapic_write(LAPIC_REG_SPURIOUS, (1 << 8) | 0xFF);
 
 	lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
-	lapic_write(LAPIC_REG_TIMER_CURRENT, 0);
 	// set 1 as divider
 	lapic_write(LAPIC_REG_TIMER_DIVIDE, 0b1011);
 
 	PERCPU_FIELD_STORE(md.apic_id, lapic_id());
+	if (x2apic)
+		PERCPU_FIELD_STORE(md.apic_ldr,
+				   lapic_read(LAPIC_REG_LOGICAL_DEST));
 
+	// also needed for TSC-deadline mode, in case we have to fall back
 	lapic_calibrate();
 
-	lapic_write(LAPIC_REG_LVT_TIMER, apic_irqobj.slot->vector + 32);
+	bool tsc_deadline = has_tsc_deadline() && tsc_deadline_usable();
+	if (tsc_deadline)
+		pr_debug("using TSC-deadline mode\n");
+	lapic_timer_setup(tsc_deadline);
 
 	lapic_eoi();
 }
@@ -180,27 +350,57 @@ void apic_global_init()
 {
 	irq_object_init(&apic_irqobj, apic_handler, NULL);
 	irq_alloc_ipl(&apic_irqobj, IPL_CLOCK, 0, PIN_CONFIG_ANY);
+
+	// no MMIO exits per EOI and IPI under virtualization, and apic ids
+	// past 255
+	x2apic = (rdmsr(MSR_LAPIC_BASE) & APIC_BASE_X2APIC) || has_x2apic();
+	if (x2apic) {
+		pr_info("using x2APIC mode\n");
+		return;
+	}
+
 	EXPECT(vm_map_mmio(kmap(), read_phys_base(), PAGE_SIZE,
 			   VM_RW | VM_GLOBAL, VM_CACHE_DISABLE, &apic_vbase));
 }
 
 void plat_arm_timer(nstime_t deadline)
 {
+	if (PERCPU_FIELD_LOAD(md.tsc_deadline)) {
+		uint64_t tsc;
+
+		if (deadline == TIMER_INFINITE) {
+			wrmsr(MSR_TSC_DEADLINE, 0);
+			return;
+		}
+
+		if (likely(tsc_deadline(deadline, &tsc))) {
+			// a deadline in the past fires right away
+			wrmsr(MSR_TSC_DEADLINE, tsc);
+			return;
+		}
+
+		// the TSC got marked unstable, count ticks instead
+		lapic_timer_setup(false);
+	}
+
 	if (deadline == TIMER_INFINITE) {
 		lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
 		return;
 	}
 
-	nstime_t delta = deadline - uptime();
-
-	uint64_t ticks;
-	ticks = (DIV_ROUNDUP(delta, 1000000)) *
-		PERCPU_FIELD_LOAD(md.apic_ticks_per_ms);
-
-	if (ticks <= 0 || delta <= 0) {
+	nstime_t now = uptime();
+	if (deadline <= now) {
 		lapic_write(LAPIC_REG_TIMER_INITIAL, 1);
 		return;
 	}
 
-	lapic_write(LAPIC_REG_TIMER_INITIAL, ticks);
+	// too far out for one count: timer_update re-arms when it fires early
+	nstime_t delta =
+		MIN(deadline - now, PERCPU_FIELD_LOAD(md.apic_max_delta));
+
+	// round up, firing before the deadline would cost another interrupt
+	uint64_t ticks = DIV_ROUNDUP(
+		delta * PERCPU_FIELD_LOAD(md.apic_ticks_per_ms), 1000000);
+
+	lapic_write(LAPIC_REG_TIMER_INITIAL, MAX(ticks, 1UL));
 }
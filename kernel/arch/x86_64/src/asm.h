@@ -5,7 +5,11 @@
 
 enum msr {
 	MSR_LAPIC_BASE = 0x1B,
+	MSR_TSC_ADJUST = 0x3B,
 	MSR_PAT = 0x277,
+	MSR_TSC_DEADLINE = 0x6E0,
+	// x2APIC registers: MSR_X2APIC_BASE + (xAPIC offset >> 4)
+	MSR_X2APIC_BASE = 0x800,
 	MSR_EFER = 0xC0000080,
 	MSR_STAR = 0xC0000081,
 	MSR_LSTAR = 0xC0000082,
@@ -13,6 +17,7 @@ enum msr {
 	MSR_FSBASE = 0xC0000100,
 	MSR_GSBASE = 0xC0000101,
 	MSR_KERNEL_GSBASE = 0xC0000102,
+	MSR_TSC_AUX = 0xC0000103,
 };
 
 static inline void wrmsr(uint32_t index, uint64_t value)
@@ -92,6 +97,16 @@ static inline void asm_cpuid(int leaf, int subleaf, uint32_t *eax,
 		     : "a"(leaf), "c"(subleaf));
 }
 
+// lfence keeps rdtsc from being executed before earlier loads
+static inline uint64_t rdtsc()
+{
+	uint32_t low, high;
+	asm volatile("lfence\n\t"
+		     "rdtsc"
+		     : "=a"(low), "=d"(high)::"memory");
+	return ((uint64_t)high << 32) | low;
+}
+
 static inline uint64_t xgetbv(unsigned int index)
 {
 	uint32_t a, d;
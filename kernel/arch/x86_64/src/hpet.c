@@ -100,6 +100,24 @@ struct clocksource hpet_clocksource = {
 	.flags = CLOCKSOURCE_EARLY,
 };
 
+// Other clocks calibrate against the HPET even if it isn't the clocksource.
+// Returns 0 if there is no HPET.
+uint64_t hpet_calibration_frequency()
+{
+	if (!hpet_clocksource.is_setup) {
+		if (!hpet_probe() || IS_ERR(hpet_setup(&hpet_clocksource)))
+			return 0;
+		hpet_clocksource.is_setup = true;
+	}
+
+	return hpet_clocksource.frequency;
+}
+
+uint64_t hpet_calibration_counter()
+{
+	return hpet_read(HPET_REG_COUNTER_MAIN);
+}
+
 void hpet_register()
 {
 	clocksource_register(&hpet_clocksource);
@@ -1,6 +1,7 @@
 #include "yak/clocksource.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <yak/init.h>
 #include <yak/arch-context.h>
 #include <yak/arch-cpu.h>
@@ -195,10 +196,70 @@ static void setup_syscall_msrs()
 	wrmsr(MSR_STAR, star);
 }
 
+// CPUs whose APIC ids only differ in the bits below the
+// cache sharing shift share their last-level cache
+static void detect_llc()
+{
+	uint32_t a, b, c, d;
+	uint32_t cache_leaf = 4;
+
+	asm_cpuid(0, 0, &a, &b, &c, &d);
+	uint32_t max_leaf = a;
+	// "AuthenticAMD" reports cache topology through the TOPOEXT leaf
+	bool amd = b == 0x68747541 && d == 0x69746e65 && c == 0x444d4163;
+
+	if (amd) {
+		asm_cpuid(0x80000000, 0, &a, &b, &c, &d);
+		if (a < 0x8000001D)
+			return;
+		asm_cpuid(0x80000001, 0, &a, &b, &c, &d);
+		if ((c & (1 << 22)) == 0)
+			return;
+		cache_leaf = 0x8000001D;
+	} else if (max_leaf < 4) {
+		return;
+	}
+
+	uint32_t level = 0, sharing = 1;
+	for (int i = 0;; i++) {
+		asm_cpuid(cache_leaf, i, &a, &b, &c, &d);
+		// no more caches
+		if ((a & 0x1F) == 0)
+			break;
+
+		uint32_t cache_level = (a >> 5) & 0x7;
+		if (cache_level >= level) {
+			level = cache_level;
+			sharing = ((a >> 14) & 0xFFF) + 1;
+		}
+	}
+
+	asm_cpuid(1, 0, &a, &b, &c, &d);
+	uint32_t apic_id = b >> 24;
+	if (max_leaf >= 0xB) {
+		asm_cpuid(0xB, 0, &a, &b, &c, &d);
+		// full x2apic id
+		if (b != 0)
+			apic_id = d;
+	}
+
+	uint32_t shift = sharing <= 1 ? 0 : 32 - __builtin_clz(sharing - 1);
+	PERCPU_FIELD_STORE(llc_id, apic_id >> shift);
+}
+
+void vdso_cpu_init();
+void pmap_cpu_init();
+
 static void setup_cpu()
 {
 	setup_syscall_msrs();
 
+	vdso_cpu_init();
+
+	pmap_cpu_init();
+
+	detect_llc();
+
 	// load the global idt
 	idt_reload();
 
@@ -221,6 +282,8 @@ void init_early_output()
 
 void apic_global_init();
 void lapic_enable();
+void tsc_sync_bsp();
+void tsc_sync_ap();
 
 LIMINE_REQ struct limine_date_at_boot_request date_at_boot = {
 	.id = LIMINE_DATE_AT_BOOT_REQUEST_ID,
@@ -234,6 +297,9 @@ void timer_setup()
 	extern void kvmclock_register();
 	kvmclock_register();
 
+	extern void tsc_register();
+	tsc_register();
+
 	uint64_t time = 0;
 	if (date_at_boot.response)
 		time = STIME(date_at_boot.response->timestamp);
@@ -243,7 +309,8 @@ void timer_setup()
 	lapic_enable();
 }
 INIT_ENTAILS(x86_timer_setup, bsp_ready);
-INIT_DEPS(x86_timer_setup, early_io_stage);
+// the clocksource publishes into the vDSO data page
+INIT_DEPS(x86_timer_setup, early_io_stage, vdso_node);
 INIT_NODE(x86_timer_setup, timer_setup);
 
 static struct irq_object ipi_obj;
@@ -267,8 +334,15 @@ INIT_ENTAILS(x86_ipi_setup, bsp_ready);
 INIT_DEPS(x86_ipi_setup, x86_timer_setup);
 INIT_NODE(x86_ipi_setup, ipi_setup);
 
+// older limine.h versions call it LIMINE_MP_X2APIC
+#ifndef LIMINE_MP_REQUEST_X86_64_X2APIC
+#define LIMINE_MP_REQUEST_X86_64_X2APIC (1 << 0)
+#endif
+
 LIMINE_REQ struct limine_mp_request mp_request = {
 	.id = LIMINE_MP_REQUEST_ID,
+	// needed to start cpus with apic ids past 254
+	.flags = LIMINE_MP_REQUEST_X86_64_X2APIC,
 };
 
 size_t num_cpus_total;
@@ -316,6 +390,9 @@ static void c_ap_entry(struct limine_mp_info *info)
 
 	cpudata_init(cpudata, (void *)extra->stack_top);
 
+	// before choosing a clocksource: the TSC might turn out unusable
+	tsc_sync_ap();
+
 	clocksource_init();
 
 	vm_map_activate(kmap());
@@ -376,6 +453,7 @@ void start_aps()
 
 	__all_cpus = kcalloc(cpu_count, sizeof(struct cpu *));
 	__all_cpus[cpuid()] = curcpu();
+	rcq_alloc_slots(cpu_count);
 
 	paddr_t kernel_cr3 = read_cr3();
 
@@ -395,6 +473,9 @@ void start_aps()
 
 		vaddr_t percpu_area = (vaddr_t)vm_kalloc(
 			ALIGN_UP(percpu_size, PAGE_SIZE), VM_SLEEP);
+		// the AP may take locks before cpudata_init: make sure they
+		// don't see garbage per-cpu state (e.g. lockstat)
+		memset((void *)percpu_area, 0, ALIGN_UP(percpu_size, PAGE_SIZE));
 
 		pr_debug("percpu_area: %lx\n", percpu_area);
 
@@ -405,6 +486,8 @@ void start_aps()
 
 		info->extra_argument = (uint64_t)extra_arg;
 		info->goto_address = naked_ap_entry;
+
+		tsc_sync_bsp();
 	}
 
 	all_ap_info_structs[cpuid()].done = 1;
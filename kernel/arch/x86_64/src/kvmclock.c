@@ -145,7 +145,7 @@ static struct clocksource kvm_clocksource = {
 	// system_time is in ns
 	.frequency = 1e9,
 	.quality = 1000,
-	.flags = CLOCKSOURCE_EARLY | CLOCKSOURCE_NO_OFFSET,
+	.flags = CLOCKSOURCE_EARLY,
 };
 
 void kvmclock_register()
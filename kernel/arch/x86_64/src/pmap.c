@@ -1,11 +1,216 @@
+#include <stdint.h>
 #include <yak/vm/pmap.h>
+#include <yak/vm/map.h>
+#include <yak/cpudata.h>
+#include <yak/ipl.h>
 #include "asm.h"
 
+#define CR4_PCIDE (1 << 17)
+// keep the entries tagged with the PCID we load
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR3_PCID_MASK 0xFFFULL
+
+enum {
+	INVPCID_ADDRESS = 0,
+	INVPCID_CONTEXT = 1,
+	INVPCID_ALL_GLOBAL = 2,
+	INVPCID_ALL = 3,
+};
+
+// past this, flushing the whole context is cheaper
+#define FLUSH_ALL_PAGES 64
+
+static bool has_invpcid;
+
+static inline void invlpg(vaddr_t va)
+{
+	asm volatile("invlpg (%0)" ::"r"(va) : "memory");
+}
+
+static inline void invpcid(unsigned long type, uint64_t pcid, vaddr_t va)
+{
+	struct {
+		uint64_t pcid;
+		uint64_t va;
+	} desc = { pcid, va };
+	asm volatile("invpcid %0, %1" ::"m"(desc), "r"(type) : "memory");
+}
+
+// current context only, global entries stay
+static inline void flush_current()
+{
+	write_cr3(read_cr3());
+}
+
+static void invlpg_range(vaddr_t va, size_t length, size_t pgsz)
+{
+	for (size_t i = 0; i < length; i += pgsz)
+		invlpg(va + i);
+}
+
+static void invpcid_range(size_t slot, vaddr_t va, size_t length, size_t pgsz)
+{
+	for (size_t i = 0; i < length; i += pgsz)
+		invpcid(INVPCID_ADDRESS, slot + 1, va + i);
+}
+
+void pmap_cpu_init()
+{
+	uint32_t a, b, c, d;
+
+	asm_cpuid(1, 0, &a, &b, &c, &d);
+	if (!(c & (1 << 17)))
+		return;
+
+	asm_cpuid(0, 0, &a, &b, &c, &d);
+	if (a >= 7) {
+		asm_cpuid(7, 0, &a, &b, &c, &d);
+		has_invpcid = b & (1 << 10);
+	}
+
+	struct cpu_md *md = &curcpu()->md;
+	for (size_t i = 0; i < PCID_SLOTS; i++) {
+		md->pcid_pmap[i] = 0;
+		md->pcid_gen[i] = 0;
+	}
+	md->pcid_next = 0;
+
+	// needs PCID 0 in CR3, which is what we run on until the next switch
+	write_cr4(read_cr4() | CR4_PCIDE);
+	md->pcid = true;
+}
+
+bool pmap_tlb_tagged()
+{
+	return PERCPU_FIELD_LOAD(md.pcid);
+}
+
+static size_t pcid_find(struct cpu_md *md, struct pmap *pmap)
+{
+	for (size_t i = 0; i < PCID_SLOTS; i++) {
+		if (md->pcid_pmap[i] == pmap->id)
+			return i;
+	}
+	return PCID_SLOTS;
+}
+
+// the slot CR3 points at, PCID_SLOTS while we're still on PCID 0
+static size_t pcid_current()
+{
+	size_t pcid = read_cr3() & CR3_PCID_MASK;
+	return pcid == 0 ? PCID_SLOTS : pcid - 1;
+}
+
 void pmap_activate(struct pmap *pmap)
 {
-	/* This was moved to the generic map_activate
-	if (read_cr3() == pmap->top_level)
+	// APs come through here before their per-cpu data is set up, but it
+	// is zeroed, so they take this path
+	if (!PERCPU_FIELD_LOAD(md.pcid)) {
+		write_cr3(pmap->top_level);
+		return;
+	}
+
+	// the shootdown handler works on the slots as well
+	ipl_t ipl = ripl(IPL_HIGH);
+
+	struct cpu_md *md = &curcpu()->md;
+
+	// vm_map_activate published us in mapped_on already: either the
+	// shootdowns reach us from now on, or we see their generation here
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t gen = __atomic_load_n(&pmap->tlb_gen, __ATOMIC_ACQUIRE);
+
+	bool flush = true;
+	size_t slot = pcid_find(md, pmap);
+	if (slot == PCID_SLOTS) {
+		slot = md->pcid_next;
+		md->pcid_next = (slot + 1) % PCID_SLOTS;
+		md->pcid_pmap[slot] = pmap->id;
+	} else if (md->pcid_gen[slot] == gen) {
+		flush = false;
+	}
+	md->pcid_gen[slot] = gen;
+
+	uint64_t cr3 = pmap->top_level | (slot + 1);
+	if (!flush)
+		cr3 |= CR3_NOFLUSH;
+	write_cr3(cr3);
+
+	xipl(ipl);
+}
+
+// Kernel entries that aren't global are cached in every context
+static void invalidate_kernel(struct cpu_md *md, vaddr_t va, size_t length,
+			      size_t pgsz)
+{
+	size_t current = pcid_current();
+	bool all = (length >> PAGE_SHIFT) >= FLUSH_ALL_PAGES;
+
+	if (has_invpcid) {
+		if (all) {
+			invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+			return;
+		}
+
+		// current context and global entries
+		invlpg_range(va, length, pgsz);
+		for (size_t i = 0; i < PCID_SLOTS; i++) {
+			if (i != current && md->pcid_pmap[i] != 0)
+				invpcid_range(i, va, length, pgsz);
+		}
 		return;
-	*/
-	write_cr3(pmap->top_level);
+	}
+
+	if (all)
+		flush_current();
+	else
+		invlpg_range(va, length, pgsz);
+
+	// we can't reach the other contexts: start over when they're loaded
+	for (size_t i = 0; i < PCID_SLOTS; i++) {
+		if (i != current)
+			md->pcid_pmap[i] = 0;
+	}
+}
+
+void pmap_invalidate_local(struct pmap *pmap, vaddr_t va, size_t length,
+			   size_t pgsz)
+{
+	bool all = (length >> PAGE_SHIFT) >= FLUSH_ALL_PAGES;
+
+	if (!PERCPU_FIELD_LOAD(md.pcid)) {
+		// a pmap we switched away from meanwhile was flushed already
+		if (all)
+			flush_current();
+		else
+			invlpg_range(va, length, pgsz);
+		return;
+	}
+
+	struct cpu_md *md = &curcpu()->md;
+
+	if (pmap == &kmap()->pmap) {
+		invalidate_kernel(md, va, length, pgsz);
+		return;
+	}
+
+	size_t slot = pcid_find(md, pmap);
+	// nothing cached here
+	if (slot == PCID_SLOTS)
+		return;
+
+	if (slot == pcid_current()) {
+		if (all)
+			flush_current();
+		else
+			invlpg_range(va, length, pgsz);
+	} else if (has_invpcid) {
+		if (all)
+			invpcid(INVPCID_CONTEXT, slot + 1, 0);
+		else
+			invpcid_range(slot, va, length, pgsz);
+	} else {
+		// flush it when it's loaded next
+		md->pcid_pmap[slot] = 0;
+	}
 }
@@ -4,6 +4,7 @@
 #include <yak/sched.h>
 #include <yak/heap.h>
 #include <yak/log.h>
+#include <yak/softint.h>
 
 #include "gdt.h"
 #include "tss.h"
@@ -103,3 +104,70 @@ void plat_swtch(struct kthread *current, struct kthread *thread)
 
 	asm_swtch(current, thread);
 }
+
+enum {
+	MWAIT_UNKNOWN,
+	MWAIT_UNSUPPORTED,
+	MWAIT_SUPPORTED,
+};
+
+static int mwait_state = MWAIT_UNKNOWN;
+
+static int detect_mwait()
+{
+	uint32_t a, b, c, d;
+	asm_cpuid(0, 0, &a, &b, &c, &d);
+	if (a < 5)
+		return MWAIT_UNSUPPORTED;
+
+	asm_cpuid(1, 0, &a, &b, &c, &d);
+	// MONITOR/MWAIT
+	if ((c & (1 << 3)) == 0)
+		return MWAIT_UNSUPPORTED;
+
+	asm_cpuid(5, 0, &a, &b, &c, &d);
+	// we need interrupts to break out of mwait with IF=0
+	if ((c & 0b11) != 0b11)
+		return MWAIT_UNSUPPORTED;
+
+	pr_info("using monitor/mwait for idle\n");
+	return MWAIT_SUPPORTED;
+}
+
+void plat_idle(struct cpu *cpu)
+{
+	if (unlikely(mwait_state == MWAIT_UNKNOWN))
+		mwait_state = detect_mwait();
+
+	disable_interrupts();
+
+	if (mwait_state == MWAIT_SUPPORTED) {
+		__atomic_store_n(&cpu->idle_polling, 1, __ATOMIC_SEQ_CST);
+
+		asm volatile("monitor" ::"a"(&cpu->next_thread), "c"(0), "d"(0)
+			     : "memory");
+
+		// re-check after arming the monitor, a store from before
+		// wouldn't wake us anymore
+		if (!__atomic_load_n(&cpu->softint_pending, __ATOMIC_SEQ_CST) &&
+		    !__atomic_load_n(&cpu->next_thread, __ATOMIC_SEQ_CST)) {
+			// C1, treat interrupts as break events even though masked
+			asm volatile("mwait" ::"a"(0), "c"(1) : "memory");
+		}
+
+		__atomic_store_n(&cpu->idle_polling, 0, __ATOMIC_SEQ_CST);
+
+		enable_interrupts();
+		return;
+	}
+
+	if (__atomic_load_n(&cpu->softint_pending, __ATOMIC_SEQ_CST) ||
+	    __atomic_load_n(&cpu->next_thread, __ATOMIC_SEQ_CST)) {
+		enable_interrupts();
+		return;
+	}
+
+	// sti only takes effect after the next instruction,
+	// nothing can slip in between the check and hlt
+	asm volatile("sti; hlt" ::: "memory");
+}
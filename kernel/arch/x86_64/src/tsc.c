@@ -0,0 +1,303 @@
+#define pr_fmt(fmt) "tsc: " fmt
+
+#include <stdint.h>
+#include <yak/clocksource.h>
+#include <yak/cpudata.h>
+#include <yak/cpu.h>
+#include <yak/log.h>
+#include <yak/spinlock.h>
+#include <yak/status.h>
+#include <yak/types.h>
+#include <yak/arch-vdso.h>
+
+#include "asm.h"
+
+#define CALIBRATE_MS 10
+#define CALIBRATE_RUNS 5
+// how long the BSP and each AP race on the warp check
+#define SYNC_MS 2
+
+#define PIT_FREQUENCY 1193182
+
+extern uint64_t hpet_calibration_frequency();
+extern uint64_t hpet_calibration_counter();
+
+enum {
+	TSC_UNPROBED = 0,
+	TSC_USABLE,
+	TSC_UNUSABLE,
+};
+
+static int tsc_state = TSC_UNPROBED;
+static bool has_tsc_adjust;
+static uint64_t bsp_tsc_adjust;
+
+static struct clocksource tsc_clocksource;
+
+static bool tsc_invariant()
+{
+	uint32_t a, b, c, d;
+
+	asm_cpuid(0x80000000, 0, &a, &b, &c, &d);
+	if (a < 0x80000007)
+		return false;
+
+	asm_cpuid(0x80000007, 0, &a, &b, &c, &d);
+	return d & (1 << 8);
+}
+
+static uint64_t tsc_calibrate_hpet()
+{
+	uint64_t hpet_freq = hpet_calibration_frequency();
+	if (hpet_freq == 0)
+		return 0;
+
+	uint64_t hpet_ticks = hpet_freq * CALIBRATE_MS / 1000;
+	uint64_t results[CALIBRATE_RUNS];
+
+	for (int run = 0; run < CALIBRATE_RUNS; run++) {
+		uint64_t hpet_start = hpet_calibration_counter();
+		uint64_t tsc_start = rdtsc();
+		uint64_t hpet_end;
+
+		do {
+			hpet_end = hpet_calibration_counter();
+		} while (hpet_end - hpet_start < hpet_ticks);
+
+		uint64_t tsc_end = rdtsc();
+
+		results[run] = (tsc_end - tsc_start) * hpet_freq /
+			       (hpet_end - hpet_start);
+	}
+
+	// the median drops runs disturbed by SMIs or a preempted vcpu
+	for (int i = 1; i < CALIBRATE_RUNS; i++) {
+		for (int j = i; j > 0 && results[j - 1] > results[j]; j--) {
+			uint64_t tmp = results[j];
+			results[j] = results[j - 1];
+			results[j - 1] = tmp;
+		}
+	}
+
+	return results[CALIBRATE_RUNS / 2];
+}
+
+static uint64_t tsc_calibrate_pit()
+{
+	// channel 2 gate on, speaker off
+	outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+	// channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+	outb(0x43, 0xb0);
+
+	uint16_t latch = PIT_FREQUENCY * CALIBRATE_MS / 1000;
+	outb(0x42, latch & 0xff);
+	outb(0x42, latch >> 8);
+
+	uint64_t start = rdtsc();
+	uint64_t end;
+
+	// OUT2 goes high once the count ran out
+	while ((inb(0x61) & 0x20) == 0) {
+		end = rdtsc();
+		// no PIT: give up after way more than any sane TSC would need
+		if (end - start > (1ULL << 36))
+			return 0;
+	}
+
+	end = rdtsc();
+
+	return (end - start) * 1000 / CALIBRATE_MS;
+}
+
+static bool tsc_probe()
+{
+	if (tsc_state != TSC_UNPROBED)
+		return tsc_state == TSC_USABLE;
+
+	tsc_state = TSC_UNUSABLE;
+
+	if (!tsc_invariant()) {
+		pr_debug("not invariant\n");
+		return false;
+	}
+
+	const char *reference = "hpet";
+	uint64_t frequency = tsc_calibrate_hpet();
+	if (frequency == 0) {
+		reference = "pit";
+		frequency = tsc_calibrate_pit();
+	}
+
+	if (frequency == 0) {
+		pr_warn("calibration failed\n");
+		return false;
+	}
+
+	pr_info("%lu.%03lu MHz (calibrated against %s)\n",
+		frequency / 1000000, (frequency / 1000) % 1000, reference);
+
+	uint32_t a, b, c, d;
+	asm_cpuid(0, 0, &a, &b, &c, &d);
+	if (a >= 7) {
+		asm_cpuid(7, 0, &a, &b, &c, &d);
+		has_tsc_adjust = b & (1 << 1);
+	}
+
+	if (has_tsc_adjust)
+		bsp_tsc_adjust = rdmsr(MSR_TSC_ADJUST);
+
+	tsc_clocksource.frequency = frequency;
+	tsc_state = TSC_USABLE;
+	return true;
+}
+
+static status_t tsc_init(struct clocksource *)
+{
+	return YAK_SUCCESS;
+}
+
+static uint64_t tsc_counter(struct clocksource *)
+{
+	return rdtsc();
+}
+
+static struct clocksource tsc_clocksource = {
+	.name = "tsc",
+	.counter = tsc_counter,
+	.probe = tsc_probe,
+	// calibrated by the probe
+	.setup = NULL,
+	.init = tsc_init,
+	.frequency = -1,
+	// cheapest to read, preferred whenever it is invariant and in sync
+	.quality = 2000,
+	.flags = CLOCKSOURCE_EARLY,
+	// rdtsc works in ring 3 as well
+	.vdso_clock_mode = VDSO_CLOCK_TSC,
+};
+
+// TSC-deadline timers need the TSC as timebase
+bool tsc_deadline_usable()
+{
+	return clocksource_current() == &tsc_clocksource;
+}
+
+// Convert an uptime() deadline into a TSC value, rounding up so the timer
+// never fires before the deadline
+bool tsc_deadline(nstime_t deadline, uint64_t *tsc)
+{
+	return clocksource_cycles_at(&tsc_clocksource, deadline, tsc);
+}
+
+void tsc_register()
+{
+	clocksource_register(&tsc_clocksource);
+}
+
+/*
+ * At AP bring-up, the BSP and the new AP take turns reading the TSC under a
+ * lock. On synchronized TSCs, every read is at least as large as the
+ * previous one, no matter which cpu did it. Otherwise we saw a warp and the
+ * TSC can't be used as a global timebase.
+ */
+
+enum {
+	SYNC_IDLE = 0,
+	SYNC_AP_READY,
+	SYNC_START,
+	SYNC_DONE,
+};
+
+static struct {
+	struct spinlock lock;
+	uint64_t last;
+	uint64_t max_warp;
+	size_t cpu;
+	int state;
+} tsc_sync = {
+	.lock = SPINLOCK_INITIALIZER(),
+};
+
+static void tsc_warp_check(uint64_t until)
+{
+	while (1) {
+		spinlock_lock_noipl(&tsc_sync.lock);
+		uint64_t prev = tsc_sync.last;
+		uint64_t now = rdtsc();
+		tsc_sync.last = now;
+		if (prev > now && prev - now > tsc_sync.max_warp)
+			tsc_sync.max_warp = prev - now;
+		spinlock_unlock_noipl(&tsc_sync.lock);
+
+		// the BSP watches the time, the AP waits for the BSP
+		if (until ? now >= until :
+			    __atomic_load_n(&tsc_sync.state,
+					    __ATOMIC_ACQUIRE) == SYNC_DONE)
+			break;
+	}
+}
+
+static void tsc_mark_unstable()
+{
+	__atomic_store_n(&tsc_state, TSC_UNUSABLE, __ATOMIC_RELEASE);
+
+	// The probe fails now, so this picks another clock. No need to kick
+	// the other cpus: each one runs the new clock's per-cpu init on its
+	// next uptime(), when it sees the timekeeper switched.
+	if (clocksource_current() == &tsc_clocksource)
+		clocksource_init();
+}
+
+void tsc_sync_ap()
+{
+	if (__atomic_load_n(&tsc_state, __ATOMIC_ACQUIRE) != TSC_USABLE)
+		return;
+
+	// firmware may have left the TSCs of different cpus offset
+	if (has_tsc_adjust) {
+		uint64_t adjust = rdmsr(MSR_TSC_ADJUST);
+		if (adjust != bsp_tsc_adjust) {
+			pr_warn("cpu%zu: TSC_ADJUST is %ld, resetting to %ld\n",
+				cpuid(), (int64_t)adjust,
+				(int64_t)bsp_tsc_adjust);
+			wrmsr(MSR_TSC_ADJUST, bsp_tsc_adjust);
+		}
+	}
+
+	tsc_sync.cpu = cpuid();
+	__atomic_store_n(&tsc_sync.state, SYNC_AP_READY, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&tsc_sync.state, __ATOMIC_ACQUIRE) !=
+	       SYNC_START)
+		busyloop_hint();
+
+	tsc_warp_check(0);
+
+	__atomic_store_n(&tsc_sync.state, SYNC_IDLE, __ATOMIC_RELEASE);
+}
+
+void tsc_sync_bsp()
+{
+	if (__atomic_load_n(&tsc_state, __ATOMIC_ACQUIRE) != TSC_USABLE)
+		return;
+
+	while (__atomic_load_n(&tsc_sync.state, __ATOMIC_ACQUIRE) !=
+	       SYNC_AP_READY)
+		busyloop_hint();
+
+	tsc_sync.last = 0;
+	tsc_sync.max_warp = 0;
+	__atomic_store_n(&tsc_sync.state, SYNC_START, __ATOMIC_RELEASE);
+
+	tsc_warp_check(rdtsc() + tsc_clocksource.frequency / 1000 * SYNC_MS);
+
+	__atomic_store_n(&tsc_sync.state, SYNC_DONE, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&tsc_sync.state, __ATOMIC_ACQUIRE) != SYNC_IDLE)
+		busyloop_hint();
+
+	if (tsc_sync.max_warp) {
+		pr_warn("cpu%zu is off by up to %lu cycles, marking unstable\n",
+			tsc_sync.cpu, tsc_sync.max_warp);
+		tsc_mark_unstable();
+	}
+}
@@ -0,0 +1,124 @@
+#define pr_fmt(fmt) "vdso: " fmt
+
+#include <stdint.h>
+#include <string.h>
+#include <yak/vdso.h>
+#include <yak/arch-vdso.h>
+#include <yak/vm.h>
+#include <yak/vm/map.h>
+#include <yak/vm/pmm.h>
+#include <yak/vm/page.h>
+#include <yak/init.h>
+#include <yak/cpudata.h>
+#include <yak/log.h>
+#include <yak/macro.h>
+#include <yak/panic.h>
+
+#include "asm.h"
+
+// the linked vDSO, embedded by vdso-image.S
+extern const char vdso_image_start[];
+extern const char vdso_image_end[];
+
+// [data page][image], physically contiguous and shared by all processes
+static paddr_t vdso_phys;
+static size_t vdso_image_size;
+static struct vdso_data *vdso_data;
+
+static uint32_t getcpu_mode()
+{
+	uint32_t a, b, c, d;
+
+	asm_cpuid(0, 0, &a, &b, &c, &d);
+	if (a >= 7) {
+		asm_cpuid(7, 0, &a, &b, &c, &d);
+		if (c & (1 << 22))
+			return VDSO_GETCPU_RDPID;
+	}
+
+	asm_cpuid(0x80000000, 0, &a, &b, &c, &d);
+	if (a >= 0x80000001) {
+		asm_cpuid(0x80000001, 0, &a, &b, &c, &d);
+		if (d & (1 << 27))
+			return VDSO_GETCPU_RDTSCP;
+	}
+
+	return VDSO_GETCPU_NONE;
+}
+
+// Called on every cpu: RDTSCP and RDPID return IA32_TSC_AUX
+void vdso_cpu_init()
+{
+	if (getcpu_mode() != VDSO_GETCPU_NONE)
+		wrmsr(MSR_TSC_AUX, cpuid());
+}
+
+static void vdso_init()
+{
+	vdso_image_size =
+		ALIGN_UP(vdso_image_end - vdso_image_start, PAGE_SIZE);
+
+	unsigned int order = 0;
+	while (((size_t)PAGE_SIZE << order) < PAGE_SIZE + vdso_image_size)
+		order++;
+
+	struct page *page = pmm_alloc_order(order);
+	if (!page)
+		panic("vdso: out of memory\n");
+	page_zero(page, order);
+
+	vdso_phys = page_to_addr(page);
+	vdso_data = (struct vdso_data *)p2v(vdso_phys);
+	memcpy((void *)p2v(vdso_phys + PAGE_SIZE), vdso_image_start,
+	       vdso_image_end - vdso_image_start);
+
+	vdso_data->getcpu_mode = getcpu_mode();
+
+	pr_debug("%zu byte image, getcpu mode %u\n",
+		 (size_t)(vdso_image_end - vdso_image_start),
+		 vdso_data->getcpu_mode);
+}
+
+INIT_ENTAILS(vdso_node);
+INIT_DEPS(vdso_node, pmm_node);
+INIT_NODE(vdso_node, vdso_init);
+
+void vdso_update_clock(int clock_mode, uint64_t base_cycles, nstime_t base_ns,
+		       uint32_t mult, uint32_t shift, nstime_t realtime_offset)
+{
+	struct vdso_data *data = vdso_data;
+
+	// same protocol as seqcount_write_begin/end
+	__atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	data->clock_mode = clock_mode;
+	data->base_cycles = base_cycles;
+	data->base_ns = base_ns;
+	data->mult = mult;
+	data->shift = shift;
+	data->realtime_offset = realtime_offset;
+
+	__atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELEASE);
+}
+
+status_t vdso_map(struct vm_map *map, vaddr_t *out)
+{
+	vaddr_t base;
+	// grab one range so the data page ends up right below the image
+	TRY(vm_map_reserve(map, 0, PAGE_SIZE + vdso_image_size, 0, &base));
+
+	// the physical pages are shared: forked children keep the same view
+	TRY(vm_map_phys(map, vdso_phys, PAGE_SIZE, VM_READ | VM_USER,
+			VM_INHERIT_SHARED, VM_CACHE_DEFAULT, base,
+			VM_MAP_FIXED | VM_MAP_OVERWRITE, &base));
+
+	vaddr_t image;
+	TRY(vm_map_phys(map, vdso_phys + PAGE_SIZE, vdso_image_size,
+			VM_RX | VM_USER, VM_INHERIT_SHARED, VM_CACHE_DEFAULT,
+			base + PAGE_SIZE, VM_MAP_FIXED | VM_MAP_OVERWRITE,
+			&image));
+
+	*out = image;
+	return YAK_SUCCESS;
+}
@@ -0,0 +1,137 @@
+// The vDSO runs in userspace, inside every process. The kernel maps its
+// data page right below the image, so clock_gettime and getcpu usually
+// don't have to enter the kernel.
+//
+// Built as a standalone shared object: nothing in here may need a
+// relocation, and there is no libc to call into.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <yak/arch-vdso.h>
+#include <yak-abi/errno.h>
+#include <yak-abi/syscall.h>
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_BOOTTIME 7
+
+#define NSEC_PER_SEC 1000000000ULL
+
+struct timespec {
+	long tv_sec;
+	long tv_nsec;
+};
+
+// placed one page below the image by vdso.lds
+extern const struct vdso_data vdso_data [[gnu::visibility("hidden")]];
+
+static inline uint64_t vdso_rdtsc()
+{
+	uint32_t lo, hi;
+	// don't let the read move ahead of the seqcount load
+	asm volatile("lfence\n\t"
+		     "rdtsc"
+		     : "=a"(lo), "=d"(hi)
+		     :
+		     : "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// Same math as uptime(). Fails if the kernel's clocksource can't be read
+// from userspace.
+static bool vdso_read_clock(uint64_t *ns, uint64_t *realtime_offset)
+{
+	// volatile: the reads must stay between the two seqcount loads
+	const volatile struct vdso_data *data = &vdso_data;
+	uint32_t seq, mult, shift;
+	uint64_t delta, base_ns;
+
+	do {
+		// odd: the kernel is switching clocks
+		while ((seq = __atomic_load_n(&data->seq, __ATOMIC_ACQUIRE)) &
+		       1)
+			asm volatile("pause");
+
+		if (data->clock_mode != VDSO_CLOCK_TSC)
+			return false;
+
+		delta = vdso_rdtsc() - data->base_cycles;
+		base_ns = data->base_ns;
+		mult = data->mult;
+		shift = data->shift;
+		*realtime_offset = data->realtime_offset;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&data->seq, __ATOMIC_RELAXED) != seq);
+
+	// the TSC of this cpu may lag the one that took base_cycles a bit
+	if ((int64_t)delta < 0)
+		delta = 0;
+
+	*ns = base_ns + (uint64_t)(((unsigned __int128)delta * mult) >> shift);
+	return true;
+}
+
+// Returns 0 or an errno value, like the syscall it replaces
+int __vdso_clock_gettime(int clock, struct timespec *ts)
+{
+	uint64_t ns, realtime_offset;
+
+	switch (clock) {
+	case CLOCK_REALTIME:
+	case CLOCK_MONOTONIC:
+	case CLOCK_BOOTTIME:
+		if (vdso_read_clock(&ns, &realtime_offset))
+			break;
+		[[fallthrough]];
+	default:
+		return syscall_err(SYS_CLOCK_GET, clock, ts);
+	}
+
+	if (clock == CLOCK_REALTIME)
+		ns += realtime_offset;
+
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+	return 0;
+}
+
+int __vdso_getcpu(unsigned int *cpu, unsigned int *node)
+{
+	unsigned int id;
+
+	// both read IA32_TSC_AUX, which the kernel sets to the cpu number
+	switch (vdso_data.getcpu_mode) {
+	case VDSO_GETCPU_RDPID: {
+		uint64_t aux;
+		asm volatile("rdpid %0" : "=r"(aux));
+		id = aux;
+		break;
+	}
+	case VDSO_GETCPU_RDTSCP: {
+		uint32_t lo, hi, aux;
+		asm volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+		id = aux;
+		break;
+	}
+	default: {
+		struct syscall_result res = syscall(SYS_GETCPU);
+		if (res.err)
+			return res.err;
+		id = res.retval;
+		break;
+	}
+	}
+
+	if (cpu)
+		*cpu = id;
+	// no NUMA support
+	if (node)
+		*node = 0;
+	return 0;
+}
+
+[[gnu::weak, gnu::alias("__vdso_clock_gettime")]]
+int clock_gettime(int clock, struct timespec *ts);
+[[gnu::weak, gnu::alias("__vdso_getcpu")]]
+int getcpu(unsigned int *cpu, unsigned int *node);
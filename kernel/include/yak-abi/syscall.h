@@ -77,6 +77,11 @@ enum {
 	SYS_CLOCK_GET,
 	SYS_DEBUG_SLEEP,
 	SYS_DEBUG_LOG,
+	SYS_SCHED_SETAFFINITY,
+	SYS_SCHED_GETAFFINITY,
+	SYS_SET_TIMER_SLACK,
+	SYS_GET_TIMER_SLACK,
+	SYS_GETCPU,
 };
 
 #endif
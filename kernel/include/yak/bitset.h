@@ -30,6 +30,38 @@ typedef unsigned long bitset_word_t;
 		__atomic_store_n(&(bs)->bits[i], 0, __ATOMIC_RELAXED); \
 	}
 
+#define bitset_fill(bs)                                                 \
+	for (size_t i = 0; i < elementsof((bs)->bits); i++) {          \
+		__atomic_store_n(&(bs)->bits[i], ~(bitset_word_t)0,   \
+				 __ATOMIC_RELAXED);                   \
+	}
+
+// dst = a & b
+#define bitset_and(dst, a, b)                                          \
+	for (size_t i = 0; i < elementsof((dst)->bits); i++) {         \
+		(dst)->bits[i] = (a)->bits[i] & (b)->bits[i];          \
+	}
+
+#define bitset_empty(bs)                                               \
+	({                                                             \
+		bool _empty = true;                                    \
+		for (size_t i = 0; i < elementsof((bs)->bits); i++) { \
+			if ((bs)->bits[i] != 0) {                      \
+				_empty = false;                        \
+				break;                                 \
+			}                                              \
+		}                                                      \
+		_empty;                                                \
+	})
+
+#define bitset_count(bs)                                               \
+	({                                                             \
+		size_t _count = 0;                                     \
+		for (size_t i = 0; i < elementsof((bs)->bits); i++)   \
+			_count += __builtin_popcountl((bs)->bits[i]);  \
+		_count;                                                \
+	})
+
 #define bitset_set(bs, bit) \
 	((bs)->bits[BITSET_WORD_IDX(bit)] |= BITSET_MASK(bit))
 
@@ -47,6 +79,9 @@ typedef unsigned long bitset_word_t;
 	__atomic_fetch_and(&(bs)->bits[BITSET_WORD_IDX(bit)], \
 			   ~BITSET_MASK(bit), __ATOMIC_RELEASE)
 
+#define bitset_atomic_test_and_clear(bs, bit) \
+	((bitset_atomic_clear(bs, bit) & BITSET_MASK(bit)) != 0)
+
 #define bitset_atomic_test(bs, bit)                         \
 	(__atomic_load_n(&(bs)->bits[BITSET_WORD_IDX(bit)], \
 			 __ATOMIC_ACQUIRE) &                \
@@ -9,7 +9,6 @@ extern "C" {
 #include <yak/status.h>
 
 #define CLOCKSOURCE_EARLY 0x1
-#define CLOCKSOURCE_NO_OFFSET 0x2
 
 struct clocksource {
 	// used for identifiying cmdline clock and logs
@@ -26,6 +25,9 @@ struct clocksource {
 	// clock frequency
 	// counter+frequency calculate current timestamp
 	uint64_t frequency;
+	// ns = (cycles * mult) >> shift, derived from frequency
+	uint32_t mult;
+	uint32_t shift;
 
 	// if no cmdline option is given,
 	// the source with the highest quality "wins"
@@ -33,6 +35,10 @@ struct clocksource {
 
 	int flags;
 
+	// arch-specific VDSO_CLOCK_* mode if userspace can read the counter,
+	// 0 if the vDSO has to fall back to the syscall
+	int vdso_clock_mode;
+
 	// used internally
 	bool is_setup;
 	struct clocksource *next;
@@ -45,6 +51,11 @@ void clocksource_init();
 void clocksource_register(struct clocksource *clock);
 struct clocksource *clocksource_current();
 
+// Counter value of clock at which uptime() reaches ns, rounded up.
+// Fails if clock is not the current clocksource.
+bool clocksource_cycles_at(struct clocksource *clock, nstime_t ns,
+			   uint64_t *cycles);
+
 nstime_t uptime();
 nstime_t nettime();
 
@@ -3,13 +3,15 @@
 #include <stddef.h>
 #include <yak/bitset.h>
 
-#define MAX_NR_CPUS 256ULL
+#define MAX_NR_CPUS 1024ULL
 
 DECLARE_BITSET_TYPE(cpumask, MAX_NR_CPUS);
 
 #define for_each_cpu(index, mask) for_each_bit(index, mask, MAX_NR_CPUS)
 
 extern struct cpumask cpumask_active;
+// cpus currently halted in their idle loop
+extern struct cpumask cpumask_idle;
 
 void cpu_init();
 void cpu_up(size_t id);
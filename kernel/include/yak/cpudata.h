@@ -16,6 +16,8 @@ extern "C" {
 #include <yak/sched.h>
 #include <yak/spinlock.h>
 #include <yak/ipi.h>
+#include <yak/rcu.h>
+#include <yak/lockstat.h>
 
 struct cpu {
 	struct cpu *self;
@@ -23,6 +25,8 @@ struct cpu {
 	struct cpu_md md;
 
 	size_t cpu_id;
+	// cpus with the same id share their last-level cache
+	uint32_t llc_id;
 
 	ipl_t hw_ipl;
 
@@ -35,14 +39,21 @@ struct cpu {
 
 	struct vm_map *current_map;
 
-	struct spinlock sched_lock;
+	struct qspinlock sched_lock;
 	struct sched sched;
 
 	struct kthread idle_thread;
 	struct kthread *current_thread;
-	struct kthread *next_thread;
+	// kmutex owner this cpu spins on, the reaper won't free it meanwhile
+	struct kthread *spin_owner;
 
+	// An idle cpu monitors this cache line (see plat_idle): storing
+	// the next thread or a pending softint is enough to wake it
+	[[gnu::aligned(64)]] struct kthread *next_thread;
 	unsigned long softint_pending;
+	// set while the line above is being watched,
+	// remote wakeups can skip the IPI then
+	int idle_polling;
 
 	struct spinlock dpc_lock;
 	LIST_HEAD(, dpc) dpc_queue;
@@ -50,14 +61,45 @@ struct cpu {
 	// timers
 	struct spinlock timer_lock;
 	HEAP_HEAD(timer_heap, timer) timer_heap;
+	struct timer_wheel timer_wheel;
+	// what the platform timer is armed for
+	nstime_t timer_next;
 	struct dpc timer_update_dpc;
 
-	// clocksource
+	// time slice of the current time-share thread
+	struct timer quantum_timer;
+	struct dpc quantum_dpc;
+
+	// periodic work stealing
+	struct timer balance_timer;
+	struct dpc balance_dpc;
+
+	// the clocksource we ran init for
 	struct clocksource *clocksource;
-	nstime_t clock_offset;
 
 	// remote calls
 	struct remote_call_queue rc_queue;
+
+	// interrupts taken here, per slot. Only written by this cpu
+	uint64_t irq_count[IRQ_SLOTS];
+
+	// rcu: last grace period we noted a quiescent state for
+	unsigned long rcu_qs_gp;
+	// callbacks not yet waiting for a grace period
+	struct rcu_head *rcu_next;
+	struct rcu_head **rcu_next_tail;
+	// callbacks waiting for grace period rcu_wait_gp to end
+	struct rcu_head *rcu_wait;
+	unsigned long rcu_wait_gp;
+	struct dpc rcu_dpc;
+
+	// queue nodes for the qspinlocks we hold or wait on
+	struct qspinlock_node qspinlock_nodes[QSPINLOCK_NODES];
+	unsigned long qspinlock_nodes_used;
+
+#if CONFIG_LOCKSTAT
+	struct lockstat_cpu lockstat;
+#endif
 };
 
 #define curcpu() PERCPU_FIELD_LOAD(self)
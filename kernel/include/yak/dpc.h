@@ -6,8 +6,14 @@ extern "C" {
 
 #include <yak/queue.h>
 
+struct cpu;
+
 struct dpc {
 	int enqueued;
+	// the cpu whose queue holds us while enqueued
+	struct cpu *cpu;
+	// handlers currently running it
+	int running;
 	void (*func)(struct dpc *self, void *context);
 	void *context;
 	LIST_ENTRY(dpc) list_entry;
@@ -17,8 +23,10 @@ void dpc_init(struct dpc *dpc, void (*func)(struct dpc *, void *));
 
 void dpc_enqueue(struct dpc *dpc, void *context);
 void dpc_dequeue(struct dpc *dpc);
+// Dequeue from whatever cpu it's queued on and wait for a running handler
+// to return. The caller is below IPL_DPC and nothing enqueues it anymore.
+void dpc_cancel_sync(struct dpc *dpc);
 
-struct cpu;
 void dpc_queue_run(struct cpu *cpu);
 
 #ifdef __cplusplus
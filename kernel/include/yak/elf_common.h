@@ -59,3 +59,4 @@ _Static_assert(sizeof(unsigned char) == 1, "unsigned char has wrong size");
 #define AT_EUID 12
 #define AT_GID 13
 #define AT_EGID 14
+#define AT_SYSINFO_EHDR 33
@@ -1,27 +1,31 @@
 #pragma once
 
-#include <yak/spinlock.h>
-#include <yak/ringbuffer.h>
 #include <yak/cpu.h>
 
-#define RC_MAX_QUEUE 32
-
 typedef void (*remote_fn_t)(void *);
 
 struct remote_call {
+	// next in the target's queue
+	struct remote_call *rc_next;
 	remote_fn_t rc_fn;
 	void *rc_ctx;
 	// optional ack counter
 	size_t *rc_done;
+	// set until the target picked the call up
+	unsigned int rc_busy;
 };
 
+// Lock-free multi-producer, single-consumer queue: any cpu pushes, only the
+// owner takes calls off, always the whole list at once.
 struct remote_call_queue {
-	struct spinlock rcq_lock;
-	struct ringbuffer rcq_buffer;
-	struct remote_call rcq_backing[RC_MAX_QUEUE];
+	struct remote_call *rcq_head;
+	// our calls to other cpus, one slot per target (cpus_total() of them)
+	struct remote_call *rcq_slots;
 };
 
-void rcq_init(struct remote_call_queue *rcq);
+void rcq_init(struct remote_call_queue *rcq, size_t cpu);
+// Called by the BSP before it starts the APs
+void rcq_alloc_slots(size_t nr_cpus);
 
 #define IPI_SEND_OTHERS (~0ULL)
 
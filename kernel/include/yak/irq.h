@@ -9,6 +9,7 @@ extern "C" {
 #include <yak/ipl.h>
 #include <yak/queue.h>
 #include <yak/status.h>
+#include <yak/cpu.h>
 
 #define IRQ_SHAREABLE (1 << 0)
 #define IRQ_MOVEABLE (1 << 1)
@@ -25,6 +26,8 @@ struct irq_object;
 
 typedef int(irq_object_handler)(void *arg);
 typedef void(irq_handler)(void *frame, irq_vec_t vector);
+// Point the interrupt source behind obj at cpu (obj->retarget_arg is free)
+typedef status_t(irq_retarget_fn)(struct irq_object *obj, size_t cpu);
 
 TAILQ_HEAD(irq_obj_list, irq_object);
 
@@ -62,6 +65,14 @@ struct irq_slot {
 	size_t refcount;
 	struct pin_config pinconf;
 	struct irq_obj_list objs;
+	// cpus walking objs right now, irq_free waits for them
+	unsigned int active;
+
+	// where the interrupt may go, and where it goes right now
+	struct cpumask affinity;
+	size_t cpu;
+	// interrupts taken on all cpus as of the last balancer run
+	uint64_t count_seen;
 };
 
 struct irq_object {
@@ -72,6 +83,10 @@ struct irq_object {
 	irq_object_handler *handler;
 	void *arg;
 
+	// NULL: the source can't be moved
+	irq_retarget_fn *retarget;
+	void *retarget_arg;
+
 	TAILQ_ENTRY(irq_object) entry;
 };
 
@@ -93,10 +108,35 @@ status_t irq_alloc_vec(struct irq_object *obj, irq_vec_t vec,
 status_t irq_alloc_ipl(struct irq_object *obj, ipl_t ipl, unsigned int flags,
 		       struct pin_config pinconf);
 
+// The interrupt source has to be quiet already. Returns once no cpu runs
+// obj's handler anymore.
+void irq_free(struct irq_object *obj);
+
+// The source behind obj delivers to cpu and can be moved with fn. A slot
+// is only moved if it is IRQ_MOVEABLE and all of its objects can follow.
+void irq_object_set_retarget(struct irq_object *obj, irq_retarget_fn *fn,
+			     void *arg, size_t cpu);
+
+// Deliver obj's interrupt to cpu, which has to be in its affinity
+status_t irq_retarget(struct irq_object *obj, size_t cpu);
+
+// Restrict the cpus obj's interrupt may go to. Moves it right away if
+// its current cpu isn't part of mask.
+status_t irq_set_affinity(struct irq_object *obj, const struct cpumask *mask);
+
 void plat_set_irq_handler(irq_vec_t vec, irq_handler *fn);
 
+// The message (address/data pair) a PCI device writes to raise vec on cpu
+status_t plat_msi_message(irq_vec_t vec, size_t cpu, uint64_t *addr,
+			  uint32_t *data);
+
+// Route irq to vector on cpu 0
 void arch_program_intr(uint8_t irq, irq_vec_t vector, int masked);
 
+// irq_retarget_fn for lines set up with arch_program_intr.
+// retarget_arg: the irq number as passed to arch_program_intr
+status_t arch_retarget_intr(struct irq_object *obj, size_t cpu);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <yak/types.h>
+
+// Lock contention statistics (CONFIG_LOCKSTAT)
+//
+// Every acquisition of a spinlock, qspinlock, kmutex or rwlock is counted
+// per lock class and call site in a table of the acquiring cpu. A lock
+// class is the lock's name: the init expression for spinlocks, the name
+// passed to kmutex_init/rwlock_init otherwise. Unnamed locks are their own
+// class.
+
+// wait time buckets: <1us <4us <16us <64us <256us <1ms <4ms >=4ms
+#define LOCKSTAT_HIST_BUCKETS 8
+#define LOCKSTAT_ENTRIES 256
+
+struct lockstat_entry {
+	// the name, or the lock itself if it has none
+	const void *key;
+	const char *name;
+	uintptr_t site;
+	unsigned long acquired;
+	unsigned long contended;
+	nstime_t wait_time;
+	unsigned int hist[LOCKSTAT_HIST_BUCKETS];
+};
+
+struct lockstat_cpu {
+	int ready;
+	// acquisitions we had no free entry for
+	unsigned long dropped;
+	struct lockstat_entry entries[LOCKSTAT_ENTRIES];
+};
+
+#if CONFIG_LOCKSTAT
+
+#define LOCKSTAT_SITE() ((uintptr_t)__builtin_return_address(0))
+
+void lockstat_init_cpu(struct lockstat_cpu *stat);
+
+// Only called on the contended path, keeps uncontended ones cheap
+nstime_t lockstat_now();
+
+void lockstat_record(const void *lock, const char *name, uintptr_t site,
+		     bool contended, nstime_t wait_time);
+
+// Format the most contended lock classes into buf, returns the length
+size_t lockstat_format(char *buf, size_t size, size_t max_classes);
+
+// For sleeping locks: note when we first had to wait, then record once the
+// lock is ours
+#define LOCKSTAT_WAIT_BEGIN(start)                  \
+	do {                                        \
+		if (!(start))                       \
+			(start) = lockstat_now() ?: 1; \
+	} while (0)
+
+#define LOCKSTAT_ACQUIRED(lock, name, site, start)                      \
+	lockstat_record((lock), (name), (site), (start) != 0,           \
+			(start) != 0 ? lockstat_now() - (start) : 0)
+
+#else
+
+#define LOCKSTAT_SITE() ((uintptr_t)0)
+#define LOCKSTAT_WAIT_BEGIN(start) ((void)(start))
+#define LOCKSTAT_ACQUIRED(lock, name, site, start) ((void)(site), (void)(start))
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
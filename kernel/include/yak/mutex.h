@@ -13,11 +13,12 @@ extern "C" {
 
 struct kmutex {
 	struct kevent event;
-#if CONFIG_DEBUG
-	// for debugging purposes
+#if CONFIG_DEBUG || CONFIG_LOCKSTAT
+	// for debugging purposes and lockstat
 	const char *name;
 #endif
 	struct kthread *owner;
+	struct pi_loan loan;
 };
 
 void kmutex_init(struct kmutex *mutex, const char *name);
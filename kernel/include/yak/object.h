@@ -36,6 +36,25 @@ struct kobject {
 
 void kobject_init(struct kobject *hdr, int signalstate, enum kobject_type type);
 
+struct kthread;
+
+// Priority the waiters on a priority inheriting lock lent to its owner.
+// Sits on the holder's list of loans until the holder releases the lock.
+// Changed under the lock object's obj_lock and the holder's thread_lock.
+struct pi_loan {
+	// thread the loan was made to, NULL if none
+	struct kthread *holder;
+	// highest priority lent, 0 if none
+	unsigned int priority;
+	LIST_ENTRY(pi_loan) entry;
+};
+
+static inline void pi_loan_init(struct pi_loan *loan)
+{
+	loan->holder = NULL;
+	loan->priority = 0;
+}
+
 // returns amount of threads woken
 int kobject_signal_locked(struct kobject *hdr, bool unblock_all);
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <yak/ipl.h>
+
+// Read-copy-update
+//
+// Readers run at IPL_DPC, so they can neither be preempted nor block.
+// Every context switch, idle loop iteration or DPC softint on a cpu is a
+// quiescent state: none of its earlier read sections can still be running.
+// A grace period ends once every cpu passed through one, then anything
+// unlinked before it started may be freed.
+
+struct rcu_head {
+	void (*func)(struct rcu_head *head);
+	struct rcu_head *next;
+};
+
+static inline ipl_t rcu_read_lock()
+{
+	return ripl(IPL_DPC);
+}
+
+static inline void rcu_read_unlock(ipl_t ipl)
+{
+	xipl(ipl);
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Run func from a DPC once all current readers are done.
+// May be called up to IPL_DPC.
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+
+// Block until all current readers are done
+void synchronize_rcu();
+
+struct cpu;
+// Called by the scheduler at quiescent states
+void rcu_note_qs(struct cpu *cpu);
+
+#ifdef __cplusplus
+}
+#endif
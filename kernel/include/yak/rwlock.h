@@ -12,10 +12,12 @@ extern "C" {
 
 struct rwlock {
 	struct kevent event;
-#if CONFIG_DEBUG
+#if CONFIG_DEBUG || CONFIG_LOCKSTAT
 	const char *name;
 #endif
 	struct kthread *exclusive_owner;
+	// lent to the exclusive owner
+	struct pi_loan loan;
 	uint32_t state;
 	unsigned int exclusive_count;
 };
@@ -71,6 +73,74 @@ DEFINE_CLEANUP_CLASS(
 	},
 	struct rwlock *lock, nstime_t timeout, int type);
 
+// Reader-scalable rwlock: readers only bump a counter of the cpu they run
+// on, writers announce themselves and wait for the sum of all counters to
+// drain. While a writer is around, readers queue up on the inner rwlock.
+// Meant for locks that are read a lot more often than they are written.
+struct pcpu_rwlock_count {
+	[[gnu::aligned(64)]] long count;
+};
+
+struct pcpu_rwlock {
+	// serializes writers against each other and against slow-path readers
+	struct rwlock rwlock;
+	// signaled by readers leaving while a writer waits for them
+	struct kevent drain_event;
+	// one per cpu, or NULL: then all readers go through the inner rwlock
+	struct pcpu_rwlock_count *counts;
+	size_t nr_counts;
+	int writer;
+};
+
+// Without percpu_readers no memory is allocated (for use during early boot)
+status_t pcpu_rwlock_init(struct pcpu_rwlock *lock, const char *name,
+			  bool percpu_readers);
+void pcpu_rwlock_destroy(struct pcpu_rwlock *lock);
+
+status_t pcpu_rwlock_acquire_shared(struct pcpu_rwlock *lock,
+				    nstime_t timeout);
+void pcpu_rwlock_release_shared(struct pcpu_rwlock *lock);
+
+// the timeout only applies to waiting for other writers, draining the
+// readers can't time out
+status_t pcpu_rwlock_acquire_exclusive(struct pcpu_rwlock *lock,
+				       nstime_t timeout);
+void pcpu_rwlock_release_exclusive(struct pcpu_rwlock *lock);
+
+DEFINE_CLEANUP_CLASS(
+	pcpu_rwlock,
+	{
+		struct pcpu_rwlock *lock;
+		int type;
+	},
+	{
+		switch (ctx->type) {
+		case RWLOCK_GUARD_EXCLUSIVE:
+			pcpu_rwlock_release_exclusive(ctx->lock);
+			break;
+		case RWLOCK_GUARD_SHARED:
+			pcpu_rwlock_release_shared(ctx->lock);
+			break;
+		}
+	},
+	{
+		status_t result = YAK_SUCCESS;
+		if (type == RWLOCK_GUARD_EXCLUSIVE) {
+			result = pcpu_rwlock_acquire_exclusive(lock, timeout);
+		} else if (type == RWLOCK_GUARD_SHARED) {
+			result = pcpu_rwlock_acquire_shared(lock, timeout);
+		}
+
+		EXPECT(result);
+
+		GUARD_RET(pcpu_rwlock, lock, type);
+	},
+	struct pcpu_rwlock *lock, nstime_t timeout, int type);
+
+#if CONFIG_RWLOCK_STRESS
+void pcpu_rwlock_stress();
+#endif
+
 #ifdef __cplusplus
 }
 #endif
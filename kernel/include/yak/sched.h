@@ -11,6 +11,7 @@ extern "C" {
 #include <yak/types.h>
 #include <yak/queue.h>
 #include <yak/timer.h>
+#include <yak/cpu.h>
 #include <yak/process.h>
 #include <yak/arch-sched.h>
 #include <yak/vm/map.h>
@@ -31,6 +32,25 @@ enum {
 	SCHED_PRIO_MAX = 32,
 };
 
+// length of a time-share thread's time slice
+#define SCHED_QUANTUM MSTIME(10)
+// how often each cpu tries to pull work from the busiest cpu
+#define SCHED_BALANCE_INTERVAL MSTIME(100)
+// a thread that ran less than this ago still has a warm cache on its last cpu
+#define SCHED_CACHE_HOT USTIME(500)
+// idle cpus spin this long before halting (if CONFIG_IDLE_POLL)
+#define SCHED_IDLE_POLL USTIME(20)
+// how late sleeps and wait timeouts may fire, unless the thread chose
+#define SCHED_TIMER_SLACK_TIME_SHARE USTIME(50)
+#define SCHED_TIMER_SLACK_REAL_TIME 0
+#define SCHED_TIMER_SLACK_DEFAULT UINT64_MAX
+
+static inline bool sched_is_time_share(unsigned int priority)
+{
+	return priority >= SCHED_PRIO_TIME_SHARE &&
+	       priority <= SCHED_PRIO_TIME_SHARE_END;
+}
+
 // current/soon-to-be state
 enum thread_state {
 	// enqueued
@@ -87,11 +107,31 @@ struct kthread {
 	struct wait_block timeout_wait_block;
 	struct timer timeout_timer;
 
+	// effective priority, may be adjusted by the scheduler
 	unsigned int priority;
+	// priority the thread was created with
+	unsigned int base_priority;
+	// highest priority lent to us by waiters on locks we hold, 0 if none
+	unsigned int inherited_priority;
+	// loans of the priority inheriting locks we hold that have waiters
+	LIST_HEAD(, pi_loan) pi_loans;
 	unsigned int status;
 
-	struct cpu *affinity_cpu;
+	// interactivity accounting
+	bool interactive;
+	nstime_t run_time;
+	nstime_t sleep_time;
+	// when the thread was last switched on
+	nstime_t run_start;
+
+	// SCHED_TIMER_SLACK_DEFAULT picks by scheduling class
+	nstime_t timer_slack;
+
+	// cpus the thread may run on, protected by thread_lock
+	struct cpumask affinity;
 	struct cpu *last_cpu;
+	// when the thread was last switched off
+	nstime_t last_ran;
 
 	/* you can temporarily switch to another vm context */
 	struct vm_map *vm_ctx;
@@ -145,6 +185,10 @@ struct sched {
 	struct runqueue *current_rq;
 	struct runqueue *next_rq;
 
+	// threads on current_rq + next_rq
+	// may be read without the sched lock by load balancing
+	unsigned int nr_ready;
+
 	thread_queue_t idle_rq;
 };
 
@@ -158,6 +202,26 @@ void sched_preempt(struct cpu *cpu);
 void sched_resume(struct kthread *thread);
 void sched_resume_locked(struct kthread *thread);
 
+// Restrict the cpus a thread may run on. The calling thread and queued
+// threads move right away. A thread running or lined up on another cpu is
+// moved by that cpu's next reschedule, which this kicks off.
+void sched_set_affinity(struct kthread *thread, const struct cpumask *mask);
+
+// Slack for the thread's sleeps and wait timeouts
+nstime_t sched_timer_slack(struct kthread *thread);
+
+// Priority inheritance: called by a thread about to block on a lock guarded
+// by obj. The owner (*ownerp) is raised to the caller's priority through the
+// lock's loan, until it releases that lock.
+void sched_lend_priority(struct kobject *obj, struct kthread **ownerp,
+			 struct pi_loan *loan);
+// Called by a waiter that gave up (timeout, abort): the loan drops to the
+// priority of the threads still waiting on obj
+void sched_withdraw_priority(struct kobject *obj, struct pi_loan *loan);
+// Called by the owner after it released the lock and woke the waiters.
+// It keeps what it was lent through the other locks it holds.
+void sched_restore_priority(struct kobject *obj, struct pi_loan *loan);
+
 [[gnu::noreturn]]
 void sched_exit_self();
 
@@ -0,0 +1,49 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <yak/spinlock.h>
+
+// Sequence counter for data that is read far more often than written.
+// Readers never block writers: they retry if a write happened meanwhile.
+// Writers must be serialized by some other lock.
+struct seqcount {
+	unsigned int seq;
+};
+
+#define SEQCOUNT_INITIALIZER() { .seq = 0 }
+
+static inline unsigned int seqcount_read_begin(const struct seqcount *sc)
+{
+	unsigned int seq;
+	// odd: a write is in progress
+	while ((seq = __atomic_load_n(&sc->seq, __ATOMIC_ACQUIRE)) & 1)
+		busyloop_hint();
+	return seq;
+}
+
+static inline bool seqcount_read_retry(const struct seqcount *sc,
+				       unsigned int seq)
+{
+	// keep the protected reads before the recheck
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&sc->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqcount_write_begin(struct seqcount *sc)
+{
+	__atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELAXED);
+	// the odd count has to be visible before any of the new data
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqcount_write_end(struct seqcount *sc)
+{
+	__atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
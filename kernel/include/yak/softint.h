@@ -12,6 +12,8 @@ void softint_issue(ipl_t ipl);
 void softint_issue_other(struct cpu *cpu, ipl_t ipl);
 
 void plat_ipi(struct cpu *cpu);
+// wait for an interrupt, or until the cpu's wakeup line is written to
+void plat_idle(struct cpu *cpu);
 
 #ifdef __cplusplus
 }
@@ -4,39 +4,59 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <yak/arch-cpu.h>
 #include <yak/ipl.h>
 
 // #define SPINLOCK_DEBUG_OWNER
 
-#if defined(SPINLOCK_DEBUG_OWNER)
+#if defined(SPINLOCK_DEBUG_OWNER) || CONFIG_LOCKSTAT
 #define SPINLOCK_DEBUG 1
 #endif
 
 #define SPINLOCK_UNLOCKED 0
 #define SPINLOCK_LOCKED 1
 
+#if CONFIG_LOCKSTAT
+// lock class for lockstat
+#define SPINLOCK_NAME_INIT(n) , .name = (n)
+#define spinlock_set_name(lock, n) ((lock)->name = (n))
+#else
+#define SPINLOCK_NAME_INIT(n)
+#define spinlock_set_name(lock, n) ((void)0)
+#endif
+
 struct spinlock {
 	int state;
 #ifdef SPINLOCK_DEBUG_OWNER
 	struct kthread *owner;
 #endif
+#if CONFIG_LOCKSTAT
+	const char *name;
+#endif
 };
 
-#define SPINLOCK(name) struct spinlock name = SPINLOCK_INITIALIZER()
+#define SPINLOCK(name) \
+	struct spinlock name = SPINLOCK_INITIALIZER_NAMED(#name)
+
+#define SPINLOCK_INITIALIZER() SPINLOCK_INITIALIZER_NAMED(NULL)
 
 #ifdef SPINLOCK_DEBUG_OWNER
-#define SPINLOCK_INITIALIZER() { .state = SPINLOCK_UNLOCKED, .owner = NULL }
-#define spinlock_init(spinlock)                        \
-	do {                                           \
-		(spinlock)->state = SPINLOCK_UNLOCKED; \
-		(spinlock)->owner = NULL;              \
+#define SPINLOCK_INITIALIZER_NAMED(n) \
+	{ .state = SPINLOCK_UNLOCKED, .owner = NULL SPINLOCK_NAME_INIT(n) }
+#define spinlock_init(spinlock)                          \
+	do {                                             \
+		(spinlock)->state = SPINLOCK_UNLOCKED;   \
+		(spinlock)->owner = NULL;                \
+		spinlock_set_name(spinlock, #spinlock); \
 	} while (0)
 #else
-#define SPINLOCK_INITIALIZER() { .state = SPINLOCK_UNLOCKED }
-#define spinlock_init(spinlock)                        \
-	do {                                           \
-		(spinlock)->state = SPINLOCK_UNLOCKED; \
+#define SPINLOCK_INITIALIZER_NAMED(n) \
+	{ .state = SPINLOCK_UNLOCKED SPINLOCK_NAME_INIT(n) }
+#define spinlock_init(spinlock)                          \
+	do {                                             \
+		(spinlock)->state = SPINLOCK_UNLOCKED;   \
+		spinlock_set_name(spinlock, #spinlock); \
 	} while (0)
 #endif
 
@@ -136,6 +156,83 @@ static inline ipl_t ticket_spinlock_lock(struct ticket_spinlock *lock)
 	return ipl;
 }
 
+// MCS queued spinlock: waiters line up in FIFO order and each one spins on
+// its own queue node instead of the shared lock word.
+// Queue nodes are taken from the per-cpu pool in struct cpu and stay in use
+// until the lock is released again, on the same cpu.
+
+// locks a cpu may hold or wait on at once (over all nesting levels)
+#define QSPINLOCK_NODES 8
+
+struct qspinlock_node {
+	struct qspinlock_node *next;
+	int locked;
+};
+
+struct qspinlock {
+	// last waiter in line, or the holder if nobody waits
+	struct qspinlock_node *tail;
+	// node of the current holder
+	struct qspinlock_node *owner;
+#if CONFIG_LOCKSTAT
+	const char *name;
+#endif
+};
+
+#define QSPINLOCK(name) \
+	struct qspinlock name = QSPINLOCK_INITIALIZER_NAMED(#name)
+
+#define QSPINLOCK_INITIALIZER() QSPINLOCK_INITIALIZER_NAMED(NULL)
+#define QSPINLOCK_INITIALIZER_NAMED(n) \
+	{ .tail = NULL, .owner = NULL SPINLOCK_NAME_INIT(n) }
+
+#define qspinlock_init(lock)                                             \
+	do {                                                             \
+		__atomic_store_n(&(lock)->tail, NULL, __ATOMIC_RELEASE); \
+		(lock)->owner = NULL;                                    \
+		spinlock_set_name(lock, #lock);                          \
+	} while (0)
+
+void qspinlock_lock_noipl(struct qspinlock *lock);
+void qspinlock_unlock_noipl(struct qspinlock *lock);
+
+static inline ipl_t qspinlock_lock(struct qspinlock *lock)
+{
+	ipl_t ipl = ripl(IPL_DPC);
+	qspinlock_lock_noipl(lock);
+	return ipl;
+}
+
+static inline void qspinlock_unlock(struct qspinlock *lock, ipl_t ipl)
+{
+	qspinlock_unlock_noipl(lock);
+	xipl(ipl);
+}
+
+static inline int qspinlock_lock_interrupts(struct qspinlock *lock)
+{
+	int state = disable_interrupts();
+	qspinlock_lock_noipl(lock);
+	return state;
+}
+
+static inline void qspinlock_unlock_interrupts(struct qspinlock *lock,
+					       int state)
+{
+	qspinlock_unlock_noipl(lock);
+	if (state)
+		enable_interrupts();
+}
+
+static inline int qspinlock_held(struct qspinlock *lock)
+{
+	return __atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL;
+}
+
+#if CONFIG_SPINLOCK_BENCH
+void spinlock_bench();
+#endif
+
 #ifdef __cplusplus
 }
 #endif
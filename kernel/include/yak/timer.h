@@ -10,6 +10,7 @@ extern "C" {
 #include <yak/types.h>
 #include <yak/dpc.h>
 #include <yak/status.h>
+#include <yak/queue.h>
 
 enum {
 	TIMER_STATE_UNUSED = 1,
@@ -42,11 +43,43 @@ struct timer {
 	struct cpu *cpu;
 
 	nstime_t deadline;
+	// may fire up to this late, to share an interrupt with other timers
+	nstime_t slack;
 	short state;
 
+	// optional; enqueued on the firing cpu once the deadline passed
+	struct dpc *dpc;
+
+	// wheel slot while queued on the timer wheel, -1 on the heap
+	short wheel_slot;
+
 	HEAP_ENTRY(timer) entry;
+	LIST_ENTRY(timer) wheel_entry;
+};
+
+// Timers that don't expire within the current level 0 slot wait on a
+// hierarchical wheel, with O(1) install and uninstall. As their slot comes
+// up, they are re-sorted into finer levels and finally onto the heap,
+// which keeps the exact deadline order.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// level 0 slots are 2^20ns (~1ms) wide, each level is 64 times coarser
+#define TIMER_WHEEL_SHIFT 20
+
+struct timer_wheel {
+	// slots up to here have been sorted out
+	nstime_t clock;
+	size_t count;
+	uint64_t occupied[TIMER_WHEEL_LEVELS];
+	// earliest expiry (deadline + slack) per slot, only ever too early
+	// after an uninstall
+	nstime_t slot_min[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+	LIST_HEAD(, timer) slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
 };
 
+void timer_wheel_init(struct timer_wheel *wheel);
+
 void timer_init(struct timer *timer);
 void timer_reset(struct timer *timer);
 
@@ -56,6 +89,8 @@ void timer_uninstall(struct timer *timer);
 void ksleep(nstime_t ns);
 void kstall(nstime_t ns);
 
+void timer_bench();
+
 #ifdef __cplusplus
 }
 #endif
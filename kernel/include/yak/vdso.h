@@ -0,0 +1,24 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <yak/types.h>
+#include <yak/status.h>
+
+struct vm_map;
+
+// Publish the current clock conversion to userspace.
+// Caller serializes updates (the clocksource lock).
+void vdso_update_clock(int clock_mode, uint64_t base_cycles, nstime_t base_ns,
+		       uint32_t mult, uint32_t shift, nstime_t realtime_offset);
+
+// Map the data page and the vDSO image into a user address space.
+// out receives the address of the vDSO ELF header (for AT_SYSINFO_EHDR).
+status_t vdso_map(struct vm_map *map, vaddr_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -46,7 +46,11 @@ struct vm_map_entry {
 
 	vm_cache_t cache; /*! cache mode */
 
-	RBT_ENTRY(struct vm_map_entry) tree_entry;
+	union {
+		RBT_ENTRY(struct vm_map_entry) tree_entry;
+		// out of the tree, waiting for the TLB shootdown
+		struct vm_map_entry *dead_next;
+	};
 };
 
 typedef RBT_HEAD(vm_map_rbtree, struct vm_map_entry) vm_map_tree_t;
@@ -54,7 +58,7 @@ typedef RBT_HEAD(vm_map_rbtree, struct vm_map_entry) vm_map_tree_t;
 #define VM_MAP_FOREACH(e, head) RBT_FOREACH(e, vm_map_rbtree, (head))
 
 struct vm_map {
-	struct rwlock map_lock;
+	struct pcpu_rwlock map_lock;
 
 	vm_map_tree_t map_tree;
 
@@ -112,6 +116,27 @@ status_t vm_map_mmio(struct vm_map *map, paddr_t device_addr, size_t length,
  */
 status_t vm_unmap_mmio(struct vm_map *map, vaddr_t va);
 
+/*!
+ * @brief Map physical memory owned by the caller
+ *
+ * Unlike @vm_map_mmio, the mapping may be inherited and placed at a fixed
+ * address. The pages are never freed by the VM; used for kernel pages
+ * shared with userspace.
+ *
+ * @param map Target VM map
+ * @param pa Page-aligned physical address
+ * @param length Length of the mapping in bytes
+ * @param prot Memory protection flags (also the maximum protection)
+ * @param inheritance Inheritance mode on fork
+ * @param cache Cache behaviour
+ * @param hint Address hint
+ * @param flags VM_MAP_* flags
+ * @param[out] out On success, receives the vaddr of the mapped region
+ */
+status_t vm_map_phys(struct vm_map *map, paddr_t pa, size_t length,
+		     vm_prot_t prot, vm_inheritance_t inheritance,
+		     vm_cache_t cache, vaddr_t hint, int flags, vaddr_t *out);
+
 /*!
  * @brief Map a VM object or a zero-fill anon space
  *
@@ -156,6 +181,10 @@ status_t vm_map_reserve(struct vm_map *map, vaddr_t hint, size_t length,
 
 void vm_map_activate(struct vm_map *map);
 
+// The current thread won't touch user memory: keep the map loaded, but
+// stop taking its TLB shootdowns until it is activated again.
+void vm_map_lazy();
+
 status_t vm_map_fork(struct vm_map *from, struct vm_map *to);
 
 // i.e. for use during ELF loading from kernel thread -> user process
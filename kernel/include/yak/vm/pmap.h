@@ -11,9 +11,38 @@ extern "C" {
 
 struct pmap {
 	struct cpumask mapped_on;
+	// mapped, but running kernel threads only: shootdowns skip these
+	struct cpumask lazy_on;
+	// lazy cpus that missed a shootdown and flush on their way back
+	struct cpumask stale_on;
 	paddr_t top_level;
+	// never reused, tags the pmap's entries in a cpu's TLB
+	uint64_t id;
+	// bumped by every shootdown: cpus that still have entries tagged
+	// with an older generation flush them when they load the pmap
+	uint64_t tlb_gen;
 };
 
+// 32 * 4k = 128kib
+#define PMAP_GATHER_BATCH 32
+
+// Collects the invalidations of a whole map operation, so the other cpus
+// are interrupted once at pmap_gather_finish() instead of once per range.
+// Our own TLB is still invalidated right away.
+struct pmap_gather {
+	struct pmap *pmap;
+	vaddr_t start;
+	vaddr_t end;
+	size_t level;
+	// freed after the shootdown
+	size_t nfree;
+	paddr_t free[PMAP_GATHER_BATCH];
+};
+
+void pmap_gather_init(struct pmap_gather *gather, struct pmap *pmap);
+
+void pmap_gather_finish(struct pmap_gather *gather);
+
 void pmap_kernel_bootstrap(struct pmap *pmap);
 
 void pmap_init(struct pmap *pmap);
@@ -25,20 +54,38 @@ void pmap_map(struct pmap *pmap, uintptr_t va, uintptr_t pa, size_t level,
 
 paddr_t pmap_unmap(struct pmap *pmap, uintptr_t va, size_t level);
 
+// gather may be NULL: the range is shot down before returning then
+
 void pmap_unmap_range(struct pmap *pmap, uintptr_t va, size_t length,
-		      size_t level);
+		      size_t level, struct pmap_gather *gather);
 
 void pmap_unmap_range_and_free(struct pmap *pmap, uintptr_t va, size_t length,
-			       size_t level);
+			       size_t level, struct pmap_gather *gather);
 
 void pmap_activate(struct pmap *pmap);
 
+// Arch: Invalidate [va, va + length) of pmap on this cpu, in whatever
+// context it is cached. pgsz is the smallest page size in the range.
+// Called at IPL_HIGH.
+void pmap_invalidate_local(struct pmap *pmap, vaddr_t va, size_t length,
+			   size_t pgsz);
+
+// Arch: Does the TLB keep entries of pmaps that aren't loaded?
+bool pmap_tlb_tagged();
+
+// This cpu keeps the pmap loaded while it runs kernel threads only
+void pmap_lazy_enter(struct pmap *pmap);
+
+// Back to using the pmap: catch up on the shootdowns we were spared
+void pmap_lazy_exit(struct pmap *pmap);
+
 void pmap_large_map_range(struct pmap *pmap, uintptr_t base, size_t length,
 			  uintptr_t virtual_base, vm_prot_t prot,
 			  vm_cache_t cache);
 
 void pmap_protect_range(struct pmap *pmap, vaddr_t va, size_t length,
-			vm_prot_t prot, vm_cache_t cache, size_t level);
+			vm_prot_t prot, vm_cache_t cache, size_t level,
+			struct pmap_gather *gather);
 
 #ifdef __cplusplus
 }
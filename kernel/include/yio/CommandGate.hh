@@ -0,0 +1,28 @@
+#pragma once
+
+#include <yio/EventSource.hh>
+
+namespace yak::io
+{
+
+// Runs callers' actions with the work loop's gate closed, so driver entry
+// points are serialized with the loop's event sources and each other.
+// Nothing is queued: the caller runs the action on its own thread.
+class CommandGate : public EventSource {
+	IO_OBJ_DECLARE(CommandGate);
+
+    public:
+	static CommandGate *commandGate(Object *owner,
+					EventSource::Action action = nullptr);
+
+	// Runs the gate's action
+	Status runCommand(void *arg0 = nullptr, void *arg1 = nullptr,
+			  void *arg2 = nullptr, void *arg3 = nullptr);
+
+	// Thread context only. Recursive from inside an action.
+	Status runAction(EventSource::Action action, void *arg0 = nullptr,
+			 void *arg1 = nullptr, void *arg2 = nullptr,
+			 void *arg3 = nullptr);
+};
+
+}
@@ -7,29 +7,41 @@
 
 namespace yak::io
 {
-class EventSource : Object {
+// Something that produces work for a WorkLoop. Producers call
+// signalWorkAvailable(), the loop thread then calls checkForWork() with
+// the gate closed until it returns false.
+class EventSource : public Object {
 	IO_OBJ_DECLARE(EventSource);
 
     public:
 	using Action = Status (*)(Object *owner, void *arg0, void *arg1,
 				  void *arg2, void *arg3);
 
-    private:
+    protected:
 	void init() override;
 	void deinit() override;
 
     public:
 	virtual void init(Object *owner, EventSource::Action action = nullptr);
 
+	// Runs the pending work, returns true if there is more of it
 	virtual bool checkForWork();
 	void signalWorkAvailable();
 
-	void enable();
-	void disable();
+	virtual void setWorkLoop(WorkLoop *workLoop);
+
+	virtual void enable();
+	virtual void disable();
 
 	WorkLoop *workLoop;
 	Action action;
 	Object *owner;
 	bool enabled;
+
+    private:
+	friend class WorkLoop;
+
+	// the loop's list of sources
+	EventSource *next_;
 };
 }
@@ -1,8 +1,60 @@
 #pragma once
 
+#include <yak/irq.h>
+#include <yak/dpc.h>
 #include <yio/EventSource.hh>
 
 namespace yak::io
 {
-class InterruptEventSource : EventSource {};
+// Moves interrupt handling onto the work loop. The interrupt only counts
+// and kicks a DPC, which wakes the loop; the action then sees all
+// interrupts since its last run at once.
+// The last reference has to be dropped in thread context: freeing waits
+// for the DPC.
+class InterruptEventSource : public EventSource {
+	IO_OBJ_DECLARE(InterruptEventSource);
+
+    public:
+	// Work loop context, count is at least 1
+	using Action = void (*)(Object *owner, InterruptEventSource *sender,
+				size_t count);
+	// Interrupt context: returns false if the interrupt isn't ours. Has
+	// to quiet the device for level-triggered sources.
+	using Filter = bool (*)(Object *owner, InterruptEventSource *sender);
+
+	static InterruptEventSource *
+	interruptEventSource(Object *owner, Action action,
+			     Filter filter = nullptr);
+
+	// Allocate it with irq_alloc_* or PciDevice::allocMsi/allocMsix
+	struct irq_object *irqObject()
+	{
+		return &irqObj_;
+	}
+
+	// For drivers that take the interrupt themselves. Any IPL.
+	void interruptOccurred();
+
+	bool checkForWork() override;
+
+    protected:
+	void init() override;
+	void deinit() override;
+
+    private:
+	static int handleInterrupt(void *arg);
+	static void handleDpc(struct dpc *dpc, void *ctx);
+
+	Action intAction_;
+	Filter filter_;
+
+	struct irq_object irqObj_;
+	struct dpc dpc_;
+	// a DPC is on its way, so further interrupts don't queue one
+	bool dpcPending_;
+
+	size_t produced_;
+	// only touched by the loop
+	size_t consumed_;
+};
 }
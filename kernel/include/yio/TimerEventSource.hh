@@ -0,0 +1,59 @@
+#pragma once
+
+#include <yak/timer.h>
+#include <yak/dpc.h>
+#include <yakpp/SpinLock.hh>
+#include <yio/EventSource.hh>
+
+namespace yak::io
+{
+
+class TimerEventSource;
+
+// one shot of the timer, the DPC gets to us through it
+struct TimerEventShot {
+	struct timer timer;
+	struct dpc dpc;
+	TimerEventSource *source;
+};
+
+// One-shot timeouts on the timer wheel, with the action on the work loop
+// The last reference has to be dropped in thread context: freeing waits
+// for the DPC.
+class TimerEventSource : public EventSource {
+	IO_OBJ_DECLARE(TimerEventSource);
+
+    public:
+	// Work loop context
+	using Action = void (*)(Object *owner, TimerEventSource *sender);
+
+	static TimerEventSource *timerEventSource(Object *owner,
+						  Action action);
+
+	// Fire ns from now, replaces a pending timeout
+	Status setTimeout(nstime_t ns);
+	// The action won't run for a timeout cancelled from the work loop
+	void cancelTimeout();
+
+	bool checkForWork() override;
+
+    protected:
+	void init() override;
+	void deinit() override;
+
+    private:
+	static void handleDpc(struct dpc *dpc, void *ctx);
+
+	Action timerAction_;
+
+	// orders the DPC against re-arming and cancelling
+	SpinLock lock_;
+	TimerEventShot shot_;
+	// bumped on every setTimeout and cancelTimeout
+	uint64_t gen_;
+	// gen_ at the time the timer was installed
+	uint64_t armedGen_;
+	bool fired_;
+};
+
+}
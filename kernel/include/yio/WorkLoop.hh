@@ -1,6 +1,5 @@
 #pragma once
 
-#include <yakpp/SpinLock.hh>
 #include <yakpp/Mutex.hh>
 #include <yakpp/Event.hh>
 #include <yakpp/Object.hh>
@@ -9,7 +8,12 @@
 namespace yak::io
 {
 
-class WorkLoop : Object {
+class EventSource;
+
+// A thread that runs the deferred work of its event sources. Sources run
+// one at a time with the gate closed, which serializes them with anyone
+// entering the driver through a CommandGate.
+class WorkLoop : public Object {
 	IO_OBJ_DECLARE(WorkLoop);
 
     public:
@@ -17,14 +21,32 @@ class WorkLoop : Object {
 
 	static WorkLoop *workLoop();
 
+	// Thread context only
+	void addEventSource(EventSource *source);
+	void removeEventSource(EventSource *source);
+
+	// Callable up to IPL_DPC
 	void wake();
 
 	void threadMain();
 
 	bool onThread();
 
+	// Recursive for the thread holding it
+	void closeGate();
+	void openGate();
+	bool inGate();
+
     private:
-	SpinLock queueLock_;
+	bool runEventSources();
+
+	// protected by the gate
+	EventSource *sources_ = nullptr;
+	bool sourcesChanged_ = false;
+
+	Mutex gateLock_;
+	Thread *gateOwner_ = nullptr;
+	size_t gateDepth_ = 0;
 
 	Event wakeEvent_;
 	Thread *workThread_;
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <yak/queue.h>
+#include <yak/irq.h>
+#include <yak/status.h>
+#include <yak/types.h>
 #include <yio/pci/PciPersonality.hh>
 #include <yio/pci/Pci.hh>
 
@@ -18,9 +21,60 @@ struct PciDevice : public Service {
 	void initWithPci(uint32_t segment, uint32_t bus, uint32_t slot,
 			 uint32_t function);
 
+	// offset of the capability in config space, 0 if there is none
+	uint8_t findCapability(uint8_t id);
+
+	// Physical address of a memory BAR, 0 for I/O BARs
+	paddr_t barAddress(unsigned int bar);
+
+	// Message signaled interrupts: every vector belongs to one
+	// irq_object alone and is delivered to the cpu asked for. They can
+	// be moved later on with irq_retarget() and irq_set_affinity().
+	//
+	// Plain MSI is limited to a single message, more would need a block
+	// of aligned vectors. Use MSI-X for multiple queues.
+	bool hasMsi()
+	{
+		return msiCap_ != 0;
+	}
+
+	// number of MSI-X table entries, 0 without MSI-X
+	size_t msixCount()
+	{
+		return msixCount_;
+	}
+
+	status_t allocMsi(struct irq_object *obj, ipl_t ipl, size_t cpu);
+
+	status_t allocMsix(size_t index, struct irq_object *obj, ipl_t ipl,
+			   size_t cpu);
+	void maskMsix(size_t index, bool masked);
+
     private:
+	static status_t retargetMessage(struct irq_object *obj, size_t cpu);
+	status_t setMsiTarget(size_t cpu);
+	status_t setMsixTarget(size_t index, size_t cpu);
+
+	uint32_t cfgRead32(uint32_t offset);
+	uint16_t cfgRead16(uint32_t offset);
+	void cfgWrite32(uint32_t offset, uint32_t value);
+	void cfgWrite16(uint32_t offset, uint16_t value);
+
+	void disableIntx();
+	status_t mapMsixTable();
+	volatile uint32_t *msixEntry(size_t index);
+
 	PciPersonality personality;
 	PciCoordinates coords;
+
+	uint8_t msiCap_ = 0;
+	struct irq_object *msiObj_ = nullptr;
+
+	uint8_t msixCap_ = 0;
+	size_t msixCount_ = 0;
+	vaddr_t msixTable_ = 0;
+	// who owns which table entry
+	struct irq_object **msixObjs_ = nullptr;
 };
 
 }
@@ -0,0 +1,45 @@
+#include <yakpp/meta.hh>
+#include <yio/CommandGate.hh>
+
+namespace yak::io
+{
+
+IO_OBJ_DEFINE(CommandGate, EventSource);
+#define super EventSource
+
+CommandGate *CommandGate::commandGate(Object *owner,
+				      EventSource::Action action)
+{
+	CommandGate *gate;
+	ALLOC_INIT(gate, CommandGate);
+	gate->init(owner, action);
+	return gate;
+}
+
+Status CommandGate::runCommand(void *arg0, void *arg1, void *arg2, void *arg3)
+{
+	return runAction(action, arg0, arg1, arg2, arg3);
+}
+
+Status CommandGate::runAction(EventSource::Action action, void *arg0,
+			      void *arg1, void *arg2, void *arg3)
+{
+	if (!action)
+		return YAK_INVALID_ARGS;
+
+	auto loop = workLoop;
+	// not added to a loop yet, or on its way out
+	if (!loop)
+		return YAK_NODEV;
+
+	loop->closeGate();
+
+	Status status = enabled ? action(owner, arg0, arg1, arg2, arg3) :
+				  YAK_BUSY;
+
+	loop->openGate();
+
+	return status;
+}
+
+}
@@ -15,6 +15,8 @@ void EventSource::init()
 	owner = nullptr;
 	workLoop = nullptr;
 	action = nullptr;
+	enabled = true;
+	next_ = nullptr;
 }
 
 void EventSource::init(Object *owner, EventSource::Action action)
@@ -31,6 +33,8 @@ void EventSource::deinit()
 		owner->release();
 		owner = nullptr;
 	}
+
+	super::deinit();
 }
 
 bool EventSource::checkForWork()
@@ -40,9 +44,16 @@ bool EventSource::checkForWork()
 
 void EventSource::signalWorkAvailable()
 {
-	if (!workLoop)
+	// may race with removal, the loop copes with a spurious wakeup
+	auto loop = __atomic_load_n(&workLoop, __ATOMIC_ACQUIRE);
+	if (!loop)
 		return;
-	workLoop->wake();
+	loop->wake();
+}
+
+void EventSource::setWorkLoop(WorkLoop *workLoop)
+{
+	__atomic_store_n(&this->workLoop, workLoop, __ATOMIC_RELEASE);
 }
 
 void EventSource::enable()
@@ -0,0 +1,96 @@
+#include <yak/irq.h>
+#include <yak/dpc.h>
+#include <yakpp/meta.hh>
+#include <yio/InterruptEventSource.hh>
+
+namespace yak::io
+{
+
+IO_OBJ_DEFINE(InterruptEventSource, EventSource);
+#define super EventSource
+
+void InterruptEventSource::init()
+{
+	super::init();
+
+	intAction_ = nullptr;
+	filter_ = nullptr;
+	irq_object_init(&irqObj_, handleInterrupt, this);
+	dpc_init(&dpc_, handleDpc);
+	dpcPending_ = false;
+	produced_ = 0;
+	consumed_ = 0;
+}
+
+void InterruptEventSource::deinit()
+{
+	// the driver silenced the device before dropping us
+	if (irqObj_.slot)
+		irq_free(&irqObj_);
+	// no interrupt queues it anymore: drain the last one
+	dpc_cancel_sync(&dpc_);
+
+	super::deinit();
+}
+
+InterruptEventSource *
+InterruptEventSource::interruptEventSource(Object *owner, Action action,
+					   Filter filter)
+{
+	InterruptEventSource *ies;
+	ALLOC_INIT(ies, InterruptEventSource);
+	ies->EventSource::init(owner);
+	ies->intAction_ = action;
+	ies->filter_ = filter;
+	return ies;
+}
+
+int InterruptEventSource::handleInterrupt(void *arg)
+{
+	auto ies = static_cast<InterruptEventSource *>(arg);
+
+	if (ies->filter_ && !ies->filter_(ies->owner, ies))
+		return IRQ_NACK;
+
+	ies->interruptOccurred();
+	return IRQ_ACK;
+}
+
+// We can't wake the loop from device IPL: take the detour through a DPC
+void InterruptEventSource::handleDpc([[maybe_unused]] struct dpc *dpc,
+				     void *ctx)
+{
+	auto ies = static_cast<InterruptEventSource *>(ctx);
+
+	// interrupts from here on queue another DPC
+	__atomic_store_n(&ies->dpcPending_, false, __ATOMIC_SEQ_CST);
+	ies->signalWorkAvailable();
+}
+
+void InterruptEventSource::interruptOccurred()
+{
+	__atomic_fetch_add(&produced_, 1, __ATOMIC_RELEASE);
+
+	// the interrupt may move between cpus: the flag keeps the DPC on
+	// one queue at a time
+	if (!__atomic_exchange_n(&dpcPending_, true, __ATOMIC_SEQ_CST))
+		dpc_enqueue(&dpc_, this);
+}
+
+bool InterruptEventSource::checkForWork()
+{
+	size_t produced = __atomic_load_n(&produced_, __ATOMIC_ACQUIRE);
+	if (produced == consumed_)
+		return false;
+
+	size_t count = produced - consumed_;
+	consumed_ = produced;
+
+	if (intAction_)
+		intAction_(owner, this, count);
+
+	// more came in while the action ran
+	return __atomic_load_n(&produced_, __ATOMIC_ACQUIRE) != consumed_;
+}
+
+}
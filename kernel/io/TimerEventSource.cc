@@ -0,0 +1,101 @@
+#include <yak/timer.h>
+#include <yak/dpc.h>
+#include <yak/macro.h>
+#include <yakpp/meta.hh>
+#include <yio/TimerEventSource.hh>
+
+namespace yak::io
+{
+
+IO_OBJ_DEFINE(TimerEventSource, EventSource);
+#define super EventSource
+
+void TimerEventSource::init()
+{
+	super::init();
+
+	timerAction_ = nullptr;
+	lock_.init();
+	timer_init(&shot_.timer);
+	dpc_init(&shot_.dpc, handleDpc);
+	shot_.timer.dpc = &shot_.dpc;
+	shot_.source = this;
+	gen_ = 0;
+	armedGen_ = 0;
+	fired_ = false;
+}
+
+void TimerEventSource::deinit()
+{
+	// a timer that fired already queued its DPC before this returns
+	cancelTimeout();
+	// it may be queued on, or running on, the cpu the timer fired on
+	dpc_cancel_sync(&shot_.dpc);
+
+	super::deinit();
+}
+
+TimerEventSource *TimerEventSource::timerEventSource(Object *owner,
+						     Action action)
+{
+	TimerEventSource *tes;
+	ALLOC_INIT(tes, TimerEventSource);
+	tes->EventSource::init(owner);
+	tes->timerAction_ = action;
+	return tes;
+}
+
+void TimerEventSource::handleDpc([[maybe_unused]] struct dpc *dpc, void *ctx)
+{
+	auto shot = container_of(static_cast<struct timer *>(ctx),
+				 TimerEventShot, timer);
+	auto tes = shot->source;
+
+	tes->lock_.lock();
+	// a stale DPC: the timer was cancelled or re-armed since it fired
+	if (__atomic_load_n(&shot->timer.state, __ATOMIC_ACQUIRE) !=
+		    TIMER_STATE_FIRED ||
+	    tes->armedGen_ != tes->gen_) {
+		tes->lock_.unlock();
+		return;
+	}
+	tes->fired_ = true;
+	tes->lock_.unlock();
+
+	tes->signalWorkAvailable();
+}
+
+Status TimerEventSource::setTimeout(nstime_t ns)
+{
+	lock_.lock();
+	timer_uninstall(&shot_.timer);
+	fired_ = false;
+	armedGen_ = ++gen_;
+	Status status = timer_install(&shot_.timer, ns);
+	lock_.unlock();
+	return status;
+}
+
+void TimerEventSource::cancelTimeout()
+{
+	lock_.lock();
+	timer_uninstall(&shot_.timer);
+	fired_ = false;
+	++gen_;
+	lock_.unlock();
+}
+
+bool TimerEventSource::checkForWork()
+{
+	lock_.lock();
+	bool fired = fired_;
+	fired_ = false;
+	lock_.unlock();
+
+	if (fired && timerAction_)
+		timerAction_(owner, this);
+
+	return false;
+}
+
+}
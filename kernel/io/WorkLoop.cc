@@ -1,8 +1,10 @@
+#include <assert.h>
 #include <yak/wait.h>
 #include <yak/sched.h>
 #include <yakpp/meta.hh>
 #include <yakpp/Event.hh>
 #include <yio/WorkLoop.hh>
+#include <yio/EventSource.hh>
 #include <yak/log.h>
 #include <yak/cpudata.h>
 
@@ -12,10 +14,37 @@ namespace yak::io
 IO_OBJ_DEFINE(WorkLoop, Object);
 #define super Object
 
+// Returns true if a source has more work or the list changed under us
+bool WorkLoop::runEventSources()
+{
+	bool more = false;
+
+	sourcesChanged_ = false;
+	for (auto source = sources_; source; source = source->next_) {
+		if (!source->enabled)
+			continue;
+
+		if (source->checkForWork())
+			more = true;
+
+		// an action added or removed a source: start over
+		if (sourcesChanged_)
+			return true;
+	}
+
+	return more;
+}
+
 void WorkLoop::threadMain()
 {
 	while (true) {
+		// sync event: a wake() while we're busy keeps it signalled
 		wakeEvent_.wait();
+
+		closeGate();
+		while (runEventSources())
+			;
+		openGate();
 	}
 }
 
@@ -28,6 +57,9 @@ static void enterWorkLoopMain(void *ctx)
 
 void WorkLoop::init()
 {
+	super::init();
+
+	gateLock_.init("workloop gate");
 	wakeEvent_.init(false, Event::kEventSync);
 
 	kernel_thread_create("workloop", SCHED_PRIO_TIME_SHARE_END,
@@ -41,9 +73,77 @@ WorkLoop *WorkLoop::workLoop()
 	return wl;
 }
 
+void WorkLoop::addEventSource(EventSource *source)
+{
+	assert(source->workLoop == nullptr);
+
+	source->retain();
+
+	closeGate();
+	source->setWorkLoop(this);
+	source->next_ = sources_;
+	sources_ = source;
+	sourcesChanged_ = true;
+	openGate();
+
+	// it may have work pending already
+	wake();
+}
+
+void WorkLoop::removeEventSource(EventSource *source)
+{
+	closeGate();
+	for (auto link = &sources_; *link; link = &(*link)->next_) {
+		if (*link != source)
+			continue;
+
+		*link = source->next_;
+		source->next_ = nullptr;
+		source->setWorkLoop(nullptr);
+		sourcesChanged_ = true;
+		openGate();
+
+		source->release();
+		return;
+	}
+	openGate();
+}
+
+void WorkLoop::wake()
+{
+	wakeEvent_.alarm(false);
+}
+
 bool WorkLoop::onThread()
 {
 	return curthread() == workThread_;
 }
 
+void WorkLoop::closeGate()
+{
+	if (gateOwner_ == curthread()) {
+		gateDepth_++;
+		return;
+	}
+
+	EXPECT(gateLock_.lock());
+	gateOwner_ = curthread();
+	gateDepth_ = 1;
+}
+
+void WorkLoop::openGate()
+{
+	assert(gateOwner_ == curthread());
+	if (--gateDepth_ > 0)
+		return;
+
+	gateOwner_ = nullptr;
+	gateLock_.unlock();
+}
+
+bool WorkLoop::inGate()
+{
+	return gateOwner_ == curthread();
+}
+
 }
@@ -399,13 +399,15 @@ uacpi_status uacpi_kernel_install_interrupt_handler(
 	handle->uacpi_ctx = ctx;
 
 	irq_object_init(&handle->obj, handle_uacpi_interrupt, handle);
-	EXPECT(irq_alloc_ipl(&handle->obj, IPL_DEVICE, IRQ_MIN_IPL,
-			     PIN_CONFIG_ANY));
+	EXPECT(irq_alloc_ipl(&handle->obj, IPL_DEVICE,
+			     IRQ_MIN_IPL | IRQ_MOVEABLE, PIN_CONFIG_ANY));
 
 	pr_info("glue irq obj vector: %d\n", handle->obj.slot->vector);
 
 	// hook up in interrupt controller
 	arch_program_intr(irq, handle->obj.slot->vector, false);
+	irq_object_set_retarget(&handle->obj, arch_retarget_intr,
+				(void *)(uintptr_t)irq, 0);
 
 	*out_irq_handle = handle;
 	return UACPI_STATUS_OK;
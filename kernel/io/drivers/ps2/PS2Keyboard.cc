@@ -265,10 +265,12 @@ class Ps2Keyboard final : public Service {
 			cmd_port_, data_port_, gsi_);
 
 		irq_object_init(&irqobj_, ps2_irq_handler, this);
-		irq_alloc_ipl(&irqobj_, IPL_DEVICE, IRQ_MIN_IPL,
+		irq_alloc_ipl(&irqobj_, IPL_DEVICE, IRQ_MIN_IPL | IRQ_MOVEABLE,
 			      { .trigger = pin_config::PIN_TRG_LEVEL,
 				.polarity = pin_config::PIN_POL_LOW });
 		arch_program_intr(gsi_, irqobj_.slot->vector, false);
+		irq_object_set_retarget(&irqobj_, arch_retarget_intr,
+					(void *)(uintptr_t)gsi_, 0);
 
 		uacpi_free_resources(kb_res);
 
@@ -1,8 +1,13 @@
+#define pr_fmt(fmt) "PciDevice: " fmt
+
 #include <stdint.h>
 #include <nanoprintf.h>
 #include <yio/pci.h>
 #include <yio/pci/Pci.hh>
 #include <yak/log.h>
+#include <yak/heap.h>
+#include <yak/macro.h>
+#include <yak/vm/map.h>
 #include <yio/pci/PciBus.hh>
 #include <yio/pci/PciDevice.hh>
 
@@ -15,6 +20,44 @@ namespace yak::io
 IO_OBJ_DEFINE(PciDevice, Service);
 #define super Device
 
+namespace
+{
+
+constexpr uint32_t PCI_COMMAND = 0x04;
+constexpr uint16_t PCI_COMMAND_MEMORY = 1 << 1;
+constexpr uint16_t PCI_COMMAND_INTX_DISABLE = 1 << 10;
+constexpr uint32_t PCI_STATUS = 0x06;
+constexpr uint16_t PCI_STATUS_CAP_LIST = 1 << 4;
+constexpr uint32_t PCI_BAR0 = 0x10;
+constexpr uint32_t PCI_CAP_PTR = 0x34;
+
+constexpr uint8_t PCI_CAP_MSI = 0x05;
+constexpr uint8_t PCI_CAP_MSIX = 0x11;
+
+constexpr uint32_t MSI_CTRL = 0x02;
+constexpr uint16_t MSI_CTRL_ENABLE = 1 << 0;
+constexpr uint16_t MSI_CTRL_MME = 0b111 << 4;
+constexpr uint16_t MSI_CTRL_64BIT = 1 << 7;
+constexpr uint32_t MSI_ADDR_LO = 0x04;
+constexpr uint32_t MSI_ADDR_HI = 0x08;
+
+constexpr uint32_t MSIX_CTRL = 0x02;
+constexpr uint16_t MSIX_CTRL_SIZE = 0x7FF;
+constexpr uint16_t MSIX_CTRL_MASKALL = 1 << 14;
+constexpr uint16_t MSIX_CTRL_ENABLE = 1 << 15;
+constexpr uint32_t MSIX_TABLE = 0x04;
+constexpr uint32_t MSIX_BIR = 0b111;
+
+// MSI-X table entry size in bytes, the fields below are dword indices
+constexpr size_t MSIX_ENTRY_SIZE = 16;
+constexpr size_t MSIX_ADDR_LO = 0;
+constexpr size_t MSIX_ADDR_HI = 1;
+constexpr size_t MSIX_DATA = 2;
+constexpr size_t MSIX_VECTOR_CTRL = 3;
+constexpr uint32_t MSIX_VECTOR_MASKED = 1 << 0;
+
+}
+
 void PciDevice::init()
 {
 	Service::init();
@@ -38,6 +81,13 @@ void PciDevice::initWithPci(uint32_t segment, uint32_t bus, uint32_t slot,
 	npf_snprintf(buf, 32, "PciDev[%d-%d.%02d@%d]", segment, bus, slot,
 		     function);
 	name = String::fromCStr(buf);
+
+	msiCap_ = findCapability(PCI_CAP_MSI);
+	msixCap_ = findCapability(PCI_CAP_MSIX);
+	if (msixCap_) {
+		auto ctrl = cfgRead16(msixCap_ + MSIX_CTRL);
+		msixCount_ = (ctrl & MSIX_CTRL_SIZE) + 1;
+	}
 }
 
 Personality *PciDevice::getPersonality()
@@ -45,4 +95,253 @@ Personality *PciDevice::getPersonality()
 	return &personality;
 }
 
+uint32_t PciDevice::cfgRead32(uint32_t offset)
+{
+	return pci_read32(coords.segment, coords.bus, coords.slot,
+			  coords.function, offset);
+}
+
+uint16_t PciDevice::cfgRead16(uint32_t offset)
+{
+	return pci_read16(coords.segment, coords.bus, coords.slot,
+			  coords.function, offset);
+}
+
+void PciDevice::cfgWrite32(uint32_t offset, uint32_t value)
+{
+	pci_write32(coords.segment, coords.bus, coords.slot, coords.function,
+		    offset, value);
+}
+
+void PciDevice::cfgWrite16(uint32_t offset, uint16_t value)
+{
+	pci_write16(coords.segment, coords.bus, coords.slot, coords.function,
+		    offset, value);
+}
+
+uint8_t PciDevice::findCapability(uint8_t id)
+{
+	if (!(cfgRead16(PCI_STATUS) & PCI_STATUS_CAP_LIST))
+		return 0;
+
+	uint8_t ptr = cfgRead32(PCI_CAP_PTR) & 0xFC;
+	// 48 capabilities fit into config space: don't loop on broken lists
+	for (int ttl = 48; ptr && ttl > 0; ttl--) {
+		auto header = cfgRead16(ptr);
+		if ((header & 0xFF) == id)
+			return ptr;
+		ptr = (header >> 8) & 0xFC;
+	}
+
+	return 0;
+}
+
+paddr_t PciDevice::barAddress(unsigned int bar)
+{
+	assert(bar < 6);
+	auto low = cfgRead32(PCI_BAR0 + bar * 4);
+	if (low & 1)
+		return 0;
+
+	paddr_t addr = low & ~0xFULL;
+	// 64-bit BAR: the next one holds the upper half
+	if (((low >> 1) & 0b11) == 0b10 && bar < 5)
+		addr |= (paddr_t)cfgRead32(PCI_BAR0 + (bar + 1) * 4) << 32;
+	return addr;
+}
+
+// Messages only: keep the legacy line quiet
+void PciDevice::disableIntx()
+{
+	auto cmd = cfgRead16(PCI_COMMAND);
+	cfgWrite16(PCI_COMMAND, cmd | PCI_COMMAND_INTX_DISABLE);
+}
+
+status_t PciDevice::allocMsi(struct irq_object *obj, ipl_t ipl, size_t cpu)
+{
+	if (!msiCap_)
+		return YAK_NOT_SUPPORTED;
+	if (msiObj_ || msixTable_)
+		return YAK_BUSY;
+
+	TRY(irq_alloc_ipl(obj, ipl, IRQ_MIN_IPL | IRQ_MOVEABLE,
+			  PIN_CONFIG_ANY));
+
+	uint64_t addr;
+	uint32_t data;
+	status_t rv = plat_msi_message(obj->slot->vector, cpu, &addr, &data);
+	IF_ERR(rv)
+	{
+		irq_free(obj);
+		return rv;
+	}
+
+	auto ctrl = cfgRead16(msiCap_ + MSI_CTRL);
+	bool is64 = ctrl & MSI_CTRL_64BIT;
+
+	cfgWrite32(msiCap_ + MSI_ADDR_LO, (uint32_t)addr);
+	if (is64)
+		cfgWrite32(msiCap_ + MSI_ADDR_HI, (uint32_t)(addr >> 32));
+	cfgWrite16(msiCap_ + (is64 ? 0x0C : 0x08), (uint16_t)data);
+
+	msiObj_ = obj;
+	irq_object_set_retarget(obj, retargetMessage, this, cpu);
+
+	disableIntx();
+	// a single message
+	ctrl &= ~MSI_CTRL_MME;
+	cfgWrite16(msiCap_ + MSI_CTRL, ctrl | MSI_CTRL_ENABLE);
+
+	return YAK_SUCCESS;
+}
+
+// irq_retarget_fn for all of our messages. Called with the irq lock held
+status_t PciDevice::retargetMessage(struct irq_object *obj, size_t cpu)
+{
+	auto dev = static_cast<PciDevice *>(obj->retarget_arg);
+
+	if (obj == dev->msiObj_)
+		return dev->setMsiTarget(cpu);
+
+	for (size_t i = 0; i < dev->msixCount_; i++) {
+		if (dev->msixObjs_[i] == obj)
+			return dev->setMsixTarget(i, cpu);
+	}
+
+	return YAK_NOENT;
+}
+
+status_t PciDevice::setMsiTarget(size_t cpu)
+{
+	if (!msiObj_)
+		return YAK_NOENT;
+
+	uint64_t addr;
+	uint32_t data;
+	TRY(plat_msi_message(msiObj_->slot->vector, cpu, &addr, &data));
+
+	// the data stays the same: the address is a single write
+	cfgWrite32(msiCap_ + MSI_ADDR_LO, (uint32_t)addr);
+
+	return YAK_SUCCESS;
+}
+
+status_t PciDevice::mapMsixTable()
+{
+	auto table = cfgRead32(msixCap_ + MSIX_TABLE);
+	paddr_t base = barAddress(table & MSIX_BIR);
+	if (base == 0)
+		return YAK_NODEV;
+	base += table & ~MSIX_BIR;
+
+	paddr_t start = ALIGN_DOWN(base, PAGE_SIZE);
+	size_t length = ALIGN_UP(base + msixCount_ * MSIX_ENTRY_SIZE - start,
+				 PAGE_SIZE);
+
+	vaddr_t va;
+	TRY(vm_map_mmio(kmap(), start, length, VM_RW, VM_CACHE_DISABLE, &va));
+
+	msixObjs_ = (struct irq_object **)kcalloc(msixCount_,
+						   sizeof(struct irq_object *));
+	if (!msixObjs_) {
+		vm_unmap_mmio(kmap(), va);
+		return YAK_OOM;
+	}
+
+	auto cmd = cfgRead16(PCI_COMMAND);
+	cfgWrite16(PCI_COMMAND, cmd | PCI_COMMAND_MEMORY);
+
+	msixTable_ = va + (base - start);
+
+	// enable with everything masked, entries are unmasked one by one
+	for (size_t i = 0; i < msixCount_; i++)
+		msixEntry(i)[MSIX_VECTOR_CTRL] = MSIX_VECTOR_MASKED;
+
+	disableIntx();
+	auto ctrl = cfgRead16(msixCap_ + MSIX_CTRL);
+	cfgWrite16(msixCap_ + MSIX_CTRL,
+		   ctrl | MSIX_CTRL_ENABLE | MSIX_CTRL_MASKALL);
+	cfgWrite16(msixCap_ + MSIX_CTRL,
+		   (ctrl | MSIX_CTRL_ENABLE) & ~MSIX_CTRL_MASKALL);
+
+	return YAK_SUCCESS;
+}
+
+volatile uint32_t *PciDevice::msixEntry(size_t index)
+{
+	return reinterpret_cast<volatile uint32_t *>(msixTable_ +
+						     index * MSIX_ENTRY_SIZE);
+}
+
+status_t PciDevice::allocMsix(size_t index, struct irq_object *obj, ipl_t ipl,
+			      size_t cpu)
+{
+	if (!msixCap_)
+		return YAK_NOT_SUPPORTED;
+	if (index >= msixCount_)
+		return YAK_INVALID_ARGS;
+	if (msiObj_)
+		return YAK_BUSY;
+
+	if (!msixTable_)
+		TRY(mapMsixTable());
+
+	if (msixObjs_[index])
+		return YAK_BUSY;
+
+	TRY(irq_alloc_ipl(obj, ipl, IRQ_MIN_IPL | IRQ_MOVEABLE,
+			  PIN_CONFIG_ANY));
+
+	uint64_t addr;
+	uint32_t data;
+	status_t rv = plat_msi_message(obj->slot->vector, cpu, &addr, &data);
+	IF_ERR(rv)
+	{
+		irq_free(obj);
+		return rv;
+	}
+
+	msixObjs_[index] = obj;
+	irq_object_set_retarget(obj, retargetMessage, this, cpu);
+
+	auto entry = msixEntry(index);
+	entry[MSIX_VECTOR_CTRL] = MSIX_VECTOR_MASKED;
+	entry[MSIX_ADDR_LO] = (uint32_t)addr;
+	entry[MSIX_ADDR_HI] = (uint32_t)(addr >> 32);
+	entry[MSIX_DATA] = data;
+	entry[MSIX_VECTOR_CTRL] = 0;
+
+	return YAK_SUCCESS;
+}
+
+status_t PciDevice::setMsixTarget(size_t index, size_t cpu)
+{
+	if (index >= msixCount_ || !msixObjs_ || !msixObjs_[index])
+		return YAK_NOENT;
+
+	uint64_t addr;
+	uint32_t data;
+	TRY(plat_msi_message(msixObjs_[index]->slot->vector, cpu, &addr,
+			     &data));
+
+	// masked, the device holds messages back (in the PBA) until the
+	// entry is consistent again
+	auto entry = msixEntry(index);
+	auto vctrl = entry[MSIX_VECTOR_CTRL];
+	entry[MSIX_VECTOR_CTRL] = vctrl | MSIX_VECTOR_MASKED;
+	entry[MSIX_ADDR_LO] = (uint32_t)addr;
+	entry[MSIX_ADDR_HI] = (uint32_t)(addr >> 32);
+	entry[MSIX_DATA] = data;
+	entry[MSIX_VECTOR_CTRL] = vctrl;
+
+	return YAK_SUCCESS;
+}
+
+void PciDevice::maskMsix(size_t index, bool masked)
+{
+	assert(index < msixCount_ && msixTable_);
+	auto entry = msixEntry(index);
+	entry[MSIX_VECTOR_CTRL] = masked ? MSIX_VECTOR_MASKED : 0;
+}
+
 }
@@ -13,10 +13,13 @@ uint32_t pci_read32(uint32_t segment, uint32_t bus, uint32_t slot,
 	return plat_pci_read32(segment, bus, slot, function, offset);
 }
 
+// The platform accessors only take dword aligned offsets: the narrower
+// ones pick their bytes out of the containing dword
 uint16_t pci_read16(uint32_t segment, uint32_t bus, uint32_t slot,
 		    uint32_t function, uint32_t offset)
 {
-	return (plat_pci_read32(segment, bus, slot, function, offset) >>
+	return (plat_pci_read32(segment, bus, slot, function,
+				offset & ~0b11u) >>
 		((offset & 0b11) * 8)) &
 	       0xffff;
 }
@@ -24,7 +27,8 @@ uint16_t pci_read16(uint32_t segment, uint32_t bus, uint32_t slot,
 uint8_t pci_read8(uint32_t segment, uint32_t bus, uint32_t slot,
 		  uint32_t function, uint32_t offset)
 {
-	return (plat_pci_read32(segment, bus, slot, function, offset) >>
+	return (plat_pci_read32(segment, bus, slot, function,
+				offset & ~0b11u) >>
 		((offset & 0b11) * 8)) &
 	       0xff;
 }
@@ -32,21 +36,23 @@ uint8_t pci_read8(uint32_t segment, uint32_t bus, uint32_t slot,
 void pci_write8(uint32_t seg, uint32_t bus, uint32_t slot, uint32_t function,
 		uint32_t offset, uint8_t value)
 {
-	uint32_t old = plat_pci_read32(seg, bus, slot, function, offset);
+	uint32_t old =
+		plat_pci_read32(seg, bus, slot, function, offset & ~0b11u);
 	int bitoffset = 8 * (offset & 0b11);
-	old &= ~(0xff << bitoffset);
-	old |= value << bitoffset;
-	plat_pci_write32(seg, bus, slot, function, offset, old);
+	old &= ~(0xffu << bitoffset);
+	old |= (uint32_t)value << bitoffset;
+	plat_pci_write32(seg, bus, slot, function, offset & ~0b11u, old);
 }
 
 void pci_write16(uint32_t seg, uint32_t bus, uint32_t slot, uint32_t function,
 		 uint32_t offset, uint16_t value)
 {
-	uint32_t old = plat_pci_read32(seg, bus, slot, function, offset);
+	uint32_t old =
+		plat_pci_read32(seg, bus, slot, function, offset & ~0b11u);
 	int bitoffset = 8 * (offset & 0b11);
-	old &= ~(0xffff << bitoffset);
-	old |= value << bitoffset;
-	plat_pci_write32(seg, bus, slot, function, offset, old);
+	old &= ~(0xffffu << bitoffset);
+	old |= (uint32_t)value << bitoffset;
+	plat_pci_write32(seg, bus, slot, function, offset & ~0b11u, old);
 }
 
 void pci_write32(uint32_t seg, uint32_t bus, uint32_t slot, uint32_t function,
@@ -5,6 +5,10 @@
 #include <yak/status.h>
 #include <yak/percpu.h>
 #include <yak/cpudata.h>
+#include <yak/seqlock.h>
+#include <yak/hint.h>
+#include <yak/macro.h>
+#include <yak/vdso.h>
 
 static uint64_t dummy_counter(struct clocksource *)
 {
@@ -23,6 +27,8 @@ static struct clocksource dummy_clock = {
 	.setup = NULL,
 	.init = dummy_init,
 	.frequency = 1000000000,
+	.mult = 1,
+	.shift = 0,
 	.quality = -10000,
 	.name = "dummy",
 	.flags = CLOCKSOURCE_EARLY,
@@ -33,32 +39,90 @@ static struct clocksource dummy_clock = {
 static struct clocksource *clock_list = &dummy_clock;
 static struct spinlock clock_lock = SPINLOCK_INITIALIZER();
 
+// Global timekeeping state, written under clock_lock.
+// uptime() = base_ns + ((counter - base_cycles) * mult) >> shift
+static struct {
+	struct seqcount seq;
+	struct clocksource *clock;
+	uint64_t base_cycles;
+	nstime_t base_ns;
+	uint32_t mult;
+	uint32_t shift;
+} tk = {
+	.seq = SEQCOUNT_INITIALIZER(),
+	.clock = &dummy_clock,
+	.base_cycles = 0,
+	.base_ns = 0,
+	.mult = 1,
+	.shift = 0,
+};
+
+static nstime_t system_realtime_offset;
+
 struct clocksource *clocksource_current()
 {
-	return PERCPU_FIELD_LOAD(clocksource);
+	return __atomic_load_n(&tk.clock, __ATOMIC_ACQUIRE);
 }
 
-void clocksource_switch(struct clocksource *clock)
+// Pick the largest shift that keeps mult in 32 bits, for the most precise
+// conversion. The 128-bit product in uptime() can't overflow.
+static void clocksource_calc_mult_shift(struct clocksource *clock)
+{
+	uint64_t mult = 0;
+	uint32_t shift;
+
+	for (shift = 32; shift > 0; shift--) {
+		mult = ((1000000000ULL << shift) + clock->frequency / 2) /
+		       clock->frequency;
+		if (mult <= UINT32_MAX)
+			break;
+	}
+
+	clock->mult = mult;
+	clock->shift = shift;
+}
+
+static inline nstime_t cycles_to_ns(uint64_t cycles, uint32_t mult,
+				    uint32_t shift)
+{
+	return ((unsigned __int128)cycles * mult) >> shift;
+}
+
+[[gnu::noinline]]
+static void clocksource_init_cpu(struct clocksource *clock)
+{
+	clock->init(clock);
+	PERCPU_FIELD_STORE(clocksource, clock);
+}
+
+// caller holds clock_lock
+static void clocksource_switch(struct clocksource *clock)
 {
-	bool ipl = spinlock_lock_interrupts(&clock_lock);
 	if (!clock->is_setup) {
 		EXPECT(clock->setup(clock));
 		clock->is_setup = true;
 	}
 
-	clock->init(clock);
+	// setup or probe may have only now determined the frequency
+	clocksource_calc_mult_shift(clock);
 
-	if (clock->flags & CLOCKSOURCE_NO_OFFSET) {
-		PERCPU_FIELD_STORE(clock_offset, 0);
-	} else {
-		PERCPU_FIELD_STORE(clock_offset, uptime());
-	}
+	// continue where the previous clock left off
+	nstime_t now = uptime();
+	clocksource_init_cpu(clock);
 
-	PERCPU_FIELD_STORE(clocksource, clock);
+	seqcount_write_begin(&tk.seq);
+	tk.clock = clock;
+	tk.base_cycles = clock->counter(clock);
+	tk.base_ns = now;
+	tk.mult = clock->mult;
+	tk.shift = clock->shift;
+	seqcount_write_end(&tk.seq);
 
-	spinlock_unlock_interrupts(&clock_lock, ipl);
+	vdso_update_clock(clock->vdso_clock_mode, tk.base_cycles, tk.base_ns,
+			  tk.mult, tk.shift, system_realtime_offset);
 
-	pr_info("using clocksource '%s'\n", clock->name);
+	pr_info("using clocksource '%s' (mult %u shift %u)\n", clock->name,
+		clock->mult, clock->shift);
 }
 
 static struct clocksource *select_source(int min_quality, bool early)
@@ -83,12 +147,10 @@ static struct clocksource *select_source(int min_quality, bool early)
 	return best;
 }
 
-static nstime_t system_realtime_offset;
-
 void clocksource_cpudata_init()
 {
-	PERCPU_FIELD_STORE(clocksource, &dummy_clock);
-	PERCPU_FIELD_STORE(clock_offset, 0);
+	// run init on first use
+	PERCPU_FIELD_STORE(clocksource, NULL);
 }
 
 void clocksource_early_init(nstime_t offset)
@@ -97,10 +159,9 @@ void clocksource_early_init(nstime_t offset)
 
 	bool ipl = spinlock_lock_interrupts(&clock_lock);
 	struct clocksource *source = select_source(-1, true);
-	spinlock_unlock_interrupts(&clock_lock, ipl);
 	assert(source && "no early clocksource");
-
 	clocksource_switch(source);
+	spinlock_unlock_interrupts(&clock_lock, ipl);
 }
 
 void clocksource_init()
@@ -108,16 +169,19 @@ void clocksource_init()
 	bool ipl = spinlock_lock_interrupts(&clock_lock);
 	// any is fine, we're not in boot anymore
 	struct clocksource *source = select_source(-1, false);
-	spinlock_unlock_interrupts(&clock_lock, ipl);
-
-	if (clocksource_current() != source)
+	if (tk.clock != source)
 		clocksource_switch(source);
+	spinlock_unlock_interrupts(&clock_lock, ipl);
 }
+
 void clocksource_register(struct clocksource *clk)
 {
 	bool ipl = spinlock_lock_interrupts(&clock_lock);
 	clk->next = NULL;
 	clk->is_setup = clk->setup == NULL ? 1 : 0;
+	// some only know their frequency after setup, redone on switch
+	if (clk->frequency != 0 && clk->frequency != (uint64_t)-1)
+		clocksource_calc_mult_shift(clk);
 
 	struct clocksource *tmp = clock_list;
 	while (tmp->next)
@@ -132,18 +196,69 @@ void clocksource_register(struct clocksource *clk)
 
 nstime_t uptime()
 {
-	struct clocksource *source = PERCPU_FIELD_LOAD(clocksource);
-	nstime_t offset = PERCPU_FIELD_LOAD(clock_offset);
-	uint64_t ctr = source->counter(source);
-	uint64_t freq = source->frequency;
+	unsigned int seq;
+	uint64_t delta;
+	nstime_t base_ns;
+	uint32_t mult, shift;
+
+	do {
+		seq = seqcount_read_begin(&tk.seq);
+
+		struct clocksource *clock = tk.clock;
+		// other cpus may have switched clocks
+		if (unlikely(clock != PERCPU_FIELD_LOAD(clocksource)))
+			clocksource_init_cpu(clock);
+
+		delta = clock->counter(clock) - tk.base_cycles;
+		base_ns = tk.base_ns;
+		mult = tk.mult;
+		shift = tk.shift;
+	} while (seqcount_read_retry(&tk.seq, seq));
+
+	// per-cpu counters may lag the switching cpu's by a hair
+	if (unlikely((int64_t)delta < 0))
+		delta = 0;
+
+	return base_ns + cycles_to_ns(delta, mult, shift);
+}
+
+bool clocksource_cycles_at(struct clocksource *clock, nstime_t ns,
+			   uint64_t *cycles)
+{
+	unsigned int seq;
+	uint64_t base_cycles;
+	nstime_t base_ns;
+	uint32_t mult, shift;
 
-	uint64_t quotient = ctr / freq;
-	uint64_t remainder = ctr % freq;
+	do {
+		seq = seqcount_read_begin(&tk.seq);
+		if (tk.clock != clock)
+			return false;
+
+		base_cycles = tk.base_cycles;
+		base_ns = tk.base_ns;
+		mult = tk.mult;
+		shift = tk.shift;
+	} while (seqcount_read_retry(&tk.seq, seq));
+
+	if (ns <= base_ns) {
+		*cycles = base_cycles;
+		return true;
+	}
 
-	uint64_t ns = quotient * 1000000000ULL;
-	ns += (remainder * 1000000000ULL) / freq;
+	nstime_t delta = ns - base_ns;
+	if (delta < (1ULL << (63 - shift))) {
+		// exact inverse of cycles_to_ns
+		*cycles = base_cycles + DIV_ROUNDUP(delta << shift, mult);
+	} else {
+		// far out, a few ns early is fine: the timer gets re-armed
+		*cycles = base_cycles +
+			  (delta / 1000000000ULL) * clock->frequency +
+			  DIV_ROUNDUP((delta % 1000000000ULL) * clock->frequency,
+				      1000000000ULL);
+	}
 
-	return offset + ns;
+	return true;
 }
 
 nstime_t nettime()
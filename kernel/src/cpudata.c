@@ -6,12 +6,14 @@
 #include <yak/cpu.h>
 
 struct cpumask cpumask_active;
+struct cpumask cpumask_idle;
 size_t num_cpus_active = 0;
 extern size_t num_cpus_total;
 
 void cpu_init()
 {
 	bitset_init(&cpumask_active);
+	bitset_init(&cpumask_idle);
 }
 
 void cpu_up(size_t id)
@@ -31,6 +33,9 @@ size_t cpus_online()
 }
 
 extern void timer_update(struct dpc *dpc, void *ctx);
+extern void sched_quantum_expire(struct dpc *dpc, void *ctx);
+extern void sched_balance_tick(struct dpc *dpc, void *ctx);
+extern void rcu_process(struct dpc *dpc, void *ctx);
 
 static struct cpu *bsp_ptr = NULL;
 struct cpu **__all_cpus = NULL;
@@ -40,8 +45,15 @@ static size_t next_cpu_id = 0;
 void cpudata_init(struct cpu *cpu, void *stack_top)
 {
 	cpu->self = cpu;
+	// anything below might already print
+	cpu->qspinlock_nodes_used = 0;
+#if CONFIG_LOCKSTAT
+	lockstat_init_cpu(&cpu->lockstat);
+#endif
 
 	cpu->cpu_id = __atomic_fetch_add(&next_cpu_id, 1, __ATOMIC_RELAXED);
+	// the platform knows better, but assume a single cache domain
+	cpu->llc_id = 0;
 
 	clocksource_cpudata_init();
 
@@ -60,10 +72,12 @@ void cpudata_init(struct cpu *cpu, void *stack_top)
 #endif
 
 	cpu->current_map = NULL;
+	cpu->spin_owner = NULL;
 
 	cpu->softint_pending = 0;
+	cpu->idle_polling = 0;
 
-	spinlock_init(&cpu->sched_lock);
+	qspinlock_init(&cpu->sched_lock);
 	struct sched *sched = &cpu->sched;
 
 	for (size_t rq = 0; rq < 2; rq++) {
@@ -76,6 +90,7 @@ void cpudata_init(struct cpu *cpu, void *stack_top)
 
 	sched->current_rq = &sched->rqs[0];
 	sched->next_rq = &sched->rqs[1];
+	sched->nr_ready = 0;
 
 	TAILQ_INIT(&sched->idle_rq);
 
@@ -84,9 +99,28 @@ void cpudata_init(struct cpu *cpu, void *stack_top)
 
 	spinlock_init(&cpu->timer_lock);
 	HEAP_INIT(&cpu->timer_heap);
+	timer_wheel_init(&cpu->timer_wheel);
+	cpu->timer_next = TIMER_INFINITE;
 	dpc_init(&cpu->timer_update_dpc, timer_update);
 
-	rcq_init(&cpu->rc_queue);
+	timer_init(&cpu->quantum_timer);
+	dpc_init(&cpu->quantum_dpc, sched_quantum_expire);
+	cpu->quantum_timer.dpc = &cpu->quantum_dpc;
+
+	timer_init(&cpu->balance_timer);
+	// nobody waits for it, fire along with something else
+	cpu->balance_timer.slack = SCHED_BALANCE_INTERVAL / 10;
+	dpc_init(&cpu->balance_dpc, sched_balance_tick);
+	cpu->balance_timer.dpc = &cpu->balance_dpc;
+
+	rcq_init(&cpu->rc_queue, cpu->cpu_id);
+
+	cpu->rcu_qs_gp = 0;
+	cpu->rcu_next = NULL;
+	cpu->rcu_next_tail = &cpu->rcu_next;
+	cpu->rcu_wait = NULL;
+	cpu->rcu_wait_gp = 0;
+	dpc_init(&cpu->rcu_dpc, rcu_process);
 
 	cpu->kstack_top = stack_top;
 	cpu->idle_thread.kstack_top = stack_top;
@@ -16,6 +16,7 @@
 #include <yak/timer.h>
 #include <yak/console.h>
 #include <yak/wait.h>
+#include <yak/rwlock.h>
 
 #include <config.h>
 
@@ -110,6 +111,18 @@ void kmain(void *)
 			     PerformFireworksTest, NULL, 1, NULL);
 #endif
 
+#if CONFIG_SPINLOCK_BENCH
+	spinlock_bench();
+#endif
+
+#if CONFIG_TIMER_BENCH
+	timer_bench();
+#endif
+
+#if CONFIG_RWLOCK_STRESS
+	pcpu_rwlock_stress();
+#endif
+
 	ipi_send_wait(-1, ipi_test, NULL);
 
 	pr_debug("before sched_exit_self in kmain\n");
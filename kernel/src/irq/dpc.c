@@ -10,6 +10,8 @@
 void dpc_init(struct dpc *dpc, void (*func)(struct dpc *, void *))
 {
 	dpc->enqueued = 0;
+	dpc->cpu = NULL;
+	dpc->running = 0;
 	dpc->func = func;
 	dpc->context = NULL;
 }
@@ -19,14 +21,17 @@ void dpc_enqueue(struct dpc *dpc, void *context)
 	struct cpu *cpu = curcpu();
 	int state = spinlock_lock_interrupts(&cpu->dpc_lock);
 
-	if (dpc->enqueued) {
+	// other cpus may queue it at the same time: only one gets to
+	int expected = 0;
+	if (!__atomic_compare_exchange_n(&dpc->enqueued, &expected, 1, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
 		spinlock_unlock_interrupts(&cpu->dpc_lock, state);
 		return;
 	}
 
-	dpc->enqueued = 1;
 	dpc->context = context;
 	LIST_INSERT_HEAD(&cpu->dpc_queue, dpc, list_entry);
+	__atomic_store_n(&dpc->cpu, cpu, __ATOMIC_RELEASE);
 
 	softint_issue(IPL_DPC);
 	spinlock_unlock_interrupts(&cpu->dpc_lock, state);
@@ -34,16 +39,37 @@ void dpc_enqueue(struct dpc *dpc, void *context)
 
 void dpc_dequeue(struct dpc *dpc)
 {
-	struct cpu *cpu = curcpu();
-	int state = spinlock_lock_interrupts(&cpu->dpc_lock);
+	// it may sit on another cpu's queue, or move while we take the lock
+	while (__atomic_load_n(&dpc->enqueued, __ATOMIC_ACQUIRE)) {
+		struct cpu *cpu = __atomic_load_n(&dpc->cpu, __ATOMIC_ACQUIRE);
+		// being queued or taken off right now
+		if (!cpu) {
+			busyloop_hint();
+			continue;
+		}
 
-	if (!dpc->enqueued)
-		goto exit;
+		int state = spinlock_lock_interrupts(&cpu->dpc_lock);
+		if (dpc->cpu != cpu) {
+			spinlock_unlock_interrupts(&cpu->dpc_lock, state);
+			continue;
+		}
 
-	LIST_REMOVE(dpc, list_entry);
-	dpc->enqueued = 0;
-exit:
-	spinlock_unlock_interrupts(&cpu->dpc_lock, state);
+		LIST_REMOVE(dpc, list_entry);
+		__atomic_store_n(&dpc->cpu, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&dpc->enqueued, 0, __ATOMIC_RELEASE);
+		spinlock_unlock_interrupts(&cpu->dpc_lock, state);
+		return;
+	}
+}
+
+void dpc_cancel_sync(struct dpc *dpc)
+{
+	assert(curipl() < IPL_DPC);
+
+	dpc_dequeue(dpc);
+
+	while (__atomic_load_n(&dpc->running, __ATOMIC_ACQUIRE))
+		busyloop_hint();
 }
 
 void dpc_queue_run(struct cpu *cpu)
@@ -65,9 +91,16 @@ void dpc_queue_run(struct cpu *cpu)
 		assert(dpc->func);
 
 		context = dpc->context;
-		dpc->enqueued = 0;
+		__atomic_fetch_add(&dpc->running, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&dpc->cpu, NULL, __ATOMIC_RELAXED);
+		// free to be queued again, on any cpu. Whoever sees it off the
+		// queue sees it running
+		__atomic_store_n(&dpc->enqueued, 0, __ATOMIC_RELEASE);
 
 		spinlock_unlock_interrupts(&cpu->dpc_lock, state);
 		dpc->func(dpc, context);
+
+		// last access: dpc_cancel_sync callers may free it from here on
+		__atomic_fetch_sub(&dpc->running, 1, __ATOMIC_RELEASE);
 	}
 }
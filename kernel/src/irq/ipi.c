@@ -1,126 +1,215 @@
 #include <stddef.h>
+#include <string.h>
 #include <yak/log.h>
-#include <yak/ringbuffer.h>
+#include <yak/ipl.h>
 #include <yak/spinlock.h>
 #include <yak/cpudata.h>
 #include <yak/cpu.h>
 #include <yak/ipi.h>
+#include <yak/heap.h>
+#include <yak/panic.h>
+
+/*
+ * Every cpu owns one remote_call slot per target. A sender fills its slot
+ * and pushes it onto the target's queue with a single CAS. Only the push
+ * that finds the queue empty sends an IPI: until the target took the list
+ * off, its doorbell is still ringing and later calls ride along.
+ *
+ * The target releases a slot as soon as it read it, so async senders only
+ * wait if they send to the same cpu again before it got around to it.
+ */
 
-void rcq_init(struct remote_call_queue *rcq)
+extern void plat_ipi(struct cpu *cpu);
+extern void plat_ipi_mask(struct cpumask *mask);
+
+// Slots of all cpus, nr_cpus per sender. Sized from the cpus that are
+// actually there: it grows with the square of their number.
+static struct remote_call *rc_slot_pool;
+
+void rcq_init(struct remote_call_queue *rcq, size_t cpu)
 {
-	spinlock_init(&rcq->rcq_lock);
-	ringbuffer_static_init(&rcq->rcq_buffer, sizeof(rcq->rcq_backing),
-			       &rcq->rcq_backing);
+	rcq->rcq_head = NULL;
+	// the BSP comes up before the heap, it gets its slots once there is
+	// someone to call
+	rcq->rcq_slots = rc_slot_pool ? &rc_slot_pool[cpu * cpus_total()] :
+					NULL;
 }
 
-void ipi_handler()
+void rcq_alloc_slots(size_t nr_cpus)
 {
-	struct cpu *cpu = curcpu();
-	struct remote_call_queue *rcq = &cpu->rc_queue;
-	spinlock_lock_noipl(&rcq->rcq_lock);
-	while (ringbuffer_available(&rcq->rcq_buffer)) {
-		struct remote_call rc;
-		ringbuffer_get(&rcq->rcq_buffer, &rc, sizeof(rc));
+	rc_slot_pool = kcalloc(nr_cpus * nr_cpus, sizeof(struct remote_call));
+	if (!rc_slot_pool)
+		panic("no memory for the remote call slots\n");
 
-		spinlock_unlock_noipl(&rcq->rcq_lock);
-
-		rc.rc_fn(rc.rc_ctx);
+	curcpu()->rc_queue.rcq_slots = &rc_slot_pool[cpuid() * nr_cpus];
+}
 
-		if (rc.rc_done) {
-			__atomic_fetch_add(rc.rc_done, 1, __ATOMIC_RELEASE);
+// Run all calls queued on this cpu. Caller is at IPL_HIGH.
+static void rcq_process(struct remote_call_queue *rcq)
+{
+	struct remote_call *list;
+
+	while ((list = __atomic_exchange_n(&rcq->rcq_head, NULL,
+					   __ATOMIC_ACQUIRE))) {
+		// pushed LIFO: reverse to run calls in the order they came in
+		struct remote_call *fifo = NULL;
+		while (list) {
+			struct remote_call *next = list->rc_next;
+			list->rc_next = fifo;
+			fifo = list;
+			list = next;
 		}
 
-		spinlock_lock_noipl(&rcq->rcq_lock);
+		while (fifo) {
+			struct remote_call *rc = fifo;
+			fifo = rc->rc_next;
+
+			remote_fn_t fn = rc->rc_fn;
+			void *ctx = rc->rc_ctx;
+			size_t *done = rc->rc_done;
+			// the sender may reuse the slot from here on
+			__atomic_store_n(&rc->rc_busy, 0, __ATOMIC_RELEASE);
+
+			fn(ctx);
+
+			if (done)
+				__atomic_fetch_add(done, 1, __ATOMIC_RELEASE);
+		}
 	}
-	spinlock_unlock_noipl(&rcq->rcq_lock);
 }
 
-extern void plat_ipi(struct cpu *cpu);
+void ipi_handler()
+{
+	rcq_process(&curcpu()->rc_queue);
+}
 
-static void do_ipi(size_t cpu, remote_fn_t fn, void *ctx, size_t *done)
+// Queue a call on cpu. Returns true if the queue was empty, i.e. the
+// doorbell has to be rung. Caller is at IPL_HIGH.
+static bool rcq_push(size_t cpu, remote_fn_t fn, void *ctx, size_t *done)
 {
-	struct cpu *dest = getcpu(cpu);
-	struct remote_call rc;
-	rc.rc_fn = fn;
-	rc.rc_ctx = ctx;
-	rc.rc_done = done;
+	struct remote_call_queue *own = &curcpu()->rc_queue;
+	struct remote_call *rc = &own->rcq_slots[cpu];
 
-	size_t put_size = 0;
+	// our last call there is still queued. We can't take IPIs right now and
+	// the target may be waiting for us in turn: run our own queue meanwhile
+	while (__atomic_load_n(&rc->rc_busy, __ATOMIC_ACQUIRE)) {
+		rcq_process(own);
+		busyloop_hint();
+	}
+
+	rc->rc_fn = fn;
+	rc->rc_ctx = ctx;
+	rc->rc_done = done;
+	rc->rc_busy = 1;
+
+	struct remote_call_queue *rcq = &getcpu(cpu)->rc_queue;
+	struct remote_call *head =
+		__atomic_load_n(&rcq->rcq_head, __ATOMIC_RELAXED);
 	do {
-		struct remote_call_queue *rcq = &dest->rc_queue;
-		ipl_t ipl = spinlock_lock(&rcq->rcq_lock);
-		put_size = ringbuffer_put(&rcq->rcq_buffer, &rc,
-					  sizeof(struct remote_call));
-		spinlock_unlock(&rcq->rcq_lock, ipl);
-	} while (put_size == 0);
-
-	plat_ipi(dest);
+		rc->rc_next = head;
+	} while (!__atomic_compare_exchange_n(&rcq->rcq_head, &head, rc, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	return head == NULL;
 }
 
-void ipi_send(size_t cpu, remote_fn_t fn, void *ctx)
+// Queue fn on every other cpu in mask, then ring all doorbells in one go.
+// Returns the number of calls queued.
+static size_t rc_send_mask(struct cpumask *mask, remote_fn_t fn, void *ctx,
+			   size_t *done)
 {
-	if (cpu == IPI_SEND_OTHERS) {
-		size_t our_id = cpuid();
-		bitset_word_t tmp;
-		for_each_cpu(tmp, &cpumask_active) {
-			if (tmp != our_id)
-				do_ipi(tmp, fn, ctx, NULL);
-		}
-	} else {
-		do_ipi(cpu, fn, ctx, NULL);
+	struct cpumask doorbell;
+	bitset_init(&doorbell);
+	size_t count = 0;
+
+	ipl_t ipl = ripl(IPL_HIGH);
+
+	size_t our_id = cpuid();
+	bitset_word_t tmp;
+	for_each_cpu(tmp, mask) {
+		if (tmp == our_id)
+			continue;
+
+		if (rcq_push(tmp, fn, ctx, done))
+			bitset_set(&doorbell, tmp);
+		count++;
 	}
+
+	if (!bitset_empty(&doorbell))
+		plat_ipi_mask(&doorbell);
+
+	xipl(ipl);
+
+	return count;
+}
+
+static void rc_send_one(size_t cpu, remote_fn_t fn, void *ctx, size_t *done)
+{
+	ipl_t ipl = ripl(IPL_HIGH);
+	if (rcq_push(cpu, fn, ctx, done))
+		plat_ipi(getcpu(cpu));
+	xipl(ipl);
+}
+
+// Wait for the ack counter to reach target. Runs our own queue as well, in
+// case the caller can't take IPIs and the others wait on us.
+static void rc_wait(size_t *done, size_t target)
+{
+	while (__atomic_load_n(done, __ATOMIC_ACQUIRE) != target) {
+		ipl_t ipl = ripl(IPL_HIGH);
+		rcq_process(&curcpu()->rc_queue);
+		xipl(ipl);
+
+		busyloop_hint();
+	}
+}
+
+void ipi_send(size_t cpu, remote_fn_t fn, void *ctx)
+{
+	if (cpu == IPI_SEND_OTHERS)
+		rc_send_mask(&cpumask_active, fn, ctx, NULL);
+	else
+		rc_send_one(cpu, fn, ctx, NULL);
 }
 
 void ipi_send_wait(size_t cpu, remote_fn_t fn, void *ctx)
 {
 	size_t done_count = 0;
-	size_t target_count = 0;
+	size_t target_count;
 
 	if (cpu == IPI_SEND_OTHERS) {
-		size_t our_id = cpuid();
-		bitset_word_t tmp;
-		for_each_cpu(tmp, &cpumask_active) {
-			if (tmp != our_id) {
-				target_count++;
-				do_ipi(tmp, fn, ctx, &done_count);
-			}
-		}
+		target_count = rc_send_mask(&cpumask_active, fn, ctx,
+					    &done_count);
 	} else {
-		do_ipi(cpu, fn, ctx, &done_count);
+		rc_send_one(cpu, fn, ctx, &done_count);
 		target_count = 1;
 	}
 
 	// wait until all calls executed
-	while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) != target_count) {
-		busyloop_hint();
-	}
+	rc_wait(&done_count, target_count);
 }
 
 void ipi_mask_send(struct cpumask *mask, remote_fn_t fn, void *ctx, bool self,
 		   bool wait)
 {
 	size_t done_count = 0;
-	size_t target_count = 0;
 
-	size_t our_id = cpuid();
-	bitset_word_t tmp;
-	for_each_cpu(tmp, mask) {
-		if (!self && tmp == our_id)
-			continue;
+	ipl_t ipl = ripl(IPL_HIGH);
 
-		if (wait) {
-			do_ipi(tmp, fn, ctx, &done_count);
-			target_count++;
-		} else {
-			do_ipi(tmp, fn, ctx, NULL);
-		}
-	}
+	size_t target_count =
+		rc_send_mask(mask, fn, ctx, wait ? &done_count : NULL);
+
+	// no need to interrupt ourselves: run it right here, while the
+	// others are busy with theirs
+	if (self && bitset_test(mask, cpuid()))
+		fn(ctx);
+
+	xipl(ipl);
 
 	if (!wait)
 		return;
 
 	// wait until all calls executed
-	while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) != target_count) {
-		busyloop_hint();
-	}
+	rc_wait(&done_count, target_count);
 }
@@ -1,10 +1,14 @@
 #include <assert.h>
+#include <string.h>
 #include <yak/spinlock.h>
 #include <yak/status.h>
 #include <yak/queue.h>
 #include <yak/irq.h>
 #include <yak/init.h>
 #include <yak/arch-ipl.h>
+#include <yak/cpudata.h>
+#include <yak/sched.h>
+#include <yak/timer.h>
 #include <yak/log.h>
 
 struct irq_slot slots[IRQ_SLOTS];
@@ -18,6 +22,10 @@ void irq_init()
 		slot->slot_flags = 0;
 		slot->refcount = 0;
 		TAILQ_INIT(&slot->objs);
+		slot->active = 0;
+		bitset_fill(&slot->affinity);
+		slot->cpu = 0;
+		slot->count_seen = 0;
 	}
 }
 
@@ -32,6 +40,8 @@ void irq_object_init(struct irq_object *obj, irq_object_handler handler,
 	obj->obj_flags = 0;
 	obj->handler = handler;
 	obj->arg = arg;
+	obj->retarget = NULL;
+	obj->retarget_arg = NULL;
 }
 
 static void dispatch_handler([[maybe_unused]] void *frame, irq_vec_t vec)
@@ -40,6 +50,14 @@ static void dispatch_handler([[maybe_unused]] void *frame, irq_vec_t vec)
 	struct irq_object *obj;
 	int acked = 0;
 
+	// for the balancer: plain load and store, nobody else writes it
+	uint64_t *count = &curcpu()->irq_count[vec];
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+
+	// pairs with irq_free: either it sees us walking, or we don't see
+	// the object it unlinked
+	__atomic_fetch_add(&slot->active, 1, __ATOMIC_SEQ_CST);
+
 	TAILQ_FOREACH(obj, &slot->objs, entry)
 	{
 		assert(obj);
@@ -48,12 +66,21 @@ static void dispatch_handler([[maybe_unused]] void *frame, irq_vec_t vec)
 			acked++;
 	}
 
+	__atomic_fetch_sub(&slot->active, 1, __ATOMIC_RELEASE);
+
 	if (!acked) {
 		pr_warn("spurious interrupt: no acks were returned for vec %d\n",
 			vec);
 	}
 }
 
+// a slot taken anew may go anywhere again
+static void slot_reset(struct irq_slot *slot)
+{
+	bitset_fill(&slot->affinity);
+	slot->cpu = 0;
+}
+
 static int pins_compatible(struct pin_config *a, struct pin_config *b)
 {
 	return (a->polarity == b->polarity || a->polarity == PIN_POL_ANY ||
@@ -109,6 +136,8 @@ retry:
 		return YAK_NOENT;
 	}
 
+	if (slot->refcount == 0)
+		slot_reset(slot);
 	slot->refcount += 1;
 	slot->slot_flags = flags & (IRQ_SHAREABLE | IRQ_MOVEABLE);
 	slot->pinconf = pinconf;
@@ -142,6 +171,8 @@ status_t irq_alloc_vec(struct irq_object *obj, irq_vec_t vec,
 		}
 	}
 
+	if (slot->refcount == 0)
+		slot_reset(slot);
 	slot->refcount += 1;
 	slot->slot_flags = flags & (IRQ_SHAREABLE | IRQ_MOVEABLE);
 	slot->pinconf = pinconf;
@@ -154,3 +185,211 @@ exit:
 	spinlock_unlock_interrupts(&irq_lock, state);
 	return ret;
 }
+
+void irq_free(struct irq_object *obj)
+{
+	int state = spinlock_lock_interrupts(&irq_lock);
+	struct irq_slot *slot = obj->slot;
+	assert(slot);
+
+	TAILQ_REMOVE(&slot->objs, obj, entry);
+	slot->refcount -= 1;
+	obj->slot = NULL;
+
+	spinlock_unlock_interrupts(&irq_lock, state);
+
+	// A handler that got to obj before we unlinked it may still run on
+	// another cpu. Later interrupts on the slot don't see obj anymore,
+	// so this only waits for the walks already in flight (and any that
+	// overlap them on a busy shared line).
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&slot->active, __ATOMIC_ACQUIRE))
+		busyloop_hint();
+}
+
+void irq_object_set_retarget(struct irq_object *obj, irq_retarget_fn *fn,
+			     void *arg, size_t cpu)
+{
+	int state = spinlock_lock_interrupts(&irq_lock);
+	obj->retarget = fn;
+	obj->retarget_arg = arg;
+	obj->slot->cpu = cpu;
+	spinlock_unlock_interrupts(&irq_lock, state);
+}
+
+// Caller holds irq_lock
+static status_t slot_retarget(struct irq_slot *slot, size_t cpu)
+{
+	if (!(slot->slot_flags & IRQ_MOVEABLE))
+		return YAK_NOT_SUPPORTED;
+
+	if (cpu >= MAX_NR_CPUS || !bitset_test(&slot->affinity, cpu) ||
+	    !bitset_atomic_test(&cpumask_active, cpu))
+		return YAK_INVALID_ARGS;
+
+	if (slot->cpu == cpu)
+		return YAK_SUCCESS;
+
+	struct irq_object *obj;
+	TAILQ_FOREACH(obj, &slot->objs, entry)
+	{
+		if (!obj->retarget)
+			return YAK_NOT_SUPPORTED;
+	}
+
+	TAILQ_FOREACH(obj, &slot->objs, entry)
+	{
+		status_t rv = obj->retarget(obj, cpu);
+		IF_ERR(rv)
+		{
+			// the sources that moved already deliver to cpu
+			pr_warn("vector %d partially moved to cpu %zu: %s\n",
+				slot->vector, cpu, status_str(rv));
+			return rv;
+		}
+	}
+
+	slot->cpu = cpu;
+	return YAK_SUCCESS;
+}
+
+status_t irq_retarget(struct irq_object *obj, size_t cpu)
+{
+	int state = spinlock_lock_interrupts(&irq_lock);
+	assert(obj->slot);
+	status_t rv = slot_retarget(obj->slot, cpu);
+	spinlock_unlock_interrupts(&irq_lock, state);
+	return rv;
+}
+
+status_t irq_set_affinity(struct irq_object *obj, const struct cpumask *mask)
+{
+	status_t rv = YAK_SUCCESS;
+	int state = spinlock_lock_interrupts(&irq_lock);
+	struct irq_slot *slot = obj->slot;
+	assert(slot);
+
+	struct cpumask old = slot->affinity;
+	slot->affinity = *mask;
+
+	if (!bitset_test(&slot->affinity, slot->cpu)) {
+		struct cpumask usable;
+		bitset_and(&usable, &slot->affinity, &cpumask_active);
+
+		rv = YAK_INVALID_ARGS;
+		bitset_word_t tmp;
+		for_each_cpu(tmp, &usable) {
+			rv = slot_retarget(slot, tmp);
+			break;
+		}
+
+		IF_ERR(rv)
+		{
+			slot->affinity = old;
+		}
+	}
+
+	spinlock_unlock_interrupts(&irq_lock, state);
+	return rv;
+}
+
+#if CONFIG_IRQ_BALANCE
+
+#define IRQ_BALANCE_INTERVAL MSTIME(500)
+// a cpu taking fewer interrupts per interval isn't worth relieving
+#define IRQ_BALANCE_MIN 1000
+
+// Move one vector from the cpu that took the most interrupts to the one
+// that took the fewest, if that narrows the gap
+static void irq_balance_once()
+{
+	// only the balancer thread touches these
+	static uint64_t cpu_seen[MAX_NR_CPUS];
+	static uint64_t load[MAX_NR_CPUS];
+	static uint64_t rate[IRQ_SLOTS];
+
+	memset(rate, 0, sizeof(rate));
+
+	size_t busiest = MAX_NR_CPUS, idlest = MAX_NR_CPUS;
+
+	bitset_word_t tmp;
+	for_each_cpu(tmp, &cpumask_active) {
+		struct cpu *cpu = getcpu(tmp);
+		uint64_t total = 0;
+
+		for (size_t vec = 0; vec < IRQ_SLOTS; vec++) {
+			uint64_t n = __atomic_load_n(&cpu->irq_count[vec],
+						     __ATOMIC_RELAXED);
+			rate[vec] += n;
+			total += n;
+		}
+
+		load[tmp] = total - cpu_seen[tmp];
+		cpu_seen[tmp] = total;
+
+		if (busiest == MAX_NR_CPUS || load[tmp] > load[busiest])
+			busiest = tmp;
+		if (idlest == MAX_NR_CPUS || load[tmp] < load[idlest])
+			idlest = tmp;
+	}
+
+	for (size_t vec = 0; vec < IRQ_SLOTS; vec++) {
+		uint64_t total = rate[vec];
+		rate[vec] = total - slots[vec].count_seen;
+		slots[vec].count_seen = total;
+	}
+
+	if (busiest == idlest || load[busiest] < IRQ_BALANCE_MIN)
+		return;
+
+	// anything above half the gap just swaps the two cpus' roles
+	uint64_t limit = (load[busiest] - load[idlest]) / 2;
+
+	int state = spinlock_lock_interrupts(&irq_lock);
+
+	struct irq_slot *best = NULL;
+	for (size_t vec = 0; vec < IRQ_SLOTS; vec++) {
+		struct irq_slot *slot = &slots[vec];
+
+		if (slot->refcount == 0 || !(slot->slot_flags & IRQ_MOVEABLE))
+			continue;
+		if (slot->cpu != busiest ||
+		    !bitset_test(&slot->affinity, idlest))
+			continue;
+		if (rate[vec] == 0 || rate[vec] > limit)
+			continue;
+
+		if (!best || rate[vec] > rate[best->vector])
+			best = slot;
+	}
+
+	if (best && IS_OK(slot_retarget(best, idlest))) {
+		pr_debug("vector %d: cpu %zu -> %zu (%lu of %lu/%lu)\n",
+			 best->vector, busiest, idlest, rate[best->vector],
+			 load[busiest], load[idlest]);
+	}
+
+	spinlock_unlock_interrupts(&irq_lock, state);
+}
+
+static void irq_balance_thread(void *)
+{
+	while (1) {
+		ksleep(IRQ_BALANCE_INTERVAL);
+
+		if (cpus_online() > 1)
+			irq_balance_once();
+	}
+}
+
+static void irq_balance_launch()
+{
+	EXPECT(kernel_thread_create("irq_balance", SCHED_PRIO_REAL_TIME,
+				    irq_balance_thread, NULL, 1, NULL));
+}
+
+INIT_ENTAILS(irq_balance);
+INIT_DEPS(irq_balance);
+INIT_NODE(irq_balance, irq_balance_launch);
+
+#endif
@@ -3,6 +3,7 @@
 #include <yak/ipl.h>
 #include <yak/cpudata.h>
 #include <yak/softint.h>
+#include <yak/rcu.h>
 
 #define PENDING(ipl) (1UL << ((ipl) - 1))
 
@@ -17,6 +18,9 @@ static void do_dpc_int(struct cpu *cpu)
 	softint_ack(cpu, IPL_DPC);
 	ripl(IPL_DPC);
 
+	// whatever ran here before was below IPL_DPC, outside any read section
+	rcu_note_qs(cpu);
+
 	enable_interrupts();
 
 	dpc_queue_run(cpu);
@@ -58,7 +62,12 @@ void softint_issue(ipl_t ipl)
 
 void softint_issue_other(struct cpu *cpu, ipl_t ipl)
 {
+	// Pairs with the idle loop publishing idle_polling before it checks
+	// softint_pending one last time: either it sees our store, or we see
+	// it polling and the store itself wakes it up.
 	__atomic_or_fetch(&cpu->softint_pending, PENDING(ipl),
-			  __ATOMIC_ACQUIRE);
+			  __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cpu->idle_polling, __ATOMIC_SEQ_CST))
+		return;
 	plat_ipi(cpu);
 }
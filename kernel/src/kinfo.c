@@ -4,10 +4,17 @@
 #include <yak/vm/pmm.h>
 #include <yak/cpu.h>
 #include <yak/init.h>
+#include <yak/lockstat.h>
 
 extern size_t n_pagefaults;
 extern size_t n_shootdowns;
 
+#if CONFIG_LOCKSTAT
+#define KINFO_BUF_SIZE 4096
+#else
+#define KINFO_BUF_SIZE 1024
+#endif
+
 static void kinfo_update_thread(void *)
 {
 	extern struct flanterm_context *kinfo_flanterm_context;
@@ -16,7 +23,7 @@ static void kinfo_update_thread(void *)
 
 	struct pmm_stat pmm_stat;
 
-	char buf[1024];
+	char buf[KINFO_BUF_SIZE];
 	size_t len = 0;
 
 	while (1) {
@@ -47,6 +54,11 @@ static void kinfo_update_thread(void *)
 		bufwrite("%ld active threads, %ld online CPUs", -1UL,
 			 cpus_online());
 
+#if CONFIG_LOCKSTAT
+		bufwrite("\n\n");
+		len += lockstat_format(&buf[len], sizeof(buf) - len, 8);
+#endif
+
 		flanterm_write_crnl(kinfo_flanterm_context, buf, len);
 
 		ksleep(STIME(1));
@@ -0,0 +1,275 @@
+#include <string.h>
+#include <nanoprintf.h>
+#include <yak/lockstat.h>
+#include <yak/clocksource.h>
+#include <yak/cpu.h>
+#include <yak/cpudata.h>
+#include <yak/hint.h>
+#include <yak/macro.h>
+#include <yak/spinlock.h>
+#include <yak/percpu.h>
+#include <yak/symbol.h>
+
+#if CONFIG_LOCKSTAT
+
+void lockstat_init_cpu(struct lockstat_cpu *stat)
+{
+	memset(stat, 0, sizeof(struct lockstat_cpu));
+	__atomic_store_n(&stat->ready, 1, __ATOMIC_RELEASE);
+}
+
+nstime_t lockstat_now()
+{
+	return uptime();
+}
+
+static unsigned int wait_bucket(nstime_t wait_time)
+{
+	nstime_t us = wait_time / 1000;
+	if (us == 0)
+		return 0;
+
+	unsigned int bucket = (63 - __builtin_clzll(us)) / 2 + 1;
+	return MIN(bucket, (unsigned int)LOCKSTAT_HIST_BUCKETS - 1);
+}
+
+// Interrupt handlers may record while we are in here: entries are claimed
+// with a CAS and counters are only ever added to
+static struct lockstat_entry *find_entry(struct lockstat_cpu *stat,
+					 const void *key, uintptr_t site)
+{
+	size_t hash = ((uintptr_t)key >> 4) ^ (site >> 2);
+
+	for (size_t i = 0; i < 16; i++) {
+		struct lockstat_entry *entry =
+			&stat->entries[(hash + i) % LOCKSTAT_ENTRIES];
+
+		const void *cur = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+		if (cur == NULL) {
+			if (!__atomic_compare_exchange_n(&entry->key, &cur, key,
+							 0, __ATOMIC_ACQ_REL,
+							 __ATOMIC_ACQUIRE))
+				goto check;
+			__atomic_store_n(&entry->site, site, __ATOMIC_RELEASE);
+			return entry;
+		}
+check:
+		if (cur == key &&
+		    __atomic_load_n(&entry->site, __ATOMIC_ACQUIRE) == site)
+			return entry;
+	}
+
+	return NULL;
+}
+
+void lockstat_record(const void *lock, const char *name, uintptr_t site,
+		     bool contended, nstime_t wait_time)
+{
+	// APs take locks before their cpu data is set up
+	if (unlikely(!PERCPU_FIELD_LOAD(lockstat.ready)))
+		return;
+
+	struct lockstat_cpu *stat = &curcpu()->lockstat;
+
+	const void *key = name ? (const void *)name : lock;
+	struct lockstat_entry *entry = find_entry(stat, key, site);
+	if (!entry) {
+		__atomic_fetch_add(&stat->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	entry->name = name;
+	__atomic_fetch_add(&entry->acquired, 1, __ATOMIC_RELAXED);
+	if (!contended)
+		return;
+
+	__atomic_fetch_add(&entry->contended, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&entry->wait_time, wait_time, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&entry->hist[wait_bucket(wait_time)], 1,
+			   __ATOMIC_RELAXED);
+}
+
+#define LOCKSTAT_MAX_CLASSES 64
+#define LOCKSTAT_TOP_SITES 2
+
+struct lockstat_class {
+	const void *key;
+	const char *name;
+	unsigned long acquired;
+	unsigned long contended;
+	nstime_t wait_time;
+	unsigned long hist[LOCKSTAT_HIST_BUCKETS];
+	struct {
+		uintptr_t site;
+		unsigned long contended;
+	} sites[LOCKSTAT_TOP_SITES];
+};
+
+// too big for the stack, lockstat_format is serialized
+static struct lockstat_class classes[LOCKSTAT_MAX_CLASSES];
+static SPINLOCK(format_lock);
+
+static struct lockstat_class *find_class(size_t *nclasses,
+					 struct lockstat_entry *entry,
+					 const void *key)
+{
+	for (size_t i = 0; i < *nclasses; i++) {
+		struct lockstat_class *class = &classes[i];
+		// a name literal may exist once per translation unit
+		if (class->key == key ||
+		    (class->name && entry->name &&
+		     strcmp(class->name, entry->name) == 0))
+			return class;
+	}
+
+	if (*nclasses == LOCKSTAT_MAX_CLASSES)
+		return NULL;
+
+	struct lockstat_class *class = &classes[(*nclasses)++];
+	memset(class, 0, sizeof(struct lockstat_class));
+	class->key = key;
+	class->name = entry->name;
+	return class;
+}
+
+static void add_site(struct lockstat_class *class, uintptr_t site,
+		     unsigned long contended)
+{
+	for (size_t i = 0; i < LOCKSTAT_TOP_SITES; i++) {
+		if (class->sites[i].site == site) {
+			class->sites[i].contended += contended;
+			return;
+		}
+	}
+
+	// replace the least contended site
+	size_t min = 0;
+	for (size_t i = 1; i < LOCKSTAT_TOP_SITES; i++) {
+		if (class->sites[i].contended < class->sites[min].contended)
+			min = i;
+	}
+
+	if (class->sites[min].site == 0 ||
+	    class->sites[min].contended < contended) {
+		class->sites[min].site = site;
+		class->sites[min].contended = contended;
+	}
+}
+
+static int class_cmp(const void *a, const void *b)
+{
+	const struct lockstat_class *ca = a, *cb = b;
+	if (ca->contended != cb->contended)
+		return ca->contended < cb->contended ? 1 : -1;
+	if (ca->acquired != cb->acquired)
+		return ca->acquired < cb->acquired ? 1 : -1;
+	return 0;
+}
+
+// no qsort in here, and there are only a few classes
+static void sort_classes(size_t nclasses)
+{
+	for (size_t i = 1; i < nclasses; i++) {
+		struct lockstat_class tmp = classes[i];
+		size_t j = i;
+		while (j > 0 && class_cmp(&classes[j - 1], &tmp) > 0) {
+			classes[j] = classes[j - 1];
+			j--;
+		}
+		classes[j] = tmp;
+	}
+}
+
+size_t lockstat_format(char *buf, size_t size, size_t max_classes)
+{
+	size_t len = 0;
+	unsigned long dropped = 0;
+	size_t nclasses = 0;
+
+	ipl_t ipl = spinlock_lock(&format_lock);
+
+	size_t cpu_idx;
+	for_each_cpu(cpu_idx, &cpumask_active) {
+		struct lockstat_cpu *stat = &getcpu(cpu_idx)->lockstat;
+		dropped += __atomic_load_n(&stat->dropped, __ATOMIC_RELAXED);
+
+		for (size_t i = 0; i < LOCKSTAT_ENTRIES; i++) {
+			struct lockstat_entry *entry = &stat->entries[i];
+			const void *key =
+				__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+			if (!key)
+				continue;
+
+			struct lockstat_class *class =
+				find_class(&nclasses, entry, key);
+			if (!class)
+				continue;
+
+			unsigned long contended = __atomic_load_n(
+				&entry->contended, __ATOMIC_RELAXED);
+			class->acquired += __atomic_load_n(&entry->acquired,
+							   __ATOMIC_RELAXED);
+			class->contended += contended;
+			class->wait_time += __atomic_load_n(&entry->wait_time,
+							    __ATOMIC_RELAXED);
+			for (size_t b = 0; b < LOCKSTAT_HIST_BUCKETS; b++)
+				class->hist[b] += __atomic_load_n(
+					&entry->hist[b], __ATOMIC_RELAXED);
+
+			add_site(class, entry->site, contended);
+		}
+	}
+
+	sort_classes(nclasses);
+
+#define bufwrite(msg, ...)                                          \
+	len += npf_snprintf(&buf[len], len < size ? size - len : 0, msg, \
+			    ##__VA_ARGS__);
+
+	bufwrite("%-24s %10s %10s %10s  <1us/4/16/64/256us/1/4/>4ms\n",
+		 "lock class", "acquired", "contended", "wait us");
+
+	for (size_t i = 0; i < MIN(nclasses, max_classes); i++) {
+		struct lockstat_class *class = &classes[i];
+
+		if (class->name) {
+			bufwrite("%-24.24s", class->name);
+		} else {
+			bufwrite("%-24p", class->key);
+		}
+
+		bufwrite(" %10lu %10lu %10lu ", class->acquired,
+			 class->contended,
+			 (unsigned long)(class->wait_time / 1000));
+		for (size_t b = 0; b < LOCKSTAT_HIST_BUCKETS; b++)
+			bufwrite(" %lu", class->hist[b]);
+		bufwrite("\n");
+
+		for (size_t s = 0; s < LOCKSTAT_TOP_SITES; s++) {
+			uintptr_t site = class->sites[s].site;
+			if (!site || !class->sites[s].contended)
+				continue;
+
+			struct symbol *sym = find_symbol_by_address(&ksym, site);
+			if (sym) {
+				bufwrite("    %s+0x%lx: %lu\n", sym->name,
+					 site - sym->address,
+					 class->sites[s].contended);
+			} else {
+				bufwrite("    0x%lx: %lu\n", site,
+					 class->sites[s].contended);
+			}
+		}
+	}
+
+	if (dropped)
+		bufwrite("(%lu acquisitions not recorded)\n", dropped);
+
+#undef bufwrite
+
+	spinlock_unlock(&format_lock, ipl);
+
+	return MIN(len, size);
+}
+
+#endif
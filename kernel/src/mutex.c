@@ -5,55 +5,133 @@
 #include <yak/cpudata.h>
 #include <yak/log.h>
 #include <yak/kevent.h>
-
-// NOTE: this was chosen pretty arbitrarily
-#define LOCK_TRY_COUNT 50
+#include <yak/hint.h>
+#include <yak/lockstat.h>
 
 void kmutex_init(struct kmutex *mutex, [[maybe_unused]] const char *name)
 {
 	event_init(&mutex->event, false, 0);
-#if CONFIG_DEBUG
+#if CONFIG_DEBUG || CONFIG_LOCKSTAT
 	mutex->name = name;
 #endif
 	mutex->owner = NULL;
+	pi_loan_init(&mutex->loan);
+}
+
+static inline bool kmutex_try_acquire(struct kmutex *mutex)
+{
+	struct kthread *unlocked = NULL;
+	return __atomic_compare_exchange_n(&mutex->owner, &unlocked, curthread(),
+					   0, __ATOMIC_ACQ_REL,
+					   __ATOMIC_RELAXED);
+}
+
+// Upper bound on one round of spinning before we block
+#define KMUTEX_SPIN_LIMIT 4096
+
+// Spinning only pays off while the owner is making progress on another cpu.
+// Once it sleeps or got preempted, the mutex won't be released any time soon.
+static bool kmutex_owner_running(struct cpu *cpu, struct kmutex *mutex,
+				 struct kthread *owner)
+{
+	// pin the owner first: the reaper doesn't free a thread a cpu has
+	// published in spin_owner
+	if (cpu->spin_owner != owner) {
+		__atomic_store_n(&cpu->spin_owner, owner, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		// it released the mutex (and may have exited) since we loaded
+		// it: its state tells us nothing then, just retry
+		if (__atomic_load_n(&mutex->owner, __ATOMIC_ACQUIRE) != owner)
+			return true;
+	}
+
+	// last_cpu is where it was queued, check it is actually on there
+	struct cpu *on = __atomic_load_n(&owner->last_cpu, __ATOMIC_RELAXED);
+	return on && on != cpu &&
+	       __atomic_load_n(&on->current_thread, __ATOMIC_RELAXED) == owner;
+}
+
+// Returns true once we own the mutex, false if we should block
+static bool kmutex_spin(struct kmutex *mutex)
+{
+	// stay on this cpu for the whole round: spin_owner is per cpu
+	ipl_t ipl = ripl(IPL_DPC);
+	struct cpu *cpu = curcpu();
+	bool acquired = false;
+
+	for (size_t i = 0; i < KMUTEX_SPIN_LIMIT; i++) {
+		if (likely(kmutex_try_acquire(mutex))) {
+			acquired = true;
+			break;
+		}
+
+		struct kthread *owner =
+			__atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+		if (owner && !kmutex_owner_running(cpu, mutex, owner))
+			break;
+
+		// we hold off a preemption of this cpu while we spin
+		if (__atomic_load_n(&cpu->next_thread, __ATOMIC_RELAXED))
+			break;
+
+		busyloop_hint();
+	}
+
+	__atomic_store_n(&cpu->spin_owner, NULL, __ATOMIC_RELEASE);
+	xipl(ipl);
+	return acquired;
 }
 
 static status_t kmutex_acquire_common(struct kmutex *mutex, nstime_t timeout,
-				      int waitmode)
+				      int waitmode, uintptr_t site)
 {
 	assert(mutex);
 	assert(mutex->owner != curthread());
 
 	status_t status;
+	nstime_t wait_start = 0;
 
 	while (1) {
-		for (int i = 0; i < LOCK_TRY_COUNT; i++) {
-			struct kthread *unlocked = NULL;
-			if (likely(__atomic_compare_exchange_n(
-				    &mutex->owner, &unlocked, curthread(), 0,
-				    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))) {
-				// we now own the mutex
-				return YAK_SUCCESS;
-			}
-			busyloop_hint();
-		}
+		if (likely(kmutex_try_acquire(mutex)))
+			goto acquired;
+
+		// spinning counts as waiting too
+		LOCKSTAT_WAIT_BEGIN(wait_start);
+
+		if (kmutex_spin(mutex))
+			goto acquired;
+
+		if (waitmode == WAIT_MODE_BLOCK)
+			sched_lend_priority(&mutex->event.hdr, &mutex->owner,
+					    &mutex->loan);
 
 		status = sched_wait(mutex, waitmode, timeout);
 
 		if (IS_ERR(status)) {
+			if (waitmode == WAIT_MODE_BLOCK)
+				sched_withdraw_priority(&mutex->event.hdr,
+							&mutex->loan);
 			return status;
 		}
 	}
+
+acquired:
+	// we now own the mutex
+	LOCKSTAT_ACQUIRED(mutex, mutex->name, site, wait_start);
+	return YAK_SUCCESS;
 }
 
 status_t kmutex_acquire(struct kmutex *mutex, nstime_t timeout)
 {
-	return kmutex_acquire_common(mutex, timeout, WAIT_MODE_BLOCK);
+	return kmutex_acquire_common(mutex, timeout, WAIT_MODE_BLOCK,
+				     LOCKSTAT_SITE());
 }
 
 status_t kmutex_acquire_polling(struct kmutex *mutex, nstime_t timeout)
 {
-	return kmutex_acquire_common(mutex, timeout, WAIT_MODE_POLL);
+	return kmutex_acquire_common(mutex, timeout, WAIT_MODE_POLL,
+				     LOCKSTAT_SITE());
 }
 
 void kmutex_release(struct kmutex *mutex)
@@ -66,6 +144,8 @@ void kmutex_release(struct kmutex *mutex)
 					       __ATOMIC_ACQ_REL,
 					       __ATOMIC_RELAXED))) {
 		event_alarm(&mutex->event, false);
+		// only after waking waiters: a loan can't arrive anymore
+		sched_restore_priority(&mutex->event.hdr, &mutex->loan);
 		return;
 	}
 
@@ -37,16 +37,16 @@ void console_print(struct console *console, void *private)
 		console->write(console, log_ctx->msg, log_ctx->size);
 }
 
-SPINLOCK(printk_lock);
+QSPINLOCK(printk_lock);
 
 __no_san void kputs(const char *buf)
 {
 	struct log_ctx ctx;
 	ctx.msg = buf;
 	ctx.size = strlen(buf);
-	int state = spinlock_lock_interrupts(&printk_lock);
+	int state = qspinlock_lock_interrupts(&printk_lock);
 	sink_foreach(console_print, &ctx);
-	spinlock_unlock_interrupts(&printk_lock, state);
+	qspinlock_unlock_interrupts(&printk_lock, state);
 }
 
 __no_san void vprintk(unsigned short level, const char *fmt, va_list args)
@@ -90,9 +90,9 @@ __no_san void vprintk(unsigned short level, const char *fmt, va_list args)
 	ctx.buf[LOG_BUF_SIZE] = '\0';
 
 	// interrupt >IPL_DPC might come in
-	int state = spinlock_lock_interrupts(&printk_lock);
+	int state = qspinlock_lock_interrupts(&printk_lock);
 	sink_foreach(console_print, &ctx);
-	spinlock_unlock_interrupts(&printk_lock, state);
+	qspinlock_unlock_interrupts(&printk_lock, state);
 }
 
 __no_san void printk(unsigned short level, const char *fmt, ...)
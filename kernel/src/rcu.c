@@ -0,0 +1,192 @@
+#define pr_fmt(fmt) "rcu: " fmt
+
+#include <assert.h>
+#include <yak/rcu.h>
+#include <yak/cpu.h>
+#include <yak/cpudata.h>
+#include <yak/dpc.h>
+#include <yak/kevent.h>
+#include <yak/macro.h>
+#include <yak/sched.h>
+#include <yak/softint.h>
+#include <yak/spinlock.h>
+#include <yak/status.h>
+
+// Grace periods are numbered. A callback queued while grace period N is
+// in progress has to wait for N + 1 to complete, since N might have started
+// before its object got unlinked.
+static struct {
+	struct spinlock lock;
+	// last started grace period
+	unsigned long gp_seq;
+	// last completed grace period
+	unsigned long completed;
+	// highest grace period someone waits for
+	unsigned long requested;
+	// cpus that still owe us a quiescent state for gp_seq
+	struct cpumask qs_needed;
+	// cpus with callbacks waiting for a grace period
+	struct cpumask cb_cpus;
+} rcu = { .lock = SPINLOCK_INITIALIZER() };
+
+static inline bool rcu_gp_done(unsigned long gp)
+{
+	return (long)(__atomic_load_n(&rcu.completed, __ATOMIC_ACQUIRE) - gp) >=
+	       0;
+}
+
+// Make a cpu pass through do_dpc_int, which notes a quiescent state
+static void rcu_nudge(struct cpu *cpu)
+{
+	if (cpu == curcpu())
+		softint_issue(IPL_DPC);
+	else
+		softint_issue_other(cpu, IPL_DPC);
+}
+
+static void rcu_start_gp_locked()
+{
+	assert(spinlock_held(&rcu.lock));
+
+	rcu.qs_needed = cpumask_active;
+	__atomic_store_n(&rcu.gp_seq, rcu.gp_seq + 1, __ATOMIC_SEQ_CST);
+
+	size_t i;
+	for_each_cpu(i, &rcu.qs_needed) {
+		rcu_nudge(getcpu(i));
+	}
+}
+
+static void rcu_complete_gp_locked()
+{
+	assert(spinlock_held(&rcu.lock));
+
+	__atomic_store_n(&rcu.completed, rcu.gp_seq, __ATOMIC_RELEASE);
+
+	// get the callbacks running
+	size_t i;
+	for_each_cpu(i, &rcu.cb_cpus) {
+		rcu_nudge(getcpu(i));
+	}
+
+	if ((long)(rcu.requested - rcu.completed) > 0)
+		rcu_start_gp_locked();
+}
+
+// Returns the grace period new callbacks have to wait for
+static unsigned long rcu_request_gp()
+{
+	ipl_t ipl = spinlock_lock(&rcu.lock);
+
+	unsigned long gp;
+	if (rcu.gp_seq != rcu.completed) {
+		gp = rcu.gp_seq + 1;
+		if ((long)(gp - rcu.requested) > 0)
+			rcu.requested = gp;
+	} else {
+		rcu.requested = rcu.gp_seq + 1;
+		rcu_start_gp_locked();
+		gp = rcu.gp_seq;
+	}
+
+	spinlock_unlock(&rcu.lock, ipl);
+	return gp;
+}
+
+// We are at a quiescent state right now, so it counts for whatever grace
+// period is in progress, even if a newer one started since we looked
+static void rcu_report_qs(struct cpu *cpu)
+{
+	spinlock_lock_noipl(&rcu.lock);
+
+	cpu->rcu_qs_gp = rcu.gp_seq;
+
+	if (rcu.gp_seq != rcu.completed &&
+	    bitset_test(&rcu.qs_needed, cpu->cpu_id)) {
+		bitset_clear(&rcu.qs_needed, cpu->cpu_id);
+		if (bitset_empty(&rcu.qs_needed))
+			rcu_complete_gp_locked();
+	}
+
+	spinlock_unlock_noipl(&rcu.lock);
+}
+
+void rcu_note_qs(struct cpu *cpu)
+{
+	assert(curipl() >= IPL_DPC);
+
+	if (cpu->rcu_qs_gp != __atomic_load_n(&rcu.gp_seq, __ATOMIC_SEQ_CST))
+		rcu_report_qs(cpu);
+
+	if ((cpu->rcu_wait && rcu_gp_done(cpu->rcu_wait_gp)) ||
+	    (!cpu->rcu_wait && cpu->rcu_next))
+		dpc_enqueue(&cpu->rcu_dpc, NULL);
+}
+
+// Runs callbacks whose grace period is over and starts waiting for the
+// next batch
+void rcu_process([[maybe_unused]] struct dpc *dpc, [[maybe_unused]] void *ctx)
+{
+	struct cpu *cpu = curcpu();
+	struct rcu_head *done = NULL;
+
+	if (cpu->rcu_wait && rcu_gp_done(cpu->rcu_wait_gp)) {
+		done = cpu->rcu_wait;
+		cpu->rcu_wait = NULL;
+	}
+
+	if (!cpu->rcu_wait && cpu->rcu_next) {
+		cpu->rcu_wait = cpu->rcu_next;
+		cpu->rcu_next = NULL;
+		cpu->rcu_next_tail = &cpu->rcu_next;
+		bitset_atomic_set(&rcu.cb_cpus, cpu->cpu_id);
+		cpu->rcu_wait_gp = rcu_request_gp();
+	} else if (!cpu->rcu_wait) {
+		bitset_atomic_clear(&rcu.cb_cpus, cpu->cpu_id);
+	}
+
+	while (done) {
+		struct rcu_head *next = done->next;
+		done->func(done);
+		done = next;
+	}
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+	head->func = func;
+	head->next = NULL;
+
+	// the callback lists are only touched at IPL_DPC on their own cpu
+	ipl_t ipl = ripl(IPL_DPC);
+	struct cpu *cpu = curcpu();
+
+	*cpu->rcu_next_tail = head;
+	cpu->rcu_next_tail = &head->next;
+
+	dpc_enqueue(&cpu->rcu_dpc, NULL);
+
+	xipl(ipl);
+}
+
+struct rcu_sync {
+	struct rcu_head head;
+	struct kevent event;
+};
+
+static void rcu_sync_done(struct rcu_head *head)
+{
+	struct rcu_sync *sync = container_of(head, struct rcu_sync, head);
+	event_alarm(&sync->event, false);
+}
+
+void synchronize_rcu()
+{
+	assert(curipl() == IPL_PASSIVE);
+
+	struct rcu_sync sync;
+	event_init(&sync.event, 0, 0);
+	call_rcu(&sync.head, rcu_sync_done);
+
+	EXPECT(sched_wait(&sync.event, WAIT_MODE_BLOCK, TIMEOUT_INFINITE));
+}
@@ -1,9 +1,16 @@
+#define pr_fmt(fmt) "rwlock: " fmt
+
 #include <yak/cpudata.h>
 #include <yak/status.h>
 #include <yak/kevent.h>
 #include <yak/sched.h>
 #include <yak/object.h>
 #include <yak/rwlock.h>
+#include <yak/heap.h>
+#include <yak/cpu.h>
+#include <yak/lockstat.h>
+#include <yak/timer.h>
+#include <yak/log.h>
 
 #define RWLOCK_UNLOCKED 0
 #define RWLOCK_EXCLUSIVE (1U << 31)
@@ -12,19 +19,22 @@
 void rwlock_init(struct rwlock *rwlock, [[maybe_unused]] const char *name)
 {
 	event_init(&rwlock->event, 0, 0);
-#if CONFIG_DEBUG
+#if CONFIG_DEBUG || CONFIG_LOCKSTAT
 	rwlock->name = name;
 #endif
 	rwlock->state = 0;
 	rwlock->exclusive_count = 0;
 	rwlock->exclusive_owner = NULL;
+	pi_loan_init(&rwlock->loan);
 }
 
-status_t rwlock_acquire_shared(struct rwlock *rwlock, nstime_t timeout)
+static status_t rwlock_acquire_shared_at(struct rwlock *rwlock,
+					 nstime_t timeout, uintptr_t site)
 {
 	assert(rwlock);
 
 	status_t status;
+	nstime_t wait_start = 0;
 
 	do {
 		uint32_t state =
@@ -46,17 +56,30 @@ status_t rwlock_acquire_shared(struct rwlock *rwlock, nstime_t timeout)
 		}
 
 wait:
+		LOCKSTAT_WAIT_BEGIN(wait_start);
+		// only an exclusive owner can be lent our priority
+		sched_lend_priority(&rwlock->event.hdr,
+				    &rwlock->exclusive_owner, &rwlock->loan);
+
 		status = sched_wait(&rwlock->event, WAIT_MODE_BLOCK, timeout);
 
 		if (IS_ERR(status)) {
+			sched_withdraw_priority(&rwlock->event.hdr,
+						&rwlock->loan);
 			return status;
 		}
 
 	} while (1);
 
+	LOCKSTAT_ACQUIRED(rwlock, rwlock->name, site, wait_start);
 	return YAK_SUCCESS;
 }
 
+status_t rwlock_acquire_shared(struct rwlock *rwlock, nstime_t timeout)
+{
+	return rwlock_acquire_shared_at(rwlock, timeout, LOCKSTAT_SITE());
+}
+
 void rwlock_release_shared(struct rwlock *rwlock)
 {
 	assert((__atomic_load_n(&rwlock->state, __ATOMIC_RELAXED) &
@@ -70,9 +93,11 @@ void rwlock_release_shared(struct rwlock *rwlock)
 		event_alarm(&rwlock->event, false);
 }
 
-status_t rwlock_acquire_exclusive(struct rwlock *rwlock, nstime_t timeout)
+static status_t rwlock_acquire_exclusive_at(struct rwlock *rwlock,
+					    nstime_t timeout, uintptr_t site)
 {
 	status_t status;
+	nstime_t wait_start = 0;
 
 	__atomic_fetch_add(&rwlock->exclusive_count, 1, __ATOMIC_ACQ_REL);
 
@@ -93,16 +118,24 @@ status_t rwlock_acquire_exclusive(struct rwlock *rwlock, nstime_t timeout)
 			// TODO: what atomicity is needed here
 			__atomic_store_n(&rwlock->exclusive_owner, curthread(),
 					 __ATOMIC_SEQ_CST);
+			LOCKSTAT_ACQUIRED(rwlock, rwlock->name, site,
+					  wait_start);
 			return YAK_SUCCESS;
 		}
 
 		// someone was faster than us, wait for release
 
 wait:
+		LOCKSTAT_WAIT_BEGIN(wait_start);
+		sched_lend_priority(&rwlock->event.hdr,
+				    &rwlock->exclusive_owner, &rwlock->loan);
+
 		status = sched_wait(&rwlock->event, WAIT_MODE_BLOCK, timeout);
 
 		IF_ERR(status)
 		{
+			sched_withdraw_priority(&rwlock->event.hdr,
+						&rwlock->loan);
 			__atomic_fetch_sub(&rwlock->exclusive_count, 1,
 					   __ATOMIC_ACQ_REL);
 			return status;
@@ -111,6 +144,11 @@ wait:
 	} while (1);
 }
 
+status_t rwlock_acquire_exclusive(struct rwlock *rwlock, nstime_t timeout)
+{
+	return rwlock_acquire_exclusive_at(rwlock, timeout, LOCKSTAT_SITE());
+}
+
 void rwlock_release_exclusive(struct rwlock *rwlock)
 {
 	assert(rwlock_fetch_owner(rwlock) == curthread());
@@ -118,6 +156,7 @@ void rwlock_release_exclusive(struct rwlock *rwlock)
 	__atomic_store_n(&rwlock->exclusive_owner, NULL, __ATOMIC_RELEASE);
 	__atomic_fetch_and(&rwlock->state, ~RWLOCK_EXCLUSIVE, __ATOMIC_RELEASE);
 	event_alarm(&rwlock->event, false);
+	sched_restore_priority(&rwlock->event.hdr, &rwlock->loan);
 }
 
 void rwlock_upgrade_to_exclusive(struct rwlock *rwlock)
@@ -148,3 +187,266 @@ void rwlock_upgrade_to_exclusive(struct rwlock *rwlock)
 	rwlock_release_shared(rwlock);
 	EXPECT(rwlock_acquire_exclusive(rwlock, TIMEOUT_INFINITE));
 }
+
+status_t pcpu_rwlock_init(struct pcpu_rwlock *lock, const char *name,
+			  bool percpu_readers)
+{
+	rwlock_init(&lock->rwlock, name);
+	event_init(&lock->drain_event, 0, 0);
+	lock->writer = 0;
+	lock->counts = NULL;
+	lock->nr_counts = 0;
+
+	if (!percpu_readers)
+		return YAK_SUCCESS;
+
+	size_t nr_counts = cpus_total();
+	struct pcpu_rwlock_count *counts =
+		kmalloc(nr_counts * sizeof(struct pcpu_rwlock_count));
+	if (!counts)
+		return YAK_OOM;
+
+	for (size_t i = 0; i < nr_counts; i++)
+		counts[i].count = 0;
+
+	lock->counts = counts;
+	lock->nr_counts = nr_counts;
+	return YAK_SUCCESS;
+}
+
+void pcpu_rwlock_destroy(struct pcpu_rwlock *lock)
+{
+	if (lock->counts)
+		kfree(lock->counts,
+		      lock->nr_counts * sizeof(struct pcpu_rwlock_count));
+	lock->counts = NULL;
+}
+
+// Readers may migrate between acquire and release, so any one count can go
+// negative. Only the sum means something.
+static inline long *pcpu_rwlock_count(struct pcpu_rwlock *lock)
+{
+	return &lock->counts[cpuid()].count;
+}
+
+static void pcpu_rwlock_wake_writer(struct pcpu_rwlock *lock)
+{
+	// a writer might be waiting for us to drain
+	if (__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))
+		event_alarm(&lock->drain_event, false);
+}
+
+// The only decrement that may land on another cpu than its increment
+static void pcpu_rwlock_reader_leave(struct pcpu_rwlock *lock)
+{
+	ipl_t ipl = ripl(IPL_DPC);
+	__atomic_sub_fetch(pcpu_rwlock_count(lock), 1, __ATOMIC_SEQ_CST);
+	xipl(ipl);
+	pcpu_rwlock_wake_writer(lock);
+}
+
+status_t pcpu_rwlock_acquire_shared(struct pcpu_rwlock *lock,
+				    nstime_t timeout)
+{
+	if (!lock->counts)
+		return rwlock_acquire_shared_at(&lock->rwlock, timeout,
+						LOCKSTAT_SITE());
+
+	// Stay on this cpu until we either hold the lock or backed off again:
+	// a writer summing the counts in between must not see the increment on
+	// one cpu and the back-off on another.
+	ipl_t ipl = ripl(IPL_DPC);
+	long *count = pcpu_rwlock_count(lock);
+
+	// pairs with the writer storing its flag before summing the counts:
+	// either it sees our count, or we see its flag
+	__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+	if (likely(!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))) {
+		xipl(ipl);
+		return YAK_SUCCESS;
+	}
+
+	// back off and wait for the writer on the inner lock
+	__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+	xipl(ipl);
+	pcpu_rwlock_wake_writer(lock);
+
+	status_t status = rwlock_acquire_shared_at(&lock->rwlock, timeout,
+						   LOCKSTAT_SITE());
+	IF_ERR(status)
+	{
+		return status;
+	}
+
+	// no writer can get in while we hold the inner lock shared, and any
+	// that comes after waits for our count to drain
+	ipl = ripl(IPL_DPC);
+	__atomic_add_fetch(pcpu_rwlock_count(lock), 1, __ATOMIC_SEQ_CST);
+	xipl(ipl);
+	rwlock_release_shared(&lock->rwlock);
+
+	return YAK_SUCCESS;
+}
+
+void pcpu_rwlock_release_shared(struct pcpu_rwlock *lock)
+{
+	if (!lock->counts) {
+		rwlock_release_shared(&lock->rwlock);
+		return;
+	}
+
+	pcpu_rwlock_reader_leave(lock);
+}
+
+static long pcpu_rwlock_readers(struct pcpu_rwlock *lock)
+{
+	long sum = 0;
+	for (size_t i = 0; i < lock->nr_counts; i++)
+		sum += __atomic_load_n(&lock->counts[i].count,
+				       __ATOMIC_SEQ_CST);
+	return sum;
+}
+
+status_t pcpu_rwlock_acquire_exclusive(struct pcpu_rwlock *lock,
+				       nstime_t timeout)
+{
+	status_t status = rwlock_acquire_exclusive_at(&lock->rwlock, timeout,
+						      LOCKSTAT_SITE());
+	IF_ERR(status)
+	{
+		return status;
+	}
+
+	if (!lock->counts)
+		return YAK_SUCCESS;
+
+	__atomic_store_n(&lock->writer, 1, __ATOMIC_SEQ_CST);
+
+	while (pcpu_rwlock_readers(lock) != 0) {
+		EXPECT(sched_wait(&lock->drain_event, WAIT_MODE_BLOCK,
+				  TIMEOUT_INFINITE));
+	}
+
+	return YAK_SUCCESS;
+}
+
+void pcpu_rwlock_release_exclusive(struct pcpu_rwlock *lock)
+{
+	if (lock->counts)
+		__atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+
+	rwlock_release_exclusive(&lock->rwlock);
+}
+
+#if CONFIG_RWLOCK_STRESS
+#define STRESS_ROUNDS 4096
+
+static struct {
+	struct pcpu_rwlock lock;
+	long readers;
+	int writing;
+	int stop;
+	size_t done;
+	unsigned long writes;
+} stress;
+
+// hop to the next active cpu, wrapping around
+static void stress_migrate()
+{
+	size_t self = cpuid(), first = MAX_NR_CPUS, next = MAX_NR_CPUS;
+
+	bitset_word_t tmp;
+	for_each_cpu(tmp, &cpumask_active) {
+		if (first == MAX_NR_CPUS)
+			first = tmp;
+		if (tmp > self && next == MAX_NR_CPUS)
+			next = tmp;
+	}
+
+	struct cpumask mask;
+	bitset_init(&mask);
+	bitset_set(&mask, next != MAX_NR_CPUS ? next : first);
+	sched_set_affinity(curthread(), &mask);
+}
+
+static void stress_reader(void *)
+{
+	for (size_t i = 0; i < STRESS_ROUNDS; i++) {
+		EXPECT(pcpu_rwlock_acquire_shared(&stress.lock,
+						  TIMEOUT_INFINITE));
+		__atomic_add_fetch(&stress.readers, 1, __ATOMIC_SEQ_CST);
+		assert(!__atomic_load_n(&stress.writing, __ATOMIC_SEQ_CST));
+
+		// release on another cpu than we acquired on, and take the
+		// next round's fast path from there
+		stress_migrate();
+
+		assert(!__atomic_load_n(&stress.writing, __ATOMIC_SEQ_CST));
+		__atomic_sub_fetch(&stress.readers, 1, __ATOMIC_SEQ_CST);
+		pcpu_rwlock_release_shared(&stress.lock);
+	}
+
+	__atomic_fetch_add(&stress.done, 1, __ATOMIC_RELEASE);
+	sched_exit_self();
+}
+
+static void stress_writer(void *)
+{
+	while (!__atomic_load_n(&stress.stop, __ATOMIC_ACQUIRE)) {
+		EXPECT(pcpu_rwlock_acquire_exclusive(&stress.lock,
+						     TIMEOUT_INFINITE));
+		__atomic_store_n(&stress.writing, 1, __ATOMIC_SEQ_CST);
+		assert(__atomic_load_n(&stress.readers, __ATOMIC_SEQ_CST) == 0);
+
+		kstall(USTIME(5));
+
+		assert(__atomic_load_n(&stress.readers, __ATOMIC_SEQ_CST) == 0);
+		__atomic_store_n(&stress.writing, 0, __ATOMIC_SEQ_CST);
+		stress.writes++;
+		pcpu_rwlock_release_exclusive(&stress.lock);
+
+		// let the readers back onto the fast path for a while
+		ksleep(USTIME(50));
+	}
+
+	__atomic_fetch_add(&stress.done, 1, __ATOMIC_RELEASE);
+	sched_exit_self();
+}
+
+// Readers hop cpus while holding the lock and between rounds, a writer
+// keeps flipping them between the fast and the slow path.
+void pcpu_rwlock_stress()
+{
+	size_t nreaders = 2 * cpus_online();
+
+	EXPECT(pcpu_rwlock_init(&stress.lock, "rwlock_stress", true));
+	stress.readers = 0;
+	stress.writing = 0;
+	stress.stop = 0;
+	stress.done = 0;
+	stress.writes = 0;
+
+	nstime_t start = uptime();
+
+	EXPECT(kernel_thread_create("rwlock_stress_w", SCHED_PRIO_TIME_SHARE,
+				    stress_writer, NULL, 1, NULL));
+	for (size_t i = 0; i < nreaders; i++) {
+		EXPECT(kernel_thread_create("rwlock_stress_r",
+					    SCHED_PRIO_TIME_SHARE,
+					    stress_reader, NULL, 1, NULL));
+	}
+
+	while (__atomic_load_n(&stress.done, __ATOMIC_ACQUIRE) != nreaders)
+		ksleep(MSTIME(10));
+
+	__atomic_store_n(&stress.stop, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&stress.done, __ATOMIC_ACQUIRE) != nreaders + 1)
+		ksleep(MSTIME(10));
+
+	pr_info("%zu readers x %d rounds against %lu writes in %llu ms\n",
+		nreaders, STRESS_ROUNDS, stress.writes,
+		(unsigned long long)(uptime() - start) / 1000000);
+
+	pcpu_rwlock_destroy(&stress.lock);
+}
+#endif
@@ -12,6 +12,7 @@
 #include <yak/file.h>
 #include <yak/macro.h>
 #include <yak/heap.h>
+#include <yak/vdso.h>
 
 struct auxv_pair {
 	uint64_t type;
@@ -19,7 +20,8 @@ struct auxv_pair {
 };
 _Static_assert(sizeof(struct auxv_pair) == 16);
 
-static size_t setup_auxv(struct auxv_pair *auxv, struct load_info *info)
+static size_t setup_auxv(struct auxv_pair *auxv, struct load_info *info,
+			 vaddr_t vdso_base)
 {
 	size_t i = 0;
 	auxv[i++] = (struct auxv_pair){ AT_PHDR, info->phdr };
@@ -34,6 +36,7 @@ static size_t setup_auxv(struct auxv_pair *auxv, struct load_info *info)
 	auxv[i++] = (struct auxv_pair){ AT_EUID, 0 };
 	auxv[i++] = (struct auxv_pair){ AT_GID, 0 };
 	auxv[i++] = (struct auxv_pair){ AT_EGID, 0 };
+	auxv[i++] = (struct auxv_pair){ AT_SYSINFO_EHDR, vdso_base };
 	return i;
 }
 
@@ -114,6 +117,13 @@ status_t launch_elf(struct kprocess *proc, struct vm_map *map, char *path,
 	user_stack_addr += USER_STACK_LENGTH;
 	assert((user_stack_addr & 15) == 0);
 
+	// after the stack, so it doesn't take the stack's preferred spot
+	vaddr_t vdso_base;
+	rv = vdso_map(map, &vdso_base);
+	if (IS_ERR(rv)) {
+		goto ErrCleanup;
+	}
+
 	for (size_t i = 0; i < argc; i++) {
 		size_t len = strlen(argv_strings[i]) + 1;
 		user_stack_addr -= len;
@@ -131,7 +141,7 @@ status_t launch_elf(struct kprocess *proc, struct vm_map *map, char *path,
 	user_stack_addr = ALIGN_DOWN(user_stack_addr, 16);
 
 	struct auxv_pair auxv[16];
-	size_t auxvc = setup_auxv(auxv, &info);
+	size_t auxvc = setup_auxv(auxv, &info, vdso_base);
 
 	// plus envc words + null word
 	// plus argc words + null word
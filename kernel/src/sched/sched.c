@@ -12,9 +12,16 @@ idle queue is only ran once we don't have any thread whatsover on any other queu
 time-shared threads may not preempt any other thread
 real-time threads may preempt lower priority threads
 
+time-shared threads run for at most one quantum (SCHED_QUANTUM) while others
+are ready, then get rotated onto the next queue
+
 Threads may be deemed interactive and end up on current queues too / handled as realtime threads
 
-i'll implement everything very primitively. interactivity and other features will follow when userspace :^)
+Interactivity is scored like ULE does it: the ratio of voluntary sleep time
+to run time, both decayed so only the recent past counts. Interactive
+time-shared threads are boosted within the time-share band and queued on
+the current queue, CPU hogs decay towards SCHED_PRIO_TIME_SHARE and wait on
+the next queue.
 
 The idea for the scheduler mechanisms are from MINTIA (by @hyenasky)
 See: https://github.com/xrarch/mintia2
@@ -42,6 +49,16 @@ See: https://github.com/xrarch/mintia2
 #include <yak/arch-cpudata.h>
 #include <yak/timer.h>
 #include <yak/panic.h>
+#include <yak/rcu.h>
+
+// Interactivity scores range from 0 (always sleeping) to SCHED_INTERACT_MAX
+// (always running). Threads scoring below SCHED_INTERACT_THRESH are
+// considered interactive.
+#define SCHED_INTERACT_MAX 100
+#define SCHED_INTERACT_HALF (SCHED_INTERACT_MAX / 2)
+#define SCHED_INTERACT_THRESH 30
+// how much sleep + run history we keep around
+#define SCHED_SLP_RUN_MAX STIME(5)
 
 static struct kevent reaper_ev;
 static SPINLOCK(reaper_lock);
@@ -74,6 +91,100 @@ void sched_finalize_swtch(struct kthread *current, struct kthread *next)
 	next->status = THREAD_RUNNING;
 }
 
+// Keep the sleep/run history bounded (see sched_interact_update in ULE)
+static void interact_decay(struct kthread *thread)
+{
+	nstime_t run = thread->run_time, sleep = thread->sleep_time;
+	nstime_t sum = run + sleep;
+
+	if (sum < SCHED_SLP_RUN_MAX)
+		return;
+
+	// one unusually long sleep or run period: that's all that counts now
+	if (sum > SCHED_SLP_RUN_MAX * 2) {
+		if (run > sleep) {
+			thread->run_time = SCHED_SLP_RUN_MAX;
+			thread->sleep_time = 1;
+		} else {
+			thread->sleep_time = SCHED_SLP_RUN_MAX;
+			thread->run_time = 1;
+		}
+		return;
+	}
+
+	// slightly more than 1/5th over: the scaling below would not get us
+	// back into range
+	if (sum > (SCHED_SLP_RUN_MAX / 5) * 6) {
+		thread->run_time = run / 2;
+		thread->sleep_time = sleep / 2;
+		return;
+	}
+
+	thread->run_time = (run / 5) * 4;
+	thread->sleep_time = (sleep / 5) * 4;
+}
+
+static unsigned int interact_score(struct kthread *thread)
+{
+	nstime_t run = thread->run_time, sleep = thread->sleep_time;
+
+	if (run > sleep) {
+		nstime_t div = MAX((nstime_t)1, run / SCHED_INTERACT_HALF);
+		return SCHED_INTERACT_HALF +
+		       (SCHED_INTERACT_HALF - (sleep / div));
+	}
+
+	if (sleep > run) {
+		nstime_t div = MAX((nstime_t)1, sleep / SCHED_INTERACT_HALF);
+		return run / div;
+	}
+
+	return run ? SCHED_INTERACT_HALF : 0;
+}
+
+// Recompute a time-share thread's priority from its interactivity.
+// The base priority is where a thread that sleeps as much as it runs ends
+// up; interactive threads are boosted towards SCHED_PRIO_TIME_SHARE_END and
+// CPU hogs decay towards SCHED_PRIO_TIME_SHARE.
+static void sched_update_priority(struct kthread *thread)
+{
+	unsigned int base = thread->base_priority;
+
+	if (!sched_is_time_share(base))
+		return;
+
+	interact_decay(thread);
+
+	unsigned int score = interact_score(thread);
+	unsigned int prio;
+
+	if (score < SCHED_INTERACT_THRESH) {
+		prio = base + (SCHED_PRIO_TIME_SHARE_END - base) *
+				      (SCHED_INTERACT_THRESH - score) /
+				      SCHED_INTERACT_THRESH;
+	} else {
+		prio = base - (base - SCHED_PRIO_TIME_SHARE) *
+				      (score - SCHED_INTERACT_THRESH) /
+				      (SCHED_INTERACT_MAX - SCHED_INTERACT_THRESH);
+	}
+
+	thread->interactive = score < SCHED_INTERACT_THRESH;
+	// never drop below what lock waiters lent us
+	thread->priority = MAX(prio, thread->inherited_priority);
+}
+
+// Give time-share threads a fresh time slice, everything else runs until it
+// blocks or gets preempted by a more important thread
+static void arm_quantum(struct cpu *cpu, struct kthread *thread)
+{
+	struct timer *quantum = &cpu->quantum_timer;
+
+	timer_uninstall(quantum);
+
+	if (sched_is_time_share(thread->priority))
+		timer_install(quantum, SCHED_QUANTUM);
+}
+
 [[gnu::no_instrument_function]]
 static void swtch(struct kthread *current, struct kthread *thread)
 {
@@ -88,7 +199,15 @@ static void swtch(struct kthread *current, struct kthread *thread)
 	assert(current->status != THREAD_TERMINATING ||
 	       current->status != THREAD_WAITING);
 
-	current->affinity_cpu = curcpu();
+	nstime_t now = uptime();
+	if (now > current->run_start)
+		current->run_time += now - current->run_start;
+	current->last_ran = now;
+	thread->run_start = now;
+
+	arm_quantum(curcpu(), thread);
+
+	rcu_note_qs(curcpu());
 
 	if (thread->vm_ctx != NULL) {
 		// Kernel processes can attach themselves to arbitrary map contexts
@@ -98,6 +217,9 @@ static void swtch(struct kthread *current, struct kthread *thread)
 		if (current->owner_process != thread->owner_process) {
 			vm_map_activate(thread->owner_process->map);
 		}
+	} else {
+		// kernel threads run on whatever map is loaded
+		vm_map_lazy();
 	}
 
 	PERCPU_FIELD_STORE(current_thread, thread);
@@ -113,35 +235,70 @@ static void swtch(struct kthread *current, struct kthread *thread)
 	assert(current == curthread());
 }
 
+static inline bool cpu_allowed(struct kthread *thread, struct cpu *cpu)
+{
+	return bitset_test(&thread->affinity, cpu->cpu_id);
+}
+
+static struct kthread *select_next(struct cpu *cpu, unsigned int priority);
+static struct cpu *select_cpu(struct kthread *thread, nstime_t now);
+
+// The running thread may no longer run on cpu, and some cpu it may run on
+// is online. Racy without its thread lock: sched_set_affinity kicks the
+// cpu again once the new mask is in place.
+static bool must_migrate(struct cpu *cpu, struct kthread *thread)
+{
+	if (thread == &cpu->idle_thread || cpu_allowed(thread, cpu))
+		return false;
+
+	size_t tmp;
+	for_each_cpu(tmp, &cpumask_active) {
+		if (bitset_test(&thread->affinity, tmp))
+			return true;
+	}
+	return false;
+}
+
 [[gnu::no_instrument_function]]
 void sched_preempt(struct cpu *cpu)
 {
-	spinlock_lock_noipl(&cpu->sched_lock);
+	struct kthread *current = cpu->current_thread;
+
+	qspinlock_lock_noipl(&cpu->sched_lock);
 	struct kthread *next = cpu->next_thread;
-	if (!next) {
-		spinlock_unlock_noipl(&cpu->sched_lock);
+	if (next) {
+		// retrieve the next thread
+		cpu->next_thread = NULL;
+		next->status = THREAD_SWITCHING;
+	} else if (must_migrate(cpu, current)) {
+		// lost its affinity for this cpu: make room for anyone else
+		next = select_next(cpu, 0);
+		if (!next)
+			next = &cpu->idle_thread;
+	} else {
+		qspinlock_unlock_noipl(&cpu->sched_lock);
 		return;
 	}
 
-	// retrieve the next thread
-	cpu->next_thread = NULL;
-	next->status = THREAD_SWITCHING;
-
-	spinlock_unlock_noipl(&cpu->sched_lock);
+	qspinlock_unlock_noipl(&cpu->sched_lock);
 
 	wait_for_switch(next);
 
-	struct kthread *current = cpu->current_thread;
-
 	spinlock_lock_noipl(&current->thread_lock);
 
 	// in the process of switching off-stack
 	__atomic_store_n(&current->switching, 1, __ATOMIC_RELAXED);
 
 	if (current != &cpu->idle_thread) {
-		spinlock_lock_noipl(&cpu->sched_lock);
-		sched_insert(cpu, current, 0);
-		spinlock_unlock_noipl(&cpu->sched_lock);
+		// quantum expiry and preemption land here too: a thread that
+		// may not stay goes to an allowed cpu on its way out
+		struct cpu *target = cpu;
+		if (!cpu_allowed(current, cpu))
+			target = select_cpu(current, uptime());
+
+		qspinlock_lock_noipl(&target->sched_lock);
+		sched_insert(target, current, target != cpu);
+		qspinlock_unlock_noipl(&target->sched_lock);
 	} else {
 		// the idle thread remains ready
 		current->status = THREAD_READY;
@@ -152,7 +309,7 @@ void sched_preempt(struct cpu *cpu)
 
 static struct kthread *select_next(struct cpu *cpu, unsigned int priority)
 {
-	assert(spinlock_held(&cpu->sched_lock));
+	assert(qspinlock_held(&cpu->sched_lock));
 	struct sched *sched = &cpu->sched;
 
 	// threads on current runqueue
@@ -173,6 +330,7 @@ static struct kthread *select_next(struct cpu *cpu, unsigned int priority)
 			sched->current_rq->ready_mask &=
 				~(1UL << next_priority);
 		}
+		sched->nr_ready -= 1;
 		thread->status = THREAD_SWITCHING;
 		return thread;
 	} else if (sched->next_rq->ready_mask) {
@@ -198,20 +356,51 @@ static struct kthread *select_next(struct cpu *cpu, unsigned int priority)
 	return NULL;
 }
 
-#if 0
-// call this from preemption handler
-static void do_reschedule()
+// Runs from the quantum timer once the current thread used up its time slice
+void sched_quantum_expire([[maybe_unused]] struct dpc *dpc,
+			  [[maybe_unused]] void *ctx)
 {
-	struct kthread *current = curthread(), *next;
-	ipl_t ipl = spinlock_lock(&curcpu()->sched_lock);
-	// check if there is something ready to preempt us
-	if ((next = select_next(curcpu(), current->priority)) != NULL) {
-		assert(curcpu()->next_thread == NULL);
-		curcpu()->next_thread = next;
+	struct cpu *cpu = curcpu();
+	struct sched *sched = &cpu->sched;
+
+	// a context switch re-armed the quantum in the meantime
+	if (cpu->quantum_timer.state != TIMER_STATE_FIRED)
+		return;
+
+	qspinlock_lock_noipl(&cpu->sched_lock);
+
+	struct kthread *current = cpu->current_thread;
+	if (cpu->next_thread != NULL ||
+	    !sched_is_time_share(current->priority)) {
+		// someone is already lined up to replace us
+		qspinlock_unlock_noipl(&cpu->sched_lock);
+		return;
+	}
+
+	// account the slice now, sched_preempt requeues by the new priority
+	nstime_t now = uptime();
+	if (now > current->run_start)
+		current->run_time += now - current->run_start;
+	current->run_start = now;
+	sched_update_priority(current);
+
+	if (!sched->current_rq->ready_mask && !sched->next_rq->ready_mask) {
+		qspinlock_unlock_noipl(&cpu->sched_lock);
+		// nobody else wants to run, extend the time slice
+		timer_install(&cpu->quantum_timer, SCHED_QUANTUM);
+		return;
 	}
-	spinlock_unlock(&curcpu()->sched_lock, ipl);
+
+	// rotate: the next thread is taken from the current runqueue
+	// (or the next runqueue, after swapping), while the preempted
+	// thread gets reinserted onto the next runqueue by sched_preempt
+	struct kthread *next = select_next(cpu, 0);
+	assert(next);
+	next->status = THREAD_NEXT;
+	cpu->next_thread = next;
+
+	qspinlock_unlock_noipl(&cpu->sched_lock);
 }
-#endif
 
 void kthread_init(struct kthread *thread, const char *name,
 		  unsigned int initial_priority, struct kprocess *process,
@@ -239,10 +428,21 @@ void kthread_init(struct kthread *thread, const char *name,
 	timer_init(&thread->timeout_timer);
 
 	thread->priority = initial_priority;
+	thread->base_priority = initial_priority;
+	thread->inherited_priority = 0;
+	LIST_INIT(&thread->pi_loans);
 	thread->status = THREAD_UNDEFINED;
 
-	thread->affinity_cpu = NULL;
+	thread->interactive = false;
+	thread->run_time = 0;
+	thread->sleep_time = 0;
+	thread->run_start = 0;
+
+	thread->timer_slack = SCHED_TIMER_SLACK_DEFAULT;
+
+	bitset_fill(&thread->affinity);
 	thread->last_cpu = NULL;
+	thread->last_ran = 0;
 
 	thread->vm_ctx = NULL;
 
@@ -265,7 +465,7 @@ void sched_yield(struct kthread *current, struct cpu *cpu)
 	assert(current);
 	assert(cpu);
 	assert(spinlock_held(&current->thread_lock));
-	spinlock_lock_noipl(&cpu->sched_lock);
+	qspinlock_lock_noipl(&cpu->sched_lock);
 	// anything is fine now
 	struct kthread *next = cpu->next_thread;
 	if (next) {
@@ -275,7 +475,7 @@ void sched_yield(struct kthread *current, struct cpu *cpu)
 		next = select_next(cpu, 0);
 	}
 
-	spinlock_unlock_noipl(&cpu->sched_lock);
+	qspinlock_unlock_noipl(&cpu->sched_lock);
 
 	if (next) {
 		wait_for_switch(next);
@@ -285,7 +485,8 @@ void sched_yield(struct kthread *current, struct cpu *cpu)
 	}
 }
 
-static void sched_rq_insert(struct runqueue *rq, struct kthread *thread)
+static void sched_rq_insert(struct sched *sched, struct runqueue *rq,
+			    struct kthread *thread)
 {
 	assert(thread);
 	assert(rq);
@@ -298,6 +499,7 @@ static void sched_rq_insert(struct runqueue *rq, struct kthread *thread)
 	assert(TAILQ_FIRST(queue) != NULL);
 
 	rq->ready_mask |= (1UL << (thread->priority - 1));
+	sched->nr_ready += 1;
 }
 
 void sched_insert(struct cpu *cpu, struct kthread *thread, int isOther)
@@ -308,7 +510,7 @@ loop:
 	thread->status = THREAD_READY;
 
 	struct sched *sched = &cpu->sched;
-	assert(spinlock_held(&cpu->sched_lock));
+	assert(qspinlock_held(&cpu->sched_lock));
 
 	struct kthread *current = cpu->current_thread, *next = cpu->next_thread;
 	// Compare with either an already selected thread, or the currently running thread
@@ -323,15 +525,20 @@ loop:
 #endif
 
 			// We aren't important enough to preempt
-			sched_rq_insert(sched->current_rq, thread);
+			sched_rq_insert(sched, sched->current_rq, thread);
 
 			return;
 		}
 	} else /* priority < SCHED_PRIO_REAL_TIME */ {
 		if (comp != &cpu->idle_thread) {
 			// Time shared threads mustn't preempt anything other than idle threads
-			if (thread->priority == SCHED_PRIO_TIME_SHARE) {
-				sched_rq_insert(sched->next_rq, thread);
+			if (sched_is_time_share(thread->priority)) {
+				// interactive threads don't wait for the next round
+				sched_rq_insert(sched,
+						thread->interactive ?
+							sched->current_rq :
+							sched->next_rq,
+						thread);
 			} else {
 				TAILQ_INSERT_TAIL(&sched->idle_rq, thread,
 						  queue_entry);
@@ -347,6 +554,11 @@ loop:
 	thread->status = THREAD_NEXT;
 	cpu->next_thread = thread;
 
+	if (comp == &cpu->idle_thread) {
+		// not idle anymore, stop advertising it to wakeups
+		bitset_atomic_clear(&cpumask_idle, cpu->cpu_id);
+	}
+
 	if (next) {
 		// reinsert old next thread if we preempted
 		// next prio < our prio
@@ -364,38 +576,524 @@ loop:
 
 static size_t count = 0;
 
-// Round Robin the next CPU
-static struct cpu *find_cpu()
+// Round Robin the next CPU the thread may run on
+static struct cpu *find_cpu(struct kthread *thread)
 {
 	assert(cpus_online() != 0);
 
+	size_t allowed = 0, tmp;
+	for_each_cpu(tmp, &cpumask_active) {
+		if (bitset_test(&thread->affinity, tmp))
+			allowed++;
+	}
+
+	if (allowed == 0)
+		goto fallback;
+
 	size_t desired =
-		__atomic_fetch_add(&count, 1, __ATOMIC_RELAXED) % cpus_online();
+		__atomic_fetch_add(&count, 1, __ATOMIC_RELAXED) % allowed;
 	size_t i = 0;
 
-	size_t tmp;
 	for_each_cpu(tmp, &cpumask_active) {
+		if (!bitset_test(&thread->affinity, tmp))
+			continue;
 		if (i++ == desired)
 			return getcpu(tmp);
 	}
 
+fallback:
 	pr_warn("find_cpu(): fallback to local core?\n");
 
 	return curcpu();
 }
 
+// Take the thread that would run last on the victim cpu off its runqueues.
+// The next runqueue goes first: those threads won't run soon on the victim
+// anyway and likely lost their cache footprint already.
+// Threads that may not run on the thief are skipped.
+// The thread comes back with its thread_lock held: until the thief queued
+// it, it is still READY on the victim as far as everyone else can tell.
+static struct kthread *steal_thread(struct cpu *victim, struct cpu *thief)
+{
+	struct sched *sched = &victim->sched;
+	struct kthread *thread;
+
+	qspinlock_lock_noipl(&victim->sched_lock);
+
+	struct runqueue *rqs[2] = { sched->next_rq, sched->current_rq };
+	for (size_t i = 0; i < elementsof(rqs); i++) {
+		struct runqueue *rq = rqs[i];
+		uint32_t mask = rq->ready_mask;
+
+		while (mask) {
+			unsigned int idx = __builtin_ctz(mask);
+			thread_queue_t *queue = &rq->queues[idx];
+			mask &= ~(1UL << idx);
+
+			TAILQ_FOREACH_REVERSE(thread, queue, thread_queue,
+					      queue_entry) {
+				// sched_lock nests inside thread_lock, so we
+				// can only try; whoever holds it is about to
+				// reprioritize, move or wake the thread anyway
+				if (!spinlock_trylock(&thread->thread_lock))
+					continue;
+				if (!cpu_allowed(thread, thief)) {
+					spinlock_unlock_noipl(
+						&thread->thread_lock);
+					continue;
+				}
+
+				TAILQ_REMOVE(queue, thread, queue_entry);
+				if (TAILQ_EMPTY(queue))
+					rq->ready_mask &= ~(1UL << idx);
+				sched->nr_ready -= 1;
+				goto out;
+			}
+		}
+	}
+
+	thread = NULL;
+out:
+	qspinlock_unlock_noipl(&victim->sched_lock);
+
+	return thread;
+}
+
+// Take a ready thread off whatever runqueue of cpu it sits on.
+// Returns false if it isn't queued there (anymore).
+static bool sched_dequeue(struct cpu *cpu, struct kthread *thread)
+{
+	assert(qspinlock_held(&cpu->sched_lock));
+	struct sched *sched = &cpu->sched;
+	struct kthread *iter;
+
+	if (thread->status != THREAD_READY || thread->last_cpu != cpu)
+		return false;
+
+	if (thread->priority == SCHED_PRIO_IDLE) {
+		TAILQ_FOREACH(iter, &sched->idle_rq, queue_entry) {
+			if (iter == thread) {
+				TAILQ_REMOVE(&sched->idle_rq, thread,
+					     queue_entry);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	unsigned int idx = thread->priority - 1;
+	for (size_t i = 0; i < elementsof(sched->rqs); i++) {
+		struct runqueue *rq = &sched->rqs[i];
+		thread_queue_t *queue = &rq->queues[idx];
+
+		TAILQ_FOREACH(iter, queue, queue_entry) {
+			if (iter != thread)
+				continue;
+
+			TAILQ_REMOVE(queue, thread, queue_entry);
+			if (TAILQ_EMPTY(queue))
+				rq->ready_mask &= ~(1UL << idx);
+			sched->nr_ready -= 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Pull one ready thread from the busiest cpu over to our cpu.
+// Returns true if a thread was migrated.
+static bool sched_balance(struct cpu *cpu)
+{
+	assert(curipl() == IPL_DPC);
+	assert(cpu == curcpu());
+
+	// the ready counts are only peeked at: a stale read at worst
+	// makes us try to steal from an emptied queue, or skip a round
+	unsigned int our_load =
+		__atomic_load_n(&cpu->sched.nr_ready, __ATOMIC_RELAXED);
+	bool idle = cpu->current_thread == &cpu->idle_thread &&
+		    cpu->next_thread == NULL;
+
+	struct cpu *victim = NULL;
+	unsigned int victim_load = 0;
+
+	size_t i;
+	for_each_cpu(i, &cpumask_active) {
+		struct cpu *other = getcpu(i);
+		if (other == cpu)
+			continue;
+
+		unsigned int load = __atomic_load_n(&other->sched.nr_ready,
+						    __ATOMIC_RELAXED);
+		if (load > victim_load) {
+			victim = other;
+			victim_load = load;
+		}
+	}
+
+	// an idle cpu takes anything, a busy one only evens out imbalances
+	if (!victim || (!idle && victim_load <= our_load + 1))
+		return false;
+
+	struct kthread *thread = steal_thread(victim, cpu);
+	if (!thread)
+		return false;
+
+	qspinlock_lock_noipl(&cpu->sched_lock);
+	sched_insert(cpu, thread, 0);
+	qspinlock_unlock_noipl(&cpu->sched_lock);
+	spinlock_unlock_noipl(&thread->thread_lock);
+
+	return true;
+}
+
+// Runs every SCHED_BALANCE_INTERVAL on each cpu
+void sched_balance_tick([[maybe_unused]] struct dpc *dpc,
+			[[maybe_unused]] void *ctx)
+{
+	struct cpu *cpu = curcpu();
+
+	sched_balance(cpu);
+
+	timer_install(&cpu->balance_timer, SCHED_BALANCE_INTERVAL);
+}
+
+static bool claim_idle(struct cpu *cpu)
+{
+	return bitset_atomic_test_and_clear(&cpumask_idle, cpu->cpu_id);
+}
+
+// Wakeup placement, cheapest cache refill first:
+// - the previous cpu, if idle or if the thread ran there just now
+// - an idle cpu sharing the previous cpu's last-level cache
+// - any idle cpu
+// - the previous cpu anyway, the balancer moves it if it has to
+//
+// Only the idle mask is consulted; no runqueue gets scanned or locked.
+// Cpus outside the thread's affinity mask are never picked.
+static struct cpu *select_cpu(struct kthread *thread, nstime_t now)
+{
+	struct cpu *prev = thread->last_cpu;
+	size_t i;
+
+	if (prev && !cpu_allowed(thread, prev))
+		prev = NULL;
+
+	if (!prev) {
+		for_each_cpu(i, &cpumask_idle) {
+			struct cpu *cpu = getcpu(i);
+			if (cpu_allowed(thread, cpu) && claim_idle(cpu))
+				return cpu;
+		}
+
+		return find_cpu(thread);
+	}
+
+	if (claim_idle(prev) || now - thread->last_ran < SCHED_CACHE_HOT)
+		return prev;
+
+	for_each_cpu(i, &cpumask_idle) {
+		struct cpu *cpu = getcpu(i);
+		if (cpu->llc_id == prev->llc_id && cpu_allowed(thread, cpu) &&
+		    claim_idle(cpu))
+			return cpu;
+	}
+
+	for_each_cpu(i, &cpumask_idle) {
+		struct cpu *cpu = getcpu(i);
+		if (cpu_allowed(thread, cpu) && claim_idle(cpu))
+			return cpu;
+	}
+
+	return prev;
+}
+
 void sched_resume_locked(struct kthread *thread)
 {
 	assert(spinlock_held(&thread->thread_lock));
 
-	struct cpu *cpu = thread->affinity_cpu;
-	if (!cpu) {
-		cpu = find_cpu();
+	nstime_t now = uptime();
+
+	if (thread->status == THREAD_WAITING) {
+		if (now > thread->last_ran)
+			thread->sleep_time += now - thread->last_ran;
+		sched_update_priority(thread);
 	}
 
-	spinlock_lock_noipl(&cpu->sched_lock);
+	struct cpu *cpu = select_cpu(thread, now);
+
+	qspinlock_lock_noipl(&cpu->sched_lock);
 	sched_insert(cpu, thread, cpu != curcpu());
-	spinlock_unlock_noipl(&cpu->sched_lock);
+	qspinlock_unlock_noipl(&cpu->sched_lock);
+}
+
+nstime_t sched_timer_slack(struct kthread *thread)
+{
+	nstime_t slack = __atomic_load_n(&thread->timer_slack, __ATOMIC_RELAXED);
+	if (slack != SCHED_TIMER_SLACK_DEFAULT)
+		return slack;
+
+	// real-time threads want their deadlines exact
+	if (thread->base_priority >= SCHED_PRIO_REAL_TIME)
+		return SCHED_TIMER_SLACK_REAL_TIME;
+	return SCHED_TIMER_SLACK_TIME_SHARE;
+}
+
+void sched_set_affinity(struct kthread *thread, const struct cpumask *mask)
+{
+	ipl_t ipl = spinlock_lock(&thread->thread_lock);
+
+	thread->affinity = *mask;
+
+	struct cpu *cpu = curcpu();
+
+	if (thread == cpu->current_thread) {
+		if (cpu_allowed(thread, cpu)) {
+			spinlock_unlock(&thread->thread_lock, ipl);
+			return;
+		}
+
+		struct cpu *target = select_cpu(thread, uptime());
+		if (target == cpu) {
+			// no allowed cpu is online, stay where we are
+			spinlock_unlock(&thread->thread_lock, ipl);
+			return;
+		}
+
+		// get ourselves queued on an allowed cpu and switch away,
+		// like sched_preempt does. We continue over there with the
+		// thread lock dropped.
+		__atomic_store_n(&thread->switching, 1, __ATOMIC_RELAXED);
+
+		qspinlock_lock_noipl(&target->sched_lock);
+		sched_insert(target, thread, 1);
+		qspinlock_unlock_noipl(&target->sched_lock);
+
+		sched_yield(thread, cpu);
+		xipl(ipl);
+		return;
+	}
+
+	struct cpu *last = thread->last_cpu;
+	if (!last || cpu_allowed(thread, last)) {
+		spinlock_unlock(&thread->thread_lock, ipl);
+		return;
+	}
+
+	switch (thread->status) {
+	case THREAD_READY: {
+		// queued on a cpu it may no longer use: requeue it elsewhere
+		qspinlock_lock_noipl(&last->sched_lock);
+		bool dequeued = sched_dequeue(last, thread);
+		qspinlock_unlock_noipl(&last->sched_lock);
+
+		if (dequeued)
+			sched_resume_locked(thread);
+		break;
+	}
+	case THREAD_NEXT: {
+		// lined up over there: take it back unless it got picked
+		qspinlock_lock_noipl(&last->sched_lock);
+		bool taken = last->next_thread == thread;
+		if (taken)
+			last->next_thread = NULL;
+		qspinlock_unlock_noipl(&last->sched_lock);
+
+		if (taken) {
+			// an idle cpu would wait for it: let it go around again
+			softint_issue_other(last, IPL_DPC);
+			sched_resume_locked(thread);
+			break;
+		}
+		// switching to it by now
+		[[fallthrough]];
+	}
+	case THREAD_SWITCHING:
+	case THREAD_RUNNING:
+		// sched_preempt over there moves it once it sees the new mask
+		softint_issue_other(last, IPL_DPC);
+		break;
+	default:
+		// waiting: the wakeup picks an allowed cpu
+		break;
+	}
+
+	spinlock_unlock(&thread->thread_lock, ipl);
+}
+
+// Change the priority of a thread, moving it to the matching runqueue
+// if it is queued somewhere
+static void sched_reprioritize_locked(struct kthread *thread,
+				      unsigned int priority)
+{
+	assert(spinlock_held(&thread->thread_lock));
+	struct cpu *cpu = thread->last_cpu;
+
+	if (thread->status == THREAD_READY && cpu) {
+		qspinlock_lock_noipl(&cpu->sched_lock);
+		if (sched_dequeue(cpu, thread)) {
+			thread->priority = priority;
+			sched_insert(cpu, thread, cpu != curcpu());
+			qspinlock_unlock_noipl(&cpu->sched_lock);
+			return;
+		}
+		qspinlock_unlock_noipl(&cpu->sched_lock);
+	}
+
+	// running, lined up or waiting: the new priority counts from the
+	// next time it gets inserted
+	thread->priority = priority;
+}
+
+// Recompute what the thread inherits from the loans it still holds and
+// move it to the resulting priority
+static void pi_update_locked(struct kthread *thread)
+{
+	assert(spinlock_held(&thread->thread_lock));
+
+	unsigned int inherited = 0;
+	struct pi_loan *loan;
+	LIST_FOREACH(loan, &thread->pi_loans, entry) {
+		inherited = MAX(inherited, loan->priority);
+	}
+	thread->inherited_priority = inherited;
+
+	// the runqueues are indexed by the current priority, so only the
+	// target is computed here
+	unsigned int priority = thread->priority;
+	thread->priority = thread->base_priority;
+	sched_update_priority(thread);
+	unsigned int target = MAX(thread->priority, inherited);
+	thread->priority = priority;
+
+	if (target != priority)
+		sched_reprioritize_locked(thread, target);
+}
+
+// Take the loan back from the thread it was made to (obj_lock held)
+static void pi_unlink(struct pi_loan *loan)
+{
+	struct kthread *holder = loan->holder;
+
+	spinlock_lock_noipl(&holder->thread_lock);
+	LIST_REMOVE(loan, entry);
+	loan->holder = NULL;
+	loan->priority = 0;
+	pi_update_locked(holder);
+	spinlock_unlock_noipl(&holder->thread_lock);
+}
+
+void sched_lend_priority(struct kobject *obj, struct kthread **ownerp,
+			 struct pi_loan *loan)
+{
+	struct kthread *self = curthread();
+	unsigned int priority = self->priority;
+
+	// The owner can't finish releasing the lock (which wakes waiters
+	// under the object lock) and so can't go away while we hold it.
+	// Its restore takes the object lock too, so our loan is either
+	// taken back by it or we see it gone.
+	ipl_t ipl = spinlock_lock(&obj->obj_lock);
+
+	struct kthread *owner = __atomic_load_n(ownerp, __ATOMIC_ACQUIRE);
+	if (!owner || owner == self)
+		goto out;
+
+	// the previous owner released the lock but didn't get to taking
+	// the loan back yet: its waiters are ours now
+	if (loan->holder && loan->holder != owner)
+		pi_unlink(loan);
+
+	spinlock_lock_noipl(&owner->thread_lock);
+	if (!loan->holder) {
+		loan->holder = owner;
+		LIST_INSERT_HEAD(&owner->pi_loans, loan, entry);
+	}
+	if (priority > loan->priority) {
+		loan->priority = priority;
+		owner->inherited_priority =
+			MAX(owner->inherited_priority, priority);
+		if (priority > owner->priority)
+			sched_reprioritize_locked(owner, priority);
+	}
+	spinlock_unlock_noipl(&owner->thread_lock);
+
+out:
+	spinlock_unlock(&obj->obj_lock, ipl);
+}
+
+void sched_withdraw_priority(struct kobject *obj, struct pi_loan *loan)
+{
+	ipl_t ipl = spinlock_lock(&obj->obj_lock);
+
+	if (!loan->holder) {
+		spinlock_unlock(&obj->obj_lock, ipl);
+		return;
+	}
+
+	// what is left is what the remaining waiters would have lent
+	unsigned int priority = 0;
+	struct wait_block *wb;
+	TAILQ_FOREACH(wb, &obj->obj_wait_list, entry) {
+		priority = MAX(priority, __atomic_load_n(&wb->thread->priority,
+							 __ATOMIC_RELAXED));
+	}
+
+	if (priority == 0) {
+		pi_unlink(loan);
+	} else if (priority < loan->priority) {
+		struct kthread *holder = loan->holder;
+		spinlock_lock_noipl(&holder->thread_lock);
+		loan->priority = priority;
+		pi_update_locked(holder);
+		spinlock_unlock_noipl(&holder->thread_lock);
+	}
+
+	spinlock_unlock(&obj->obj_lock, ipl);
+}
+
+void sched_restore_priority(struct kobject *obj, struct pi_loan *loan)
+{
+	struct kthread *thread = curthread();
+
+	// Waking the waiters took the object lock after we gave up the lock,
+	// so a loan made to us is visible here, and no new one can come in.
+	if (__atomic_load_n(&loan->holder, __ATOMIC_RELAXED) != thread)
+		return;
+
+	ipl_t ipl = spinlock_lock(&obj->obj_lock);
+
+	// a waiter of the next owner may have taken it over meanwhile
+	if (loan->holder != thread) {
+		spinlock_unlock(&obj->obj_lock, ipl);
+		return;
+	}
+
+	pi_unlink(loan);
+
+	spinlock_lock_noipl(&thread->thread_lock);
+
+	// step aside if we were only running because of the loan
+	struct cpu *cpu = curcpu();
+	struct sched *sched = &cpu->sched;
+
+	qspinlock_lock_noipl(&cpu->sched_lock);
+	uint32_t ready = sched->current_rq->ready_mask |
+			 sched->next_rq->ready_mask;
+	if (!cpu->next_thread && ready &&
+	    (unsigned int)(32 - __builtin_clz(ready)) > thread->priority) {
+		struct kthread *next = select_next(cpu, thread->priority);
+		if (next) {
+			next->status = THREAD_NEXT;
+			cpu->next_thread = next;
+			softint_issue(IPL_DPC);
+		}
+	}
+	qspinlock_unlock_noipl(&cpu->sched_lock);
+
+	spinlock_unlock_noipl(&thread->thread_lock);
+	spinlock_unlock(&obj->obj_lock, ipl);
 }
 
 void sched_resume(struct kthread *thread)
@@ -473,16 +1171,58 @@ void sched_exit_self()
 	__builtin_trap();
 }
 
+static inline bool idle_wakeup_pending(struct cpu *cpu)
+{
+	return __atomic_load_n(&cpu->softint_pending, __ATOMIC_SEQ_CST) ||
+	       __atomic_load_n(&cpu->next_thread, __ATOMIC_SEQ_CST);
+}
+
+#if CONFIG_IDLE_POLL
+// Spin for a short while before going to sleep. Wakeups during this window
+// need neither an IPI nor an exit from a low power state.
+static void idle_poll(struct cpu *cpu)
+{
+	__atomic_store_n(&cpu->idle_polling, 1, __ATOMIC_SEQ_CST);
+
+	nstime_t deadline = uptime() + SCHED_IDLE_POLL;
+	while (!idle_wakeup_pending(cpu) && uptime() < deadline) {
+		busyloop_hint();
+	}
+
+	__atomic_store_n(&cpu->idle_polling, 0, __ATOMIC_SEQ_CST);
+}
+#endif
+
 void idle_loop()
 {
+	struct cpu *cpu = curcpu();
+
+	timer_install(&cpu->balance_timer, SCHED_BALANCE_INTERVAL);
+
 	xipl(IPL_PASSIVE);
 	while (1) {
 		assert(curipl() == IPL_PASSIVE);
-#if defined __x86_64__
-		enable_interrupts();
-		asm volatile("hlt");
-#else
-#error "Unsupported architecture! Port idle_loop for your platform"
+
+		// look for work on the other cpus before halting
+		// if we got something, lowering the ipl switches to it
+		ipl_t ipl = ripl(IPL_DPC);
+		rcu_note_qs(cpu);
+		sched_balance(cpu);
+		xipl(ipl);
+
+		// wakeups may now target us directly. a waker claims the bit
+		// before inserting, so we might halt with a next thread already
+		// set, but then its IPI or its store to our wakeup line is on
+		// the way
+		bitset_atomic_set(&cpumask_idle, cpu->cpu_id);
+
+#if CONFIG_IDLE_POLL
+		idle_poll(cpu);
 #endif
+
+		// pending softints are dispatched by lowering the ipl
+		// at the top of the loop
+		if (!idle_wakeup_pending(cpu))
+			plat_idle(cpu);
 	}
 }
@@ -1,6 +1,8 @@
 #include <yak/sched.h>
 #include <yak/log.h>
 #include <yak/heap.h>
+#include <yak/cpu.h>
+#include <yak/cpudata.h>
 
 static void ensure_reapable(struct kthread *thread)
 {
@@ -9,6 +11,19 @@ static void ensure_reapable(struct kthread *thread)
 	spinlock_unlock(&thread->thread_lock, ipl);
 }
 
+// kmutex spinners look at the owner without a reference
+static void ensure_unpinned(struct kthread *thread)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	bitset_word_t tmp;
+	for_each_cpu(tmp, &cpumask_active) {
+		while (__atomic_load_n(&getcpu(tmp)->spin_owner,
+				       __ATOMIC_ACQUIRE) == thread)
+			busyloop_hint();
+	}
+}
+
 void kthread_destroy(struct kthread *thread)
 {
 	ensure_reapable(thread);
@@ -42,6 +57,7 @@ void kthread_destroy(struct kthread *thread)
 	vaddr_t stack_base = (vaddr_t)thread->kstack_top - KSTACK_SIZE;
 	vm_kfree((void *)stack_base, KSTACK_SIZE);
 
+	ensure_unpinned(thread);
 	kfree(thread, sizeof(struct kthread));
 #endif
 }
@@ -79,6 +79,7 @@ static void set_timeout(struct kthread *thread, nstime_t timeout)
 	struct timer *ttim = &thread->timeout_timer;
 
 	timer_reset(ttim);
+	ttim->slack = sched_timer_slack(thread);
 	timer_install(ttim, timeout);
 
 	// We cannot miss the timeout, we are at ipl = DPC
@@ -1,13 +1,33 @@
+#define pr_fmt(fmt) "spinlock: " fmt
+
+#include <assert.h>
 #include <yak/spinlock.h>
+#include <yak/cpudata.h>
+#include <yak/panic.h>
+#include <yak/lockstat.h>
+#include <yak/hint.h>
 
 #ifdef SPINLOCK_DEBUG
 // #define SPINLOCK_DEBUG_OWNER
 // #define SPINLOCK_DEBUG_
 void spinlock_lock_noipl(struct spinlock *lock)
 {
+#if CONFIG_LOCKSTAT
+	if (likely(spinlock_trylock(lock))) {
+		lockstat_record(lock, lock->name, LOCKSTAT_SITE(), false, 0);
+	} else {
+		nstime_t start = lockstat_now();
+		while (!spinlock_trylock(lock)) {
+			busyloop_hint();
+		}
+		lockstat_record(lock, lock->name, LOCKSTAT_SITE(), true,
+				lockstat_now() - start);
+	}
+#else
 	while (!spinlock_trylock(lock)) {
 		busyloop_hint();
 	}
+#endif
 #ifdef SPINLOCK_DEBUG_OWNER
 	lock->owner = curthread();
 #endif
@@ -21,3 +41,176 @@ void spinlock_unlock_noipl(struct spinlock *lock)
 	__atomic_store_n(&lock->state, SPINLOCK_UNLOCKED, __ATOMIC_RELEASE);
 }
 #endif
+
+// Interrupts may take qspinlocks too, so the nodes are claimed atomically
+static struct qspinlock_node *qspinlock_node_get()
+{
+	struct cpu *cpu = curcpu();
+
+	while (1) {
+		unsigned long used = __atomic_load_n(&cpu->qspinlock_nodes_used,
+						     __ATOMIC_RELAXED);
+		if (used == (1UL << QSPINLOCK_NODES) - 1)
+			panic("out of qspinlock nodes\n");
+
+		unsigned long bit = 1UL << __builtin_ctzl(~used);
+		if (!(__atomic_fetch_or(&cpu->qspinlock_nodes_used, bit,
+					__ATOMIC_ACQUIRE) &
+		      bit)) {
+			return &cpu->qspinlock_nodes[__builtin_ctzl(bit)];
+		}
+	}
+}
+
+static void qspinlock_node_put(struct qspinlock_node *node)
+{
+	struct cpu *cpu = curcpu();
+	size_t idx = node - cpu->qspinlock_nodes;
+	assert(idx < QSPINLOCK_NODES);
+
+	__atomic_fetch_and(&cpu->qspinlock_nodes_used, ~(1UL << idx),
+			   __ATOMIC_RELEASE);
+}
+
+void qspinlock_lock_noipl(struct qspinlock *lock)
+{
+	struct qspinlock_node *node = qspinlock_node_get();
+
+	node->next = NULL;
+	node->locked = 0;
+
+	struct qspinlock_node *prev =
+		__atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev) {
+#if CONFIG_LOCKSTAT
+		nstime_t start = lockstat_now();
+#endif
+		// get in line and wait for our predecessor to hand over
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+			busyloop_hint();
+		}
+#if CONFIG_LOCKSTAT
+		lockstat_record(lock, lock->name, LOCKSTAT_SITE(), true,
+				lockstat_now() - start);
+	} else {
+		lockstat_record(lock, lock->name, LOCKSTAT_SITE(), false, 0);
+#endif
+	}
+
+	lock->owner = node;
+}
+
+void qspinlock_unlock_noipl(struct qspinlock *lock)
+{
+	struct qspinlock_node *node = lock->owner;
+	struct qspinlock_node *next =
+		__atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (!next) {
+		// nobody waiting: try to leave the lock unlocked
+		struct qspinlock_node *expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			goto out;
+
+		// someone swapped the tail but hasn't linked up yet
+		while (!(next = __atomic_load_n(&node->next,
+						__ATOMIC_ACQUIRE))) {
+			busyloop_hint();
+		}
+	}
+
+	__atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+
+out:
+	qspinlock_node_put(node);
+}
+
+#if CONFIG_SPINLOCK_BENCH
+#include <yak/cpu.h>
+#include <yak/ipi.h>
+#include <yak/log.h>
+#include <yak/clocksource.h>
+
+// Every online cpu hammers the same lock, once for each lock type
+#define BENCH_ROUNDS 100000
+
+static SPINLOCK(bench_tas_lock);
+static QSPINLOCK(bench_mcs_lock);
+
+static struct {
+	bool mcs;
+	int go;
+	size_t ready;
+	size_t done;
+	unsigned long counter;
+} bench;
+
+static void bench_worker(void *)
+{
+	__atomic_fetch_add(&bench.ready, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&bench.go, __ATOMIC_ACQUIRE)) {
+		busyloop_hint();
+	}
+
+	for (size_t i = 0; i < BENCH_ROUNDS; i++) {
+		if (bench.mcs) {
+			qspinlock_lock_noipl(&bench_mcs_lock);
+			bench.counter++;
+			qspinlock_unlock_noipl(&bench_mcs_lock);
+		} else {
+			spinlock_lock_noipl(&bench_tas_lock);
+			bench.counter++;
+			spinlock_unlock_noipl(&bench_tas_lock);
+		}
+	}
+
+	__atomic_fetch_add(&bench.done, 1, __ATOMIC_RELEASE);
+}
+
+static nstime_t bench_run(bool mcs, size_t ncpus)
+{
+	bench.mcs = mcs;
+	bench.go = 0;
+	bench.ready = 0;
+	bench.done = 0;
+	bench.counter = 0;
+
+	ipi_send(IPI_SEND_OTHERS, bench_worker, NULL);
+	while (__atomic_load_n(&bench.ready, __ATOMIC_ACQUIRE) != ncpus - 1) {
+		busyloop_hint();
+	}
+
+	int state = disable_interrupts();
+
+	nstime_t start = uptime();
+	__atomic_store_n(&bench.go, 1, __ATOMIC_RELEASE);
+
+	bench_worker(NULL);
+	while (__atomic_load_n(&bench.done, __ATOMIC_ACQUIRE) != ncpus) {
+		busyloop_hint();
+	}
+
+	nstime_t elapsed = uptime() - start;
+
+	if (state)
+		enable_interrupts();
+
+	assert(bench.counter == ncpus * BENCH_ROUNDS);
+	return elapsed;
+}
+
+void spinlock_bench()
+{
+	size_t ncpus = cpus_online();
+
+	nstime_t tas = bench_run(false, ncpus);
+	nstime_t mcs = bench_run(true, ncpus);
+
+	pr_info("%zu-way contention, %d rounds per cpu: tas %llu us, mcs %llu us\n",
+		ncpus, BENCH_ROUNDS, (unsigned long long)tas / 1000,
+		(unsigned long long)mcs / 1000);
+}
+#endif
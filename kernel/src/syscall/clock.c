@@ -21,6 +21,7 @@ DEFINE_SYSCALL(SYS_CLOCK_GET, clock_get, int clock, struct timespec *ts)
 	case CLOCK_MONOTONIC:
 	case CLOCK_BOOTTIME:
 		timestamp = uptime();
+		break;
 	default:
 		return SYS_ERR(EINVAL);
 	}
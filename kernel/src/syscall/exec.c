@@ -58,7 +58,7 @@ DEFINE_SYSCALL(SYS_EXECVE, execve, const char *user_path, char **user_argv,
 
 		struct kthread *thread;
 		status_t rv = launch_elf(proc, new_map, path,
-					 curthread()->priority, argv, envp,
+					 curthread()->base_priority, argv, envp,
 					 &thread);
 
 		if (IS_ERR(rv)) {
@@ -45,8 +45,13 @@ DEFINE_SYSCALL(SYS_FORK, fork)
 
 	struct kthread *new_thread = kmalloc(sizeof(struct kthread));
 	assert(new_thread != NULL);
-	kthread_init(new_thread, cur_thread->name, cur_thread->priority,
+	kthread_init(new_thread, cur_thread->name, cur_thread->base_priority,
 		     new_proc, 1);
+	// the child starts out with the parent's interactivity
+	new_thread->run_time = cur_thread->run_time;
+	new_thread->sleep_time = cur_thread->sleep_time;
+	new_thread->affinity = cur_thread->affinity;
+	new_thread->timer_slack = cur_thread->timer_slack;
 	kthread_context_copy(cur_thread, new_thread);
 
 	// Allocate a new kernel stack for the child
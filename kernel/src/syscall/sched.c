@@ -0,0 +1,109 @@
+#include <string.h>
+#include <yak/cpu.h>
+#include <yak/cpudata.h>
+#include <yak/process.h>
+#include <yak/queue.h>
+#include <yak/sched.h>
+#include <yak/spinlock.h>
+#include <yak/syscall.h>
+#include <yak/types.h>
+#include <yak-abi/errno.h>
+#include <yak-abi/syscall.h>
+
+static struct kprocess *affinity_target(pid_t pid)
+{
+	if (pid == 0)
+		return curproc();
+	return lookup_pid(pid);
+}
+
+// The mask applies to every thread of the process
+DEFINE_SYSCALL(SYS_SCHED_SETAFFINITY, sched_setaffinity, pid_t pid,
+	       size_t size, const void *user_mask)
+{
+	struct kprocess *proc = affinity_target(pid);
+	if (!proc)
+		return SYS_ERR(ESRCH);
+
+	struct cpumask mask, usable;
+	bitset_init(&mask);
+	memcpy(&mask, user_mask, MIN(size, sizeof(struct cpumask)));
+
+	bitset_and(&usable, &mask, &cpumask_active);
+	if (bitset_empty(&usable))
+		return SYS_ERR(EINVAL);
+
+	struct kthread *self = curthread(), *thread;
+	bool move_self = false;
+
+	ipl_t ipl = spinlock_lock(&proc->thread_list_lock);
+	LIST_FOREACH(thread, &proc->thread_list, process_entry) {
+		// we may have to switch cpus, which we can't do in here
+		if (thread == self) {
+			move_self = true;
+			continue;
+		}
+		sched_set_affinity(thread, &mask);
+	}
+	spinlock_unlock(&proc->thread_list_lock, ipl);
+
+	if (move_self)
+		sched_set_affinity(self, &mask);
+
+	return SYS_OK(0);
+}
+
+DEFINE_SYSCALL(SYS_SCHED_GETAFFINITY, sched_getaffinity, pid_t pid,
+	       size_t size, void *user_mask)
+{
+	if (size < sizeof(struct cpumask))
+		return SYS_ERR(EINVAL);
+
+	struct kprocess *proc = affinity_target(pid);
+	if (!proc)
+		return SYS_ERR(ESRCH);
+
+	struct kthread *thread;
+	struct cpumask mask;
+
+	ipl_t ipl = spinlock_lock(&proc->thread_list_lock);
+	if (proc == curproc()) {
+		thread = curthread();
+	} else {
+		thread = LIST_FIRST(&proc->thread_list);
+	}
+
+	if (!thread) {
+		spinlock_unlock(&proc->thread_list_lock, ipl);
+		return SYS_ERR(ESRCH);
+	}
+
+	spinlock_lock_noipl(&thread->thread_lock);
+	mask = thread->affinity;
+	spinlock_unlock_noipl(&thread->thread_lock);
+	spinlock_unlock(&proc->thread_list_lock, ipl);
+
+	memcpy(user_mask, &mask, sizeof(struct cpumask));
+
+	return SYS_OK(sizeof(struct cpumask));
+}
+
+// Slack for the calling thread's sleeps and timeouts, in ns.
+// SCHED_TIMER_SLACK_DEFAULT (-1) goes back to the scheduling class default.
+DEFINE_SYSCALL(SYS_SET_TIMER_SLACK, set_timer_slack, nstime_t slack)
+{
+	__atomic_store_n(&curthread()->timer_slack, slack, __ATOMIC_RELAXED);
+	return SYS_OK(0);
+}
+
+DEFINE_SYSCALL(SYS_GET_TIMER_SLACK, get_timer_slack)
+{
+	return SYS_OK(sched_timer_slack(curthread()));
+}
+
+// Fallback for the vDSO's getcpu on cpus without RDTSCP/RDPID.
+// The answer may be stale by the time userspace looks at it.
+DEFINE_SYSCALL(SYS_GETCPU, getcpu)
+{
+	return SYS_OK(cpuid());
+}
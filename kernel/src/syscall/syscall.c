@@ -44,7 +44,14 @@
 	X(SYS_LINKAT, sys_linkat,                                            \
 	  "olddirfd=%d oldpath=%p newdirfd=%d newpath=%p flags=%d")          \
 	X(SYS_CLOCK_GET, sys_clock_get, "clock=%d ts=%p")                    \
-	X(SYS_DEBUG_SLEEP, sys_debug_sleep, "duration=%ld ns")
+	X(SYS_DEBUG_SLEEP, sys_debug_sleep, "duration=%ld ns")               \
+	X(SYS_SCHED_SETAFFINITY, sys_sched_setaffinity,                      \
+	  "pid=%lld size=%ld mask=%p")                                       \
+	X(SYS_SCHED_GETAFFINITY, sys_sched_getaffinity,                      \
+	  "pid=%lld size=%ld mask=%p")                                       \
+	X(SYS_SET_TIMER_SLACK, sys_set_timer_slack, "slack=%lu ns")          \
+	X(SYS_GET_TIMER_SLACK, sys_get_timer_slack, "")                      \
+	X(SYS_GETCPU, sys_getcpu, "")
 
 #define SYSCALL_LIST_NOLOG        \
 	SYSCALL_LIST              \
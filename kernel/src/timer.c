@@ -1,3 +1,5 @@
+#define pr_fmt(fmt) "timer: " fmt
+
 #include <heap.h>
 #include <yak/timer.h>
 #include <yak/percpu.h>
@@ -8,10 +10,21 @@
 #include <yak/status.h>
 #include <yak/dpc.h>
 #include <yak/sched.h>
+#include <yak/log.h>
+#include <yak/macro.h>
+
+// latest time the timer may fire at
+static inline nstime_t timer_expiry(struct timer *timer)
+{
+	if (timer->deadline > TIMER_INFINITE - timer->slack)
+		return TIMER_INFINITE;
+	return timer->deadline + timer->slack;
+}
 
+// by expiry: the root is what the platform timer has to be armed for
 static int timer_cmp(struct timer *a, struct timer *b)
 {
-	return a->deadline < b->deadline;
+	return timer_expiry(a) < timer_expiry(b);
 }
 
 HEAP_IMPL(timer_heap, timer, entry, timer_cmp);
@@ -22,6 +35,198 @@ void timer_init(struct timer *timer)
 	timer->cpu = NULL;
 	timer->state = TIMER_STATE_UNUSED;
 	timer->deadline = 0;
+	timer->slack = 0;
+	timer->dpc = NULL;
+	timer->wheel_slot = -1;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel)
+{
+	wheel->clock = 0;
+	wheel->count = 0;
+	for (size_t i = 0; i < TIMER_WHEEL_LEVELS; i++)
+		wheel->occupied[i] = 0;
+	for (size_t i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+		wheel->slot_min[i] = TIMER_INFINITE;
+		LIST_INIT(&wheel->slots[i]);
+	}
+}
+
+static inline unsigned int wheel_shift(int level)
+{
+	return TIMER_WHEEL_SHIFT + level * TIMER_WHEEL_BITS;
+}
+
+static inline uint64_t rotr64(uint64_t x, unsigned int r)
+{
+	r &= 63;
+	return r ? (x >> r) | (x << (64 - r)) : x;
+}
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return rotr64(x, 64 - (r & 63));
+}
+
+// caller holds timer_lock
+static void timer_enqueue(struct cpu *cpu, struct timer *timer)
+{
+	struct timer_wheel *wheel = &cpu->timer_wheel;
+	nstime_t clock = wheel->clock;
+	nstime_t deadline = timer->deadline;
+
+	// due within the current slot: needs the exact order of the heap
+	if ((deadline >> TIMER_WHEEL_SHIFT) <= (clock >> TIMER_WHEEL_SHIFT)) {
+		timer->wheel_slot = -1;
+		HEAP_INSERT(timer_heap, &cpu->timer_heap, timer);
+		return;
+	}
+
+	// the finest level that reaches far enough
+	int level;
+	uint64_t slot = 0;
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned int shift = wheel_shift(level);
+		slot = deadline >> shift;
+		if (slot - (clock >> shift) < TIMER_WHEEL_SLOTS)
+			break;
+	}
+
+	if (level == TIMER_WHEEL_LEVELS) {
+		// beyond the wheel: park in the last slot, re-sorted from there
+		level = TIMER_WHEEL_LEVELS - 1;
+		slot = (clock >> wheel_shift(level)) + TIMER_WHEEL_SLOTS - 1;
+	}
+
+	unsigned int bit = slot & (TIMER_WHEEL_SLOTS - 1);
+	size_t idx = level * TIMER_WHEEL_SLOTS + bit;
+
+	if (wheel->occupied[level] & (1ULL << bit)) {
+		wheel->slot_min[idx] =
+			MIN(wheel->slot_min[idx], timer_expiry(timer));
+	} else {
+		wheel->occupied[level] |= (1ULL << bit);
+		wheel->slot_min[idx] = timer_expiry(timer);
+	}
+
+	LIST_INSERT_HEAD(&wheel->slots[idx], timer, wheel_entry);
+	timer->wheel_slot = idx;
+	wheel->count++;
+}
+
+// caller holds timer_lock
+static void timer_dequeue(struct cpu *cpu, struct timer *timer)
+{
+	if (timer->wheel_slot < 0) {
+		HEAP_REMOVE(timer_heap, &cpu->timer_heap, timer);
+		return;
+	}
+
+	struct timer_wheel *wheel = &cpu->timer_wheel;
+	size_t idx = timer->wheel_slot;
+
+	LIST_REMOVE(timer, wheel_entry);
+	if (LIST_EMPTY(&wheel->slots[idx]))
+		wheel->occupied[idx / TIMER_WHEEL_SLOTS] &=
+			~(1ULL << (idx % TIMER_WHEEL_SLOTS));
+
+	timer->wheel_slot = -1;
+	wheel->count--;
+}
+
+// Re-sort the timers of all slots that started by now.
+// caller holds timer_lock
+static void timer_wheel_advance(struct cpu *cpu, nstime_t now)
+{
+	struct timer_wheel *wheel = &cpu->timer_wheel;
+	nstime_t clock = wheel->clock;
+
+	if (now <= clock)
+		return;
+
+	wheel->clock = now;
+	if (wheel->count == 0)
+		return;
+
+	LIST_HEAD(, timer) due = LIST_HEAD_INITIALIZER(due);
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned int shift = wheel_shift(level);
+		uint64_t from = (clock >> shift) + 1;
+		uint64_t to = now >> shift;
+
+		// coarser levels can't have moved either
+		if (to < from)
+			break;
+
+		uint64_t range = ~0ULL;
+		if (to - from < TIMER_WHEEL_SLOTS - 1) {
+			range = (1ULL << (to - from + 1)) - 1;
+			range = rotl64(range, from & (TIMER_WHEEL_SLOTS - 1));
+		}
+
+		uint64_t pending = wheel->occupied[level] & range;
+		wheel->occupied[level] &= ~pending;
+
+		while (pending) {
+			unsigned int bit = __builtin_ctzll(pending);
+			pending &= pending - 1;
+
+			size_t idx = level * TIMER_WHEEL_SLOTS + bit;
+			struct timer *timer;
+			while ((timer = LIST_FIRST(&wheel->slots[idx]))) {
+				LIST_REMOVE(timer, wheel_entry);
+				LIST_INSERT_HEAD(&due, timer, wheel_entry);
+				wheel->count--;
+			}
+		}
+	}
+
+	struct timer *timer;
+	while ((timer = LIST_FIRST(&due))) {
+		LIST_REMOVE(timer, wheel_entry);
+		timer_enqueue(cpu, timer);
+	}
+}
+
+// Timers are sorted by deadline, but may expire as late as deadline + slack.
+// Walk the occupied slots of each level in order, until they start after
+// the earliest expiry found so far.
+static nstime_t timer_wheel_next(struct timer_wheel *wheel)
+{
+	nstime_t next = TIMER_INFINITE;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned int shift = wheel_shift(level);
+		uint64_t first = (wheel->clock >> shift) + 1;
+		unsigned int start = first & (TIMER_WHEEL_SLOTS - 1);
+		// bit 0 is the first slot ahead of the clock
+		uint64_t occupied = rotr64(wheel->occupied[level], start);
+
+		while (occupied) {
+			unsigned int offset = __builtin_ctzll(occupied);
+			occupied &= occupied - 1;
+
+			if (((first + offset) << shift) >= next)
+				break;
+
+			unsigned int bit =
+				(start + offset) & (TIMER_WHEEL_SLOTS - 1);
+			next = MIN(next, wheel->slot_min[level * TIMER_WHEEL_SLOTS +
+							 bit]);
+		}
+	}
+
+	return next;
+}
+
+// caller holds timer_lock
+static nstime_t timer_next_expiry(struct cpu *cpu)
+{
+	nstime_t next = timer_wheel_next(&cpu->timer_wheel);
+	if (!HEAP_EMPTY(&cpu->timer_heap))
+		next = MIN(next, timer_expiry(HEAP_PEEK(&cpu->timer_heap)));
+	return next;
 }
 
 void timer_reset(struct timer *timer)
@@ -50,14 +255,14 @@ void timer_uninstall(struct timer *timer)
 		goto exit;
 	}
 
-	HEAP_REMOVE(timer_heap, &cpu->timer_heap, timer);
+	timer_dequeue(cpu, timer);
 
 	timer->cpu = NULL;
 	timer->state = TIMER_STATE_CANCELED;
 
-	// no need to run update dpc
+	// no need to re-arm
 	// either the timer wasn't the next timer anyway
-	// or it was the next and we re-arm to the new next
+	// or it was the next and timer_update re-arms to the new next
 
 exit:
 	spinlock_unlock_noipl(&cpu->timer_lock);
@@ -76,19 +281,31 @@ status_t timer_install(struct timer *timer, nstime_t ns_delta)
 		return YAK_BUSY;
 	}
 
-	timer->cpu = curcpu();
+	struct cpu *cpu = curcpu();
+	nstime_t now = uptime();
+
+	timer->cpu = cpu;
 	timer->state = TIMER_STATE_QUEUED;
-	timer->deadline = uptime() + ns_delta;
+	timer->deadline = now + ns_delta;
 
-	struct timer_heap *heap = &curcpu()->timer_heap;
-	HEAP_INSERT(timer_heap, heap, timer);
+	// an empty wheel can catch up for free
+	if (cpu->timer_wheel.count == 0)
+		cpu->timer_wheel.clock = MAX(cpu->timer_wheel.clock, now);
+
+	timer_enqueue(cpu, timer);
 
 	timer->hdr.obj_signal_count = 0;
 
-	spinlock_unlock_noipl(&timer->hdr.obj_lock);
-	spinlock_unlock_interrupts(&curcpu()->timer_lock, state);
+	// only reprogram when this is the new earliest expiry, else the
+	// armed deadline comes first and timer_update takes care of us
+	nstime_t expiry = timer_expiry(timer);
+	if (expiry < cpu->timer_next) {
+		cpu->timer_next = expiry;
+		plat_arm_timer(expiry);
+	}
 
-	dpc_enqueue(&curcpu()->timer_update_dpc, NULL);
+	spinlock_unlock_noipl(&timer->hdr.obj_lock);
+	spinlock_unlock_interrupts(&cpu->timer_lock, state);
 
 	return YAK_SUCCESS;
 }
@@ -96,26 +313,29 @@ status_t timer_install(struct timer *timer, nstime_t ns_delta)
 // run from DPC context
 void timer_update([[maybe_unused]] struct dpc *dpc, [[maybe_unused]] void *ctx)
 {
-	struct timer_heap *heap = &curcpu()->timer_heap;
+	struct cpu *cpu = curcpu();
+	struct timer_heap *heap = &cpu->timer_heap;
 
 	nstime_t curr_time;
 
 	do {
 		curr_time = uptime();
 
-		spinlock_lock_noipl(&curcpu()->timer_lock);
-		if (HEAP_EMPTY(heap)) {
-			plat_arm_timer(TIMER_INFINITE);
-			spinlock_unlock_noipl(&curcpu()->timer_lock);
+		spinlock_lock_noipl(&cpu->timer_lock);
+
+		timer_wheel_advance(cpu, curr_time);
+
+		// Fire everything past its deadline, in order of expiry: timers
+		// with overlapping slack windows share one interrupt
+		if (HEAP_EMPTY(heap) || HEAP_PEEK(heap)->deadline > curr_time) {
+			// always re-arm: we may have been woken up early
+			cpu->timer_next = timer_next_expiry(cpu);
+			plat_arm_timer(cpu->timer_next);
+			spinlock_unlock_noipl(&cpu->timer_lock);
 			return;
 		}
 
 		struct timer *root = HEAP_PEEK(heap);
-		if (root->deadline > curr_time) {
-			plat_arm_timer(root->deadline);
-			spinlock_unlock_noipl(&curcpu()->timer_lock);
-			return;
-		}
 
 		spinlock_lock_noipl(&root->hdr.obj_lock);
 
@@ -131,8 +351,11 @@ void timer_update([[maybe_unused]] struct dpc *dpc, [[maybe_unused]] void *ctx)
 
 		root->hdr.obj_signal_count = 1;
 
+		if (root->dpc)
+			dpc_enqueue(root->dpc, root);
+
 		spinlock_unlock_noipl(&root->hdr.obj_lock);
-		spinlock_unlock_noipl(&curcpu()->timer_lock);
+		spinlock_unlock_noipl(&cpu->timer_lock);
 	} while (1);
 }
 
@@ -140,6 +363,7 @@ void ksleep(nstime_t ns)
 {
 	struct timer timer;
 	timer_init(&timer);
+	timer.slack = sched_timer_slack(curthread());
 	timer_install(&timer, ns);
 	sched_wait(&timer, WAIT_MODE_BLOCK, TIMEOUT_INFINITE);
 }
@@ -160,3 +384,36 @@ struct timespec time_now()
 	ts.tv_nsec = now - (ts.tv_sec * STIME(1));
 	return ts;
 }
+
+#if CONFIG_TIMER_BENCH
+#define BENCH_ROUNDS 32
+
+// how late do ksleeps wake up?
+void timer_bench()
+{
+	static const nstime_t sleeps[] = {
+		USTIME(10), USTIME(50), USTIME(100),
+		USTIME(500), MSTIME(1), MSTIME(5),
+	};
+
+	for (size_t i = 0; i < elementsof(sleeps); i++) {
+		nstime_t min = UINT64_MAX, max = 0, sum = 0;
+
+		for (int round = 0; round < BENCH_ROUNDS; round++) {
+			nstime_t start = uptime();
+			ksleep(sleeps[i]);
+			nstime_t late = uptime() - start - sleeps[i];
+
+			min = MIN(min, late);
+			max = MAX(max, late);
+			sum += late;
+		}
+
+		pr_info("ksleep(%llu us): late by min %llu avg %llu max %llu ns\n",
+			(unsigned long long)sleeps[i] / 1000,
+			(unsigned long long)min,
+			(unsigned long long)sum / BENCH_ROUNDS,
+			(unsigned long long)max);
+	}
+}
+#endif
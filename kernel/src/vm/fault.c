@@ -31,11 +31,13 @@ status_t vm_handle_fault(struct vm_map *map, vaddr_t address,
 
 	address = ALIGN_DOWN(address, PAGE_SIZE);
 
-	rwlock_acquire_shared(&map->map_lock, TIMEOUT_INFINITE);
+	// Faults only read the map. Concurrent faults are serialized by the
+	// amap, anon and object locks, and the pmap copes with them.
+	EXPECT(pcpu_rwlock_acquire_shared(&map->map_lock, TIMEOUT_INFINITE));
 	struct vm_map_entry *entry = vm_map_lookup_entry_locked(map, address);
 
 	if (!entry || entry->type == VM_MAP_ENT_RESERVED) {
-		rwlock_release_shared(&map->map_lock);
+		pcpu_rwlock_release_shared(&map->map_lock);
 		if (address < PAGE_SIZE)
 			return YAK_NULL_DEREF;
 
@@ -43,8 +45,10 @@ status_t vm_handle_fault(struct vm_map *map, vaddr_t address,
 	}
 
 	if (!(entry->protection & VM_WRITE)) {
-		if (fault_flags & VM_FAULT_WRITE)
+		if (fault_flags & VM_FAULT_WRITE) {
+			pcpu_rwlock_release_shared(&map->map_lock);
 			return YAK_PERM_DENIED;
+		}
 	}
 
 	voff_t map_offset = address - entry->base;
@@ -54,11 +58,9 @@ status_t vm_handle_fault(struct vm_map *map, vaddr_t address,
 		pmap_map(&map->pmap, address, entry->mmio_addr + backing_offset,
 			 0, entry->protection, entry->cache);
 
-		rwlock_release_shared(&map->map_lock);
+		pcpu_rwlock_release_shared(&map->map_lock);
 		return YAK_SUCCESS;
 	} else if (entry->type == VM_MAP_ENT_OBJ) {
-		rwlock_upgrade_to_exclusive(&map->map_lock);
-
 		assert(entry->object != NULL);
 
 		struct page *page = NULL;
@@ -162,7 +164,7 @@ status_t vm_handle_fault(struct vm_map *map, vaddr_t address,
 		}
 
 exit:
-		rwlock_release_exclusive(&map->map_lock);
+		pcpu_rwlock_release_shared(&map->map_lock);
 		return YAK_SUCCESS;
 	}
 
@@ -9,6 +9,7 @@
 #include <yak/arch-cpu.h>
 #include <yak/macro.h>
 #include <yak/ipi.h>
+#include <yak/cpudata.h>
 #include <yak/vm.h>
 #include <yak/vm/pmap.h>
 #include <yak/vm/pmm.h>
@@ -104,8 +105,15 @@ static pte_t *pte_fetch(struct pmap *pmap, uintptr_t va, size_t atLevel,
 			uintptr_t pa = pmm_alloc_zeroed();
 			assert(pa != 0);
 
-			pte = pte_make_dir(pa);
-			PTE_STORE(ptep, pte);
+			// faults on the same map may race us here
+			pte_t new_pte = pte_make_dir(pa);
+			if (__atomic_compare_exchange_n(ptep, &pte, new_pte, 0,
+							__ATOMIC_SEQ_CST,
+							__ATOMIC_SEQ_CST)) {
+				pte = new_pte;
+			} else {
+				pmm_free(pa);
+			}
 		} else {
 			assert(!pte_is_large(pte, lvl));
 		}
@@ -121,6 +129,7 @@ static inline void pmap_invalidate(vaddr_t va)
 	asm volatile("invlpg (%0)" ::"r"(va) : "memory");
 }
 
+// with PCIDs, this only flushes the current context
 static inline void pmap_flush_tlb()
 {
 	uint64_t pml4;
@@ -128,17 +137,10 @@ static inline void pmap_flush_tlb()
 	asm volatile("mov %0, %%cr3" : : "r"(pml4) : "memory");
 }
 
-static void pmap_invalidate_range(vaddr_t va, size_t length, size_t pgsz)
-{
-	for (size_t i = 0; i < length; i += pgsz) {
-		pmap_invalidate(va + i);
-	}
-}
-
 struct shootdown_context {
+	struct pmap *pmap;
 	vaddr_t va;
 	size_t length;
-	bool kernel;
 #ifdef PMAP_HAS_LARGE_PAGE_SIZES
 	size_t level;
 #endif
@@ -147,8 +149,6 @@ struct shootdown_context {
 static void shootdown_handler(void *ctx)
 {
 	struct shootdown_context *shootdown_ctx = ctx;
-	vaddr_t va = shootdown_ctx->va;
-	size_t len = shootdown_ctx->length;
 
 #ifdef PMAP_HAS_LARGE_PAGE_SIZES
 	size_t level = shootdown_ctx->level;
@@ -157,38 +157,161 @@ static void shootdown_handler(void *ctx)
 	size_t pgsz = PAGE_SIZE;
 #endif
 
-	// more efficient to just flush the whole thing altogether
-	if ((len >> PAGE_SHIFT) >= 64) {
-		pmap_flush_tlb();
-	} else {
-		pmap_invalidate_range(va, len, pgsz);
-	}
+	pmap_invalidate_local(shootdown_ctx->pmap, shootdown_ctx->va,
+			      shootdown_ctx->length, pgsz);
 }
 
 size_t n_shootdowns = 0;
 
+// Who has to take the shootdown. Lazy cpus are skipped: they only run
+// kernel threads right now and flush when they come back to the map,
+// see pmap_lazy_exit().
+static void shootdown_targets(struct pmap *pmap, struct cpumask *out)
+{
+	for (size_t i = 0; i < elementsof(out->bits); i++) {
+		bitset_word_t mapped = __atomic_load_n(&pmap->mapped_on.bits[i],
+						       __ATOMIC_SEQ_CST);
+		bitset_word_t lazy = mapped &
+				     __atomic_load_n(&pmap->lazy_on.bits[i],
+						     __ATOMIC_SEQ_CST);
+		if (lazy) {
+			__atomic_fetch_or(&pmap->stale_on.bits[i], lazy,
+					  __ATOMIC_SEQ_CST);
+			// a cpu that left lazy mode meanwhile may have checked
+			// its stale bit before we set it: interrupt it after all
+			lazy &= __atomic_load_n(&pmap->lazy_on.bits[i],
+						__ATOMIC_SEQ_CST);
+		}
+		out->bits[i] = mapped & ~lazy;
+	}
+}
+
 static void do_tlb_shootdown(struct pmap *pmap, vaddr_t va, size_t length,
 			     size_t level)
 {
-	if (cpus_online() == 1)
+	bool kernel = pmap == &kmap()->pmap;
+
+	// cpus that don't have the pmap loaded catch up when they load it
+	if (!kernel)
+		__atomic_fetch_add(&pmap->tlb_gen, 1, __ATOMIC_SEQ_CST);
+
+	// kernel entries live in every tagged context, our own invalidation
+	// only reached the current one
+	bool local = kernel && pmap_tlb_tagged();
+
+	if (cpus_online() == 1 && !local)
 		return;
 
-	__atomic_fetch_add(&n_shootdowns, 1, __ATOMIC_RELAXED);
+	struct cpumask mask;
+	if (kernel) {
+		mask = cpumask_active;
+	} else {
+		// the PTE stores must be visible before we look at the masks
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		shootdown_targets(pmap, &mask);
+	}
+
+	bitset_clear(&mask, cpuid());
+	if (!bitset_empty(&mask))
+		__atomic_fetch_add(&n_shootdowns, 1, __ATOMIC_RELAXED);
+	else if (!local)
+		return;
+
+	if (local)
+		bitset_set(&mask, cpuid());
 
 	struct shootdown_context ctx;
+	ctx.pmap = pmap;
 	ctx.va = va;
 	ctx.length = length;
 	ctx.level = level;
 
-	struct cpumask *mask = &pmap->mapped_on;
-	if (pmap == &kmap()->pmap) {
-		mask = &cpumask_active;
+	ipi_mask_send(&mask, shootdown_handler, &ctx, local, true);
+}
+
+void pmap_lazy_enter(struct pmap *pmap)
+{
+	bitset_atomic_set(&pmap->lazy_on, cpuid());
+}
+
+void pmap_lazy_exit(struct pmap *pmap)
+{
+	size_t cpu = cpuid();
+
+	bitset_atomic_clear(&pmap->lazy_on, cpu);
+	// pairs with the re-check in shootdown_targets()
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (bitset_atomic_test_and_clear(&pmap->stale_on, cpu))
+		pmap_flush_tlb();
+}
+
+void pmap_gather_init(struct pmap_gather *gather, struct pmap *pmap)
+{
+	gather->pmap = pmap;
+	gather->start = 0;
+	gather->end = 0;
+	gather->level = 0;
+	gather->nfree = 0;
+}
+
+static void gather_range(struct pmap_gather *gather, vaddr_t va,
+			 size_t length, size_t level)
+{
+	if (gather->start == gather->end) {
+		gather->start = va;
+		gather->end = va + length;
+		gather->level = level;
+		return;
 	}
-	ipi_mask_send(mask, shootdown_handler, &ctx, false, true);
+
+	gather->start = MIN(gather->start, va);
+	gather->end = MAX(gather->end, va + length);
+	// invalidating at the smallest page size covers the larger ones too
+	gather->level = MIN(gather->level, level);
+}
+
+static void gather_flush(struct pmap_gather *gather)
+{
+	if (gather->start != gather->end) {
+		do_tlb_shootdown(gather->pmap, gather->start,
+				 gather->end - gather->start, gather->level);
+		gather->start = gather->end = 0;
+	}
+
+	// nobody can reach these pages anymore
+	for (size_t i = 0; i < gather->nfree; i++)
+		pmm_free(gather->free[i]);
+	gather->nfree = 0;
+}
+
+static void gather_page(struct pmap_gather *gather, paddr_t pa)
+{
+	gather->free[gather->nfree++] = pa;
+	if (gather->nfree == PMAP_GATHER_BATCH)
+		gather_flush(gather);
+}
+
+void pmap_gather_finish(struct pmap_gather *gather)
+{
+	gather_flush(gather);
+}
+
+static void pmap_init_common(struct pmap *pmap)
+{
+	static uint64_t next_id = 1;
+
+	pmap->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+	pmap->tlb_gen = 0;
+
+	bitset_init(&pmap->mapped_on);
+	bitset_init(&pmap->lazy_on);
+	bitset_init(&pmap->stale_on);
 }
 
 void pmap_kernel_bootstrap(struct pmap *pmap)
 {
+	pmap_init_common(pmap);
 	pmap->top_level = pmm_alloc_zeroed();
 	uint64_t *top_dir = (uint64_t *)p2v(pmap->top_level);
 	// preallocate the top half so we can share among user maps
@@ -202,6 +325,7 @@ void pmap_kernel_bootstrap(struct pmap *pmap)
 
 void pmap_init(struct pmap *pmap)
 {
+	pmap_init_common(pmap);
 	pmap->top_level = pmm_alloc_zeroed();
 	uint64_t *top_dir = (uint64_t *)p2v(pmap->top_level);
 	uint64_t *kernel_top_dir = (uint64_t *)p2v(kmap()->pmap.top_level);
@@ -254,7 +378,8 @@ paddr_t pmap_unmap(struct pmap *pmap, uintptr_t va, size_t level)
 }
 
 void pmap_protect_range(struct pmap *pmap, vaddr_t va, size_t length,
-			vm_prot_t prot, vm_cache_t cache, size_t level)
+			vm_prot_t prot, vm_cache_t cache, size_t level,
+			struct pmap_gather *gather)
 {
 #ifdef PMAP_HAS_LARGE_PAGE_SIZES
 	size_t pgsz = level == 0 ? PAGE_SIZE : PMAP_LARGE_PAGE_SIZES[level - 1];
@@ -262,6 +387,13 @@ void pmap_protect_range(struct pmap *pmap, vaddr_t va, size_t length,
 	size_t pgsz = PAGE_SIZE;
 #endif
 
+	struct pmap_gather local;
+	if (!gather) {
+		pmap_gather_init(&local, pmap);
+		gather = &local;
+	}
+	assert(gather->pmap == pmap);
+
 	for (uintptr_t i = 0; i < length; i += pgsz) {
 		pte_t *ppte = pte_fetch(pmap, va + i, level, 0);
 		if (ppte) {
@@ -276,60 +408,64 @@ void pmap_protect_range(struct pmap *pmap, vaddr_t va, size_t length,
 		}
 	}
 
-	do_tlb_shootdown(pmap, va, length, level);
+	gather_range(gather, va, length, level);
+
+	if (gather == &local)
+		pmap_gather_finish(&local);
 }
 
 void pmap_unmap_range(struct pmap *pmap, uintptr_t va, size_t length,
-		      size_t level)
+		      size_t level, struct pmap_gather *gather)
 {
 #ifdef PMAP_HAS_LARGE_PAGE_SIZES
 	size_t pgsz = level == 0 ? PAGE_SIZE : PMAP_LARGE_PAGE_SIZES[level - 1];
 #else
 	size_t pgsz = PAGE_SIZE;
 #endif
+
+	struct pmap_gather local;
+	if (!gather) {
+		pmap_gather_init(&local, pmap);
+		gather = &local;
+	}
+	assert(gather->pmap == pmap);
+
 	for (uintptr_t i = 0; i < length; i += pgsz) {
 		do_unmap(pmap, va + i, level);
 	}
 
-	do_tlb_shootdown(pmap, va, length, level);
-}
+	gather_range(gather, va, length, level);
 
-// 32 * 4k = 128kib
-#define FREE_BATCH 32
+	if (gather == &local)
+		pmap_gather_finish(&local);
+}
 
 void pmap_unmap_range_and_free(struct pmap *pmap, uintptr_t base, size_t length,
-			       size_t level)
+			       size_t level, struct pmap_gather *gather)
 {
 	assert(level == 0);
 	size_t pgsz = PAGE_SIZE;
 
-	paddr_t batch[FREE_BATCH];
-	size_t batch_count = 0;
+	struct pmap_gather local;
+	if (!gather) {
+		pmap_gather_init(&local, pmap);
+		gather = &local;
+	}
+	assert(gather->pmap == pmap);
 
 	for (voff_t offset = 0; offset < length; offset += pgsz) {
 		vaddr_t vaddr = base + offset;
 		paddr_t pa = do_unmap(pmap, vaddr, level);
-		batch[batch_count++] = pa;
-
-		if (batch_count == FREE_BATCH) {
-			do_tlb_shootdown(pmap, vaddr - (FREE_BATCH - 1) * pgsz,
-					 FREE_BATCH * pgsz, level);
-
-			for (size_t i = 0; i < batch_count; i++) {
-				pmm_free(batch[i]);
-			}
+		if (pa == UINTPTR_MAX)
+			continue;
 
-			batch_count = 0;
-		}
+		// the range goes in first: a full batch flushes it
+		gather_range(gather, vaddr, pgsz, level);
+		gather_page(gather, pa);
 	}
 
-	if (batch_count > 0) {
-		vaddr_t vaddr = base + length - batch_count * pgsz;
-		do_tlb_shootdown(pmap, vaddr, batch_count * pgsz, level);
-		for (size_t i = 0; i < batch_count; i++) {
-			pmm_free(batch[i]);
-		}
-	}
+	if (gather == &local)
+		pmap_gather_finish(&local);
 }
 
 void pmap_large_map_range(struct pmap *pmap, paddr_t base, size_t length,
@@ -53,7 +53,14 @@ static void free_map_entry(struct vm_map_entry *entry)
 
 status_t vm_map_init(struct vm_map *map)
 {
-	rwlock_init(&map->map_lock, "map_lock");
+	// the kernel map comes up before the heap does.
+	// Page faults are the hot read side of user maps.
+	status_t rv = pcpu_rwlock_init(&map->map_lock, "map_lock",
+				       map != &kernel_map);
+	IF_ERR(rv)
+	{
+		return rv;
+	}
 
 	RBT_INIT(vm_map_rbtree, &map->map_tree);
 
@@ -68,7 +75,8 @@ status_t vm_map_init(struct vm_map *map)
 
 void vm_map_destroy(struct vm_map *map)
 {
-	EXPECT(rwlock_acquire_exclusive(&map->map_lock, TIMEOUT_INFINITE));
+	EXPECT(pcpu_rwlock_acquire_exclusive(&map->map_lock,
+					     TIMEOUT_INFINITE));
 
 	while (!RBT_EMPTY(vm_map_rbtree, &map->map_tree)) {
 		struct vm_map_entry *entry =
@@ -85,6 +93,9 @@ void vm_map_destroy(struct vm_map *map)
 	}
 
 	pmap_destroy(&map->pmap);
+
+	pcpu_rwlock_release_exclusive(&map->map_lock);
+	pcpu_rwlock_destroy(&map->map_lock);
 }
 
 static void init_map_entry(struct vm_map_entry *entry, voff_t offset,
@@ -272,9 +283,9 @@ status_t vm_protect(struct vm_map *map, vaddr_t va, size_t length,
 	    !IS_ALIGNED_POW2(length, PAGE_SIZE))
 		return YAK_INVALID_ARGS;
 
-	guard(rwlock)(&map->map_lock, TIMEOUT_INFINITE,
-		      (flags & VM_MAP_LOCK_HELD) ? RWLOCK_GUARD_SKIP :
-						   RWLOCK_GUARD_EXCLUSIVE);
+	guard(pcpu_rwlock)(&map->map_lock, TIMEOUT_INFINITE,
+			   (flags & VM_MAP_LOCK_HELD) ? RWLOCK_GUARD_SKIP :
+							RWLOCK_GUARD_EXCLUSIVE);
 
 	if (RBT_EMPTY(vm_map_rbtree, &map->map_tree))
 		return YAK_SUCCESS;
@@ -287,6 +298,10 @@ status_t vm_protect(struct vm_map *map, vaddr_t va, size_t length,
 		current = RBT_MAX(vm_map_rbtree, &map->map_tree);
 	struct vm_map_entry *prev = RBT_PREV(vm_map_rbtree, current);
 
+	struct pmap_gather gather;
+	pmap_gather_init(&gather, &map->pmap);
+	status_t rv = YAK_SUCCESS;
+
 	// move to the first entry that might overlap [start, end)
 	if (prev && prev->end > search_base)
 		current = prev;
@@ -308,10 +323,9 @@ status_t vm_protect(struct vm_map *map, vaddr_t va, size_t length,
 
 		if (entry_base != split_base || entry_end != split_end) {
 			// current is modified in-place
-			status_t rv = carve_entry(map, current, split_base,
-						  split_end);
+			rv = carve_entry(map, current, split_base, split_end);
 			if (IS_ERR(rv))
-				return rv;
+				break;
 		}
 
 		// current is now fully inside [start, end)
@@ -319,19 +333,23 @@ status_t vm_protect(struct vm_map *map, vaddr_t va, size_t length,
 		if (flags & VM_MAP_SETMAXPROT) {
 			current->max_protection = prot;
 		} else if (!vm_check_prot(current->max_protection, prot)) {
-			return YAK_PERM_DENIED;
+			rv = YAK_PERM_DENIED;
+			break;
 		}
 
 		current->protection = prot;
 
 		pmap_protect_range(&map->pmap, current->base,
 				   current->end - current->base, prot,
-				   current->cache, 0);
+				   current->cache, 0, &gather);
 
 		current = next;
 	}
 
-	return YAK_SUCCESS;
+	// whatever we changed so far has to be shot down either way
+	pmap_gather_finish(&gather);
+
+	return rv;
 }
 
 status_t vm_unmap(struct vm_map *map, vaddr_t va, size_t length, int flags)
@@ -341,9 +359,9 @@ status_t vm_unmap(struct vm_map *map, vaddr_t va, size_t length, int flags)
 	va = ALIGN_DOWN(va, PAGE_SIZE);
 	length = ALIGN_UP(length, PAGE_SIZE);
 
-	guard(rwlock)(&map->map_lock, TIMEOUT_INFINITE,
-		      (flags & VM_MAP_LOCK_HELD) ? RWLOCK_GUARD_SKIP :
-						   RWLOCK_GUARD_EXCLUSIVE);
+	guard(pcpu_rwlock)(&map->map_lock, TIMEOUT_INFINITE,
+			   (flags & VM_MAP_LOCK_HELD) ? RWLOCK_GUARD_SKIP :
+							RWLOCK_GUARD_EXCLUSIVE);
 
 	if (RBT_EMPTY(vm_map_rbtree, &map->map_tree))
 		return YAK_SUCCESS;
@@ -359,6 +377,12 @@ status_t vm_unmap(struct vm_map *map, vaddr_t va, size_t length, int flags)
 	if (prev && prev->end > start)
 		current = prev;
 
+	struct pmap_gather gather;
+	pmap_gather_init(&gather, &map->pmap);
+	status_t rv = YAK_SUCCESS;
+	// the pages may only go once no TLB points at them anymore
+	struct vm_map_entry *dead = NULL;
+
 	while (current && current->base < end) {
 		struct vm_map_entry *next = RBT_NEXT(vm_map_rbtree, current);
 
@@ -374,10 +398,9 @@ status_t vm_unmap(struct vm_map *map, vaddr_t va, size_t length, int flags)
 		vaddr_t split_end = MIN(entry_end, end);
 
 		if (entry_base != split_base || entry_end != split_end) {
-			status_t rv = carve_entry(map, current, split_base,
-						  split_end);
+			rv = carve_entry(map, current, split_base, split_end);
 			if (IS_ERR(rv))
-				return rv;
+				break;
 
 			// current now exactly covers [split_base, split_end)
 			current = map_lower_bound(map, split_base);
@@ -385,24 +408,34 @@ status_t vm_unmap(struct vm_map *map, vaddr_t va, size_t length, int flags)
 
 		// unmap pages from the pmap
 		pmap_unmap_range(&map->pmap, current->base,
-				 current->end - current->base, 0);
+				 current->end - current->base, 0, &gather);
 
-		// deref object/amap if needed
-		if (current->type == VM_MAP_ENT_OBJ) {
-			assert(current->object);
-			if (current->amap)
-				vm_amap_deref(current->amap);
-			vm_object_deref(current->object);
-		}
-
-		// remove from map and free
+		// remove from map, free after the shootdown
 		RBT_REMOVE(vm_map_rbtree, &map->map_tree, current);
-		free_map_entry(current);
+		current->dead_next = dead;
+		dead = current;
 
 		current = next;
 	}
 
-	return YAK_SUCCESS;
+	pmap_gather_finish(&gather);
+
+	while (dead) {
+		struct vm_map_entry *entry = dead;
+		dead = entry->dead_next;
+
+		// deref object/amap if needed
+		if (entry->type == VM_MAP_ENT_OBJ) {
+			assert(entry->object);
+			if (entry->amap)
+				vm_amap_deref(entry->amap);
+			vm_object_deref(entry->object);
+		}
+
+		free_map_entry(entry);
+	}
+
+	return rv;
 }
 
 static status_t alloc_map_range_locked(struct vm_map *map, vaddr_t hint,
@@ -545,7 +578,8 @@ found:
 status_t vm_map_reserve(struct vm_map *map, vaddr_t hint, size_t length,
 			int flags, vaddr_t *out)
 {
-	guard(rwlock)(&map->map_lock, TIMEOUT_INFINITE, RWLOCK_GUARD_EXCLUSIVE);
+	guard(pcpu_rwlock)(&map->map_lock, TIMEOUT_INFINITE,
+			   RWLOCK_GUARD_EXCLUSIVE);
 
 	struct vm_map_entry *ent;
 	status_t rv = alloc_map_range_locked(map, hint, length, 0, 0, 0, 0,
@@ -557,7 +591,8 @@ status_t vm_map_reserve(struct vm_map *map, vaddr_t hint, size_t length,
 status_t vm_map_mmio(struct vm_map *map, paddr_t device_addr, size_t length,
 		     vm_prot_t prot, vm_cache_t cache, vaddr_t *out)
 {
-	guard(rwlock)(&map->map_lock, TIMEOUT_INFINITE, RWLOCK_GUARD_EXCLUSIVE);
+	guard(pcpu_rwlock)(&map->map_lock, TIMEOUT_INFINITE,
+			   RWLOCK_GUARD_EXCLUSIVE);
 
 	paddr_t rounded_addr = ALIGN_DOWN(device_addr, PAGE_SIZE);
 	size_t offset = device_addr - rounded_addr;
@@ -576,11 +611,34 @@ status_t vm_map_mmio(struct vm_map *map, paddr_t device_addr, size_t length,
 	return YAK_SUCCESS;
 }
 
+status_t vm_map_phys(struct vm_map *map, paddr_t pa, size_t length,
+		     vm_prot_t prot, vm_inheritance_t inheritance,
+		     vm_cache_t cache, vaddr_t hint, int flags, vaddr_t *out)
+{
+	assert(IS_ALIGNED_POW2(pa, PAGE_SIZE));
+
+	guard(pcpu_rwlock)(&map->map_lock, TIMEOUT_INFINITE,
+			   RWLOCK_GUARD_EXCLUSIVE);
+
+	struct vm_map_entry *entry;
+	// faults on MMIO entries map the backing address as-is
+	TRY(alloc_map_range_locked(map, hint, ALIGN_UP(length, PAGE_SIZE), prot,
+				   inheritance, cache, 0, VM_MAP_ENT_MMIO, flags,
+				   &entry));
+
+	entry->mmio_addr = pa;
+
+	*out = entry->base;
+
+	return YAK_SUCCESS;
+}
+
 status_t vm_map(struct vm_map *map, struct vm_object *obj, size_t length,
 		voff_t offset, vm_prot_t prot, vm_inheritance_t inheritance,
 		vm_cache_t cache, vaddr_t hint, int flags, vaddr_t *out)
 {
-	guard(rwlock)(&map->map_lock, TIMEOUT_INFINITE, RWLOCK_GUARD_EXCLUSIVE);
+	guard(pcpu_rwlock)(&map->map_lock, TIMEOUT_INFINITE,
+			   RWLOCK_GUARD_EXCLUSIVE);
 
 	struct vm_map_entry *entry;
 	status_t rv = alloc_map_range_locked(map, hint, length, prot,
@@ -641,18 +699,36 @@ void vm_map_activate(struct vm_map *map)
 	assert(map);
 
 	struct vm_map *old = PERCPU_FIELD_LOAD(current_map);
+	size_t cpu = cpuid();
 
-	if (old != map) {
-		pmap_activate(&map->pmap);
+	if (old == map) {
+		// back from a kernel thread
+		if (bitset_atomic_test(&map->pmap.lazy_on, cpu))
+			pmap_lazy_exit(&map->pmap);
+		return;
 	}
 
+	// shootdowns have to find us before the TLB may cache anything
+	bitset_atomic_set(&map->pmap.mapped_on, cpu);
+	// pmap_activate catches up on whatever we missed while we were lazy
+	bitset_atomic_clear(&map->pmap.stale_on, cpu);
+
+	pmap_activate(&map->pmap);
+
 	PERCPU_FIELD_STORE(current_map, map);
 
 	if (old != NULL) {
-		bitset_atomic_clear(&old->pmap.mapped_on, cpuid());
+		bitset_atomic_clear(&old->pmap.lazy_on, cpu);
+		bitset_atomic_clear(&old->pmap.mapped_on, cpu);
 	}
+}
 
-	bitset_atomic_set(&map->pmap.mapped_on, cpuid());
+void vm_map_lazy()
+{
+	struct vm_map *map = PERCPU_FIELD_LOAD(current_map);
+	// kernel mappings are shot down everywhere anyway
+	if (map && map != kmap())
+		pmap_lazy_enter(&map->pmap);
 }
 
 struct vm_map *vm_map_tmp_switch(struct vm_map *map)
@@ -674,8 +750,14 @@ status_t vm_map_fork(struct vm_map *from, struct vm_map *to)
 {
 	// to has to be initialized already
 
-	guard(rwlock)(&from->map_lock, TIMEOUT_INFINITE, RWLOCK_GUARD_SHARED);
-	guard(rwlock)(&to->map_lock, TIMEOUT_INFINITE, RWLOCK_GUARD_EXCLUSIVE);
+	guard(pcpu_rwlock)(&from->map_lock, TIMEOUT_INFINITE,
+			   RWLOCK_GUARD_SHARED);
+	guard(pcpu_rwlock)(&to->map_lock, TIMEOUT_INFINITE,
+			   RWLOCK_GUARD_EXCLUSIVE);
+
+	// one shootdown for all the COW ranges
+	struct pmap_gather gather;
+	pmap_gather_init(&gather, &from->pmap);
 
 	struct vm_map_entry *elm;
 	VM_MAP_FOREACH(elm, &from->map_tree)
@@ -710,7 +792,7 @@ status_t vm_map_fork(struct vm_map *from, struct vm_map *to)
 							   elm->base,
 							   elm->end - elm->base,
 							   cow_prot, elm->cache,
-							   0);
+							   0, &gather);
 				}
 			} else {
 				assert(!elm->is_cow);
@@ -725,5 +807,7 @@ status_t vm_map_fork(struct vm_map *from, struct vm_map *to)
 		RBT_INSERT(vm_map_rbtree, &to->map_tree, new_entry);
 	}
 
+	pmap_gather_finish(&gather);
+
 	return YAK_SUCCESS;
 }
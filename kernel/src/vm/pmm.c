@@ -56,7 +56,7 @@ struct zone {
 	unsigned int max_zone_order;
 
 	paddr_t base, end;
-	struct spinlock zone_lock;
+	struct qspinlock zone_lock;
 	int may_alloc;
 
 	SLIST_ENTRY(zone) list_entry;
@@ -94,7 +94,7 @@ void pmm_zone_init(int zone_id, const char *name, int may_alloc, paddr_t base,
 	zone->base = base;
 	zone->end = end;
 
-	spinlock_init(&zone->zone_lock);
+	qspinlock_init(&zone->zone_lock);
 
 	zone->may_alloc = may_alloc;
 
@@ -293,7 +293,7 @@ static struct page *zone_alloc(struct zone *zone, unsigned int desired_order)
 	if (unlikely(desired_order > zone->max_zone_order))
 		return NULL;
 
-	ipl_t ipl = spinlock_lock(&zone->zone_lock);
+	ipl_t ipl = qspinlock_lock(&zone->zone_lock);
 	zone_validate(zone);
 
 	if (zone->npages[desired_order] > 0) {
@@ -310,7 +310,7 @@ static struct page *zone_alloc(struct zone *zone, unsigned int desired_order)
 
 		zone_validate(zone);
 
-		spinlock_unlock(&zone->zone_lock, ipl);
+		qspinlock_unlock(&zone->zone_lock, ipl);
 
 		__atomic_fetch_sub(&free_pagecnt, (1 << desired_order),
 				   __ATOMIC_RELAXED);
@@ -322,7 +322,7 @@ static struct page *zone_alloc(struct zone *zone, unsigned int desired_order)
 	while (++order < BUDDY_ORDERS && TAILQ_EMPTY(&zone->orders[order])) {
 	}
 	if (unlikely(order >= BUDDY_ORDERS)) {
-		spinlock_unlock(&zone->zone_lock, ipl);
+		qspinlock_unlock(&zone->zone_lock, ipl);
 		return NULL;
 	}
 
@@ -347,7 +347,7 @@ static struct page *zone_alloc(struct zone *zone, unsigned int desired_order)
 
 	zone_validate(zone);
 
-	spinlock_unlock(&zone->zone_lock, ipl);
+	qspinlock_unlock(&zone->zone_lock, ipl);
 	__atomic_fetch_sub(&free_pagecnt, (1 << desired_order),
 			   __ATOMIC_RELAXED);
 
@@ -359,7 +359,7 @@ static void zone_free(struct zone *zone, struct page *page, unsigned int order)
 	assert(page);
 	assert(order < BUDDY_ORDERS);
 
-	ipl_t ipl = spinlock_lock(&zone->zone_lock);
+	ipl_t ipl = qspinlock_lock(&zone->zone_lock);
 	zone_validate(zone);
 
 	assert(page->shares == 0);
@@ -424,7 +424,7 @@ valid:
 
 	zone_validate(zone);
 
-	spinlock_unlock(&zone->zone_lock, ipl);
+	qspinlock_unlock(&zone->zone_lock, ipl);
 	__atomic_fetch_add(&free_pagecnt, (1 << initial_order),
 			   __ATOMIC_RELAXED);
 }